@@ -1,6 +1,7 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include "cpuapi.h"
 #include "instruction.h"
 #include "util.h"
 #include <stdint.h>
@@ -187,22 +188,91 @@ enum {
     INTERRUPT_TYPE_HARDWARE // i.e. IRQ8
 };
 
-#define TRACE_INFO_ENTRIES (64 * 1024) // TODO: Enlarge?
-#define TRACE_CACHE_SIZE (TRACE_INFO_ENTRIES * 8) // TODO: Enlarge?
-#define MAX_TRACE_SIZE 32
-
-#define MAX_TLB_ENTRIES 8192
+// Default cache sizes. All of them can be changed at runtime with cpu_set_cache_config
+#define DEFAULT_TRACE_INFO_ENTRIES (64 * 1024)
+#define DEFAULT_TRACE_CACHE_SIZE (DEFAULT_TRACE_INFO_ENTRIES * 8)
+#define DEFAULT_MAX_TRACE_SIZE 32
+#define DEFAULT_TLB_ENTRIES 8192
+// Upper limit on the number of instructions in a trace, since it has to fit in TRACE_INSNS
+#define MAX_TRACE_SIZE 63
+
+// The trace index is set associative. Each physical address can be stored in one of TRACE_WAYS entries
+#define TRACE_WAYS 4
+// The trace cache is split into regions that are filled one after another. When we run out of space, only the oldest
+// region is evicted, instead of the whole trace cache.
+#define TRACE_REGIONS 8
+// Every combination of STATE_CODE16 and STATE_ADDR16 gets its own partition of the trace index, so the same code can
+// stay cached in both 16 and 32-bit mode. The partition is picked when the mode changes, not on every lookup.
+#define TRACE_PARTITIONS 4
+#define TRACE_PARTITION(state_hash) ((state_hash) & (STATE_CODE16 | STATE_ADDR16))
 
 #define TRACE_LENGTH(flags) (flags & 0x3FF)
+#define TRACE_INSNS_SHIFT 10
+#define TRACE_INSNS(flags) (flags >> TRACE_INSNS_SHIFT & 0x3F) // Number of decoded instructions, including the trace terminator
+#define TRACE_REGION_SHIFT 16
+#define TRACE_REGION(flags) (flags >> TRACE_REGION_SHIFT & 0xFF) // Trace cache region that holds the instructions
 struct trace_info {
-    uint32_t phys, state_hash;
+    uint32_t phys;
     struct decoded_instruction* ptr;
     uint32_t flags;
+    // The entry is only valid if this matches the current generation of its trace cache region
+    uint32_t generation;
+    // Cached successors of this trace. These are only hints and must be validated like any other entry before use
+    struct trace_info *taken, *fallthrough;
+    // Links in the list of traces that start in the same physical page, see cpu/smc.c. page_pprev is NULL if the entry
+    // isn't in any list
+    struct trace_info *page_next, **page_pprev;
 #ifdef DYNAREC
     uint32_t calls; // Used by the dynamic recompiler to determine whether the block should be compiled
 #endif
 };
 
+// Number of page directory entries that the page walker remembers, see cpu/mmu.c. Must be a power of two
+#define PDE_CACHE_SIZE 256
+struct pde_cache_entry {
+    uint32_t tag; // CR3 and paging mode the entry was read with, or 0 if the entry is unused
+    uint32_t region; // Linear address >> 21 with PAE, or >> 22 without
+    uint32_t pdpte_addr, pde_addr; // Physical addresses that the entry depends on. pdpte_addr is -1 without PAE
+    uint32_t pdpte, pde, pde2;
+};
+
+// The TLB is split into tables that each cover 4 MB of the linear address space, and only the tables for regions that
+// are in use are allocated. Every other slot of cpu.tlb_dir points to a shared table of invalid entries, so lookups
+// don't have to check for missing tables. All of the macros take a linear page number.
+#define TLB_TABLE_SHIFT 10
+#define TLB_TABLE_ENTRIES (1 << TLB_TABLE_SHIFT)
+struct tlb_table {
+    void* ptr[TLB_TABLE_ENTRIES]; // Host pointer minus the linear address of the page
+    uint8_t tags[TLB_TABLE_ENTRIES];
+#define TLB_ATTR_NX 1
+#define TLB_ATTR_NON_GLOBAL 2
+    // Interesting information on TLB
+    uint8_t attrs[TLB_TABLE_ENTRIES];
+};
+#define TLB_PTR(page) (cpu.tlb_dir[(page) >> TLB_TABLE_SHIFT]->ptr[(page) & (TLB_TABLE_ENTRIES - 1)])
+#define TLB_TAGS(page) (cpu.tlb_dir[(page) >> TLB_TABLE_SHIFT]->tags[(page) & (TLB_TABLE_ENTRIES - 1)])
+#define TLB_ATTRS(page) (cpu.tlb_dir[(page) >> TLB_TABLE_SHIFT]->attrs[(page) & (TLB_TABLE_ENTRIES - 1)])
+
+// Paging structure entries that a TLB entry was built from, so that it can be checked against the page tables again
+// before it is reused. Addresses are -1 if the level wasn't used, and pde_addr is -1 if the entry can't be checked.
+struct tlb_source {
+    uint32_t phys;
+    uint32_t pdpte_addr, pde_addr, pte_addr;
+    uint32_t pdpte, pde, pde2, pte;
+};
+struct tlb_saved_entry {
+    void* ptr; // Value of TLB_PTR
+    uint32_t entry;
+    uint8_t tags, attrs;
+    struct tlb_source src;
+};
+// Non-global TLB entries of an address space that the CPU has switched away from, see cpu_mmu_tlb_switch
+#define TLB_CONTEXTS 4
+struct tlb_context {
+    uint32_t cr3, count, age;
+    struct tlb_saved_entry* entries; // Holds up to max_tlb_entries entries
+};
+
 struct cpu {
     // <<< BEGIN STRUCT "struct" >>>
     /// ignore: mem
@@ -355,32 +425,77 @@ struct cpu {
 
     uint32_t smc_has_code_length;
     uint32_t* smc_has_code;
+    // Head of the list of traces that start in each physical page
+    struct trace_info** smc_traces;
+#ifdef SMC_PROTECT
+    // Set if code pages are write protected on the host, see cpu/smc.c
+    int smc_protect;
+    // Number of pages that the guest has written to since cpu_smc_handle_faults was last called. Set by a signal handler
+    volatile int smc_faults;
+#endif
 
-    uint32_t tlb_entry_count;
-    uint32_t tlb_entry_indexes[MAX_TLB_ENTRIES];
-
-    // TLB entries plus tags
-    uint8_t tlb_tags[1 << 20];
-#define TLB_ATTR_NX 1
-#define TLB_ATTR_NON_GLOBAL 2
-    // Interesting information on TLB
-    uint8_t tlb_attrs[1 << 20];
-    void* tlb[1 << 20];
+    uint32_t tlb_entry_count, max_tlb_entries;
+    uint32_t* tlb_entry_indexes;
+    // Parallel to tlb_entry_indexes
+    struct tlb_source* tlb_entry_sources;
+    struct tlb_context tlb_contexts[TLB_CONTEXTS];
+    uint32_t tlb_context_age;
+
+    // Page directory entries read by cpu_mmu_translate, and the number of them that came from each physical page
+    struct pde_cache_entry pde_cache[PDE_CACHE_SIZE];
+    uint16_t* pde_cache_refs;
+
+    // Device memory mapped into the physical address space with cpu_map_device_ram, and a bitmap of the pages in it
+    // that were written since the last call to cpu_get_device_ram_dirty
+    uint8_t* devram;
+    uint32_t devram_base, devram_size;
+    uint32_t* devram_dirty;
+    // TLB entries that were made writable by cpu_mmu_devram_write, and have to be write protected again once their
+    // pages are no longer dirty
+    uint32_t* devram_writable;
+    uint32_t devram_writable_count;
+
+    // TLB entries plus tags, see struct tlb_table
+    struct tlb_table* tlb_dir[1 << (20 - TLB_TABLE_SHIFT)];
+
+    // Trace that cpu_get_trace most recently returned, or NULL if it was not cached. Used for trace chaining
+    struct trace_info* current_trace;
+
+    // Region of the trace cache that new traces are being decoded into
+    int trace_region;
+    // Each region gets a new generation number whenever it is reused, which invalidates all of the traces inside of it
+    uint32_t trace_generation;
+    uint32_t trace_region_generation[TRACE_REGIONS];
+
+    // Partition of cpu.trace_info that belongs to the current state hash
+    struct trace_info* trace_partition;
+
+    // Trace cache geometry, see cpu_set_cache_config. trace_info_entries is the size of a single partition
+    uint32_t trace_info_entries, trace_sets, trace_cache_size, trace_region_size;
+    int max_trace_size;
+
+    // Trace cache and TLB statistics
+    struct cpu_cache_stats stats;
 
     // Actual trace cache
-    struct decoded_instruction trace_cache[TRACE_CACHE_SIZE];
-    struct trace_info trace_info[TRACE_INFO_ENTRIES];
+    struct decoded_instruction* trace_cache;
+    struct trace_info* trace_info;
 };
 extern struct cpu cpu;
 
+// Checks if the trace cache region that holds the trace has been reused since the trace was decoded
+#define TRACE_VALID(trace) ((trace)->generation == cpu.trace_region_generation[TRACE_REGION((trace)->flags)])
+
 #define MEM32(e) *(uint32_t*)(cpu.mem + e)
 #define MEM16(e) *(uint16_t*)(cpu.mem + e)
 #ifdef LIBCPU
 uint32_t cpulib_ptr_to_phys(void*);
 #define PTR_TO_PHYS(ptr) cpulib_ptr_to_phys(ptr)
 #else
-// Converts pointer to a physical address
-#define PTR_TO_PHYS(ptr) (uint32_t)(uintptr_t)((void*)ptr - cpu.mem)
+// Converts pointer to a physical address. Pointers into device memory are relative to where it is mapped
+#define PTR_TO_PHYS(ptr) ((uintptr_t)(ptr) - (uintptr_t)cpu.devram < cpu.devram_size \
+        ? cpu.devram_base + (uint32_t)((uintptr_t)(ptr) - (uintptr_t)cpu.devram)     \
+        : (uint32_t)(uintptr_t)((void*)ptr - cpu.mem))
 #endif
 
 // Based on the linear address, the TLB tag for this entry, and the shift for the current mode
@@ -442,66 +557,66 @@ uint32_t cpulib_ptr_to_phys(void*);
 
 #define cpu_read8(linaddr, dest, shift)                                            \
     do {                                                                           \
-        uint32_t addr_ = linaddr, shift_ = shift, tag = cpu.tlb_tags[addr_ >> 12]; \
+        uint32_t addr_ = linaddr, shift_ = shift, tag = TLB_TAGS(addr_ >> 12);     \
         if (TLB_ENTRY_INVALID8(addr_, tag, shift_)) {                              \
             if (!cpu_access_read8(addr_, tag >> shift, shift))                     \
                 dest = cpu.read_result;                                            \
             else                                                                   \
                 EXCEPTION_HANDLER;                                                 \
         } else                                                                     \
-            dest = *(uint8_t*)(cpu.tlb[addr_ >> 12] + addr_);                      \
+            dest = *(uint8_t*)(TLB_PTR(addr_ >> 12) + addr_);                      \
     } while (0)
 #define cpu_read16(linaddr, dest, shift)                                           \
     do {                                                                           \
-        uint32_t addr_ = linaddr, shift_ = shift, tag = cpu.tlb_tags[addr_ >> 12]; \
+        uint32_t addr_ = linaddr, shift_ = shift, tag = TLB_TAGS(addr_ >> 12);     \
         if (TLB_ENTRY_INVALID16(addr_, tag, shift_)) {                             \
             if (!cpu_access_read16(addr_, tag >> shift, shift))                    \
                 dest = cpu.read_result;                                            \
             else                                                                   \
                 EXCEPTION_HANDLER;                                                 \
         } else                                                                     \
-            dest = *(uint16_t*)(cpu.tlb[addr_ >> 12] + addr_);                     \
+            dest = *(uint16_t*)(TLB_PTR(addr_ >> 12) + addr_);                     \
     } while (0)
 #define cpu_read32(linaddr, dest, shift)                                           \
     do {                                                                           \
-        uint32_t addr_ = linaddr, shift_ = shift, tag = cpu.tlb_tags[addr_ >> 12]; \
+        uint32_t addr_ = linaddr, shift_ = shift, tag = TLB_TAGS(addr_ >> 12);     \
         if (TLB_ENTRY_INVALID32(addr_, tag, shift_)) {                             \
             if (!cpu_access_read32(addr_, tag >> shift, shift))                    \
                 dest = cpu.read_result;                                            \
             else                                                                   \
                 EXCEPTION_HANDLER;                                                 \
         } else                                                                     \
-            dest = *(uint32_t*)(cpu.tlb[addr_ >> 12] + addr_);                     \
+            dest = *(uint32_t*)(TLB_PTR(addr_ >> 12) + addr_);                     \
     } while (0)
 #define cpu_write8(linaddr, data, shift)                              \
     do {                                                              \
         uint32_t addr_ = linaddr, shift_ = shift, data_ = data,       \
-                 tag = cpu.tlb_tags[addr_ >> 12];                     \
+                 tag = TLB_TAGS(addr_ >> 12);                         \
         if (TLB_ENTRY_INVALID8(addr_, tag, shift_)) {                 \
             if (cpu_access_write8(addr_, data_, tag >> shift, shift)) \
                 EXCEPTION_HANDLER;                                    \
         } else                                                        \
-            *(uint8_t*)(cpu.tlb[addr_ >> 12] + addr_) = data_;        \
+            *(uint8_t*)(TLB_PTR(addr_ >> 12) + addr_) = data_;        \
     } while (0)
 #define cpu_write16(linaddr, data, shift)                              \
     do {                                                               \
         uint32_t addr_ = linaddr, shift_ = shift, data_ = data,        \
-                 tag = cpu.tlb_tags[addr_ >> 12];                      \
+                 tag = TLB_TAGS(addr_ >> 12);                          \
         if (TLB_ENTRY_INVALID16(addr_, tag, shift_)) {                 \
             if (cpu_access_write16(addr_, data_, tag >> shift, shift)) \
                 EXCEPTION_HANDLER;                                     \
         } else                                                         \
-            *(uint16_t*)(cpu.tlb[addr_ >> 12] + addr_) = data_;        \
+            *(uint16_t*)(TLB_PTR(addr_ >> 12) + addr_) = data_;        \
     } while (0)
 #define cpu_write32(linaddr, data, shift)                              \
     do {                                                               \
         uint32_t addr_ = linaddr, shift_ = shift, data_ = data,        \
-                 tag = cpu.tlb_tags[addr_ >> 12];                      \
+                 tag = TLB_TAGS(addr_ >> 12);                          \
         if (TLB_ENTRY_INVALID32(addr_, tag, shift_)) {                 \
             if (cpu_access_write32(addr_, data_, tag >> shift, shift)) \
                 EXCEPTION_HANDLER;                                     \
         } else                                                         \
-            *(uint32_t*)(cpu.tlb[addr_ >> 12] + addr_) = data_;        \
+            *(uint32_t*)(TLB_PTR(addr_ >> 12) + addr_) = data_;        \
     } while (0)
 
 // Macros to help with segmentation
@@ -526,6 +641,10 @@ uint32_t cpulib_ptr_to_phys(void*);
 
 // decoder.c
 int cpu_decode(struct trace_info* info, struct decoded_instruction* i);
+#ifdef CPU_BENCH
+// Turns macro-op fusion on or off. Only built for tools/cpubench.c
+void cpu_set_fusion(int enabled);
+#endif
 
 // General execution
 void cpu_execute(void);
@@ -567,20 +686,41 @@ int cpu_load_csip_protected(uint16_t cs, struct seg_desc* info, uint32_t eip);
 // smc.c
 int cpu_smc_page_has_code(uint32_t phys);
 int cpu_smc_has_code(uint32_t phys);
-void cpu_smc_invalidate(uint32_t lin, uint32_t phys);
+void cpu_smc_invalidate(uint32_t lin, uint32_t phys, int length);
 void cpu_smc_invalidate_page(uint32_t phys);
 void cpu_smc_set_code(uint32_t phys);
+void cpu_smc_add_trace(struct trace_info* info);
+void cpu_smc_remove_trace(struct trace_info* info);
+void cpu_smc_clear_traces(void);
+void cpu_smc_clear_pages(void);
+#ifdef SMC_PROTECT
+void* cpu_smc_init_mem(uint32_t size);
+void cpu_smc_handle_faults(void);
+#endif
 
 // mmu.c
 void cpu_mmu_tlb_flush(void);
-void cpu_mmu_tlb_flush_nonglobal(void);
+void cpu_mmu_tlb_reset(void);
+void cpu_mmu_tlb_switch(uint32_t old_cr3);
 int cpu_mmu_translate(uint32_t lin, int shift);
 void cpu_mmu_tlb_invalidate(uint32_t lin);
+void cpu_mmu_pde_cache_flush(void);
+void cpu_mmu_pde_write(uint32_t phys, uint32_t length);
+void cpu_mmu_devram_write(uint32_t lin, uint32_t phys);
 
 // trace.c
-struct trace_info* cpu_trace_get_entry(uint32_t phys);
 struct decoded_instruction* cpu_get_trace(void);
 void cpu_trace_flush(void);
+void cpu_trace_select_partition(void);
+
+#ifdef DYNAREC
+// jit.c
+#define JIT_THRESHOLD 64 // Number of times a trace has to be looked up before it is compiled
+void cpu_jit_init(void);
+void cpu_jit_flush(void);
+void cpu_jit_reset(void);
+void cpu_jit_compile(struct trace_info* info);
+#endif
 
 // eflags.c
 int cpu_get_of(void);
@@ -59,6 +59,8 @@ struct fpu {
 #ifdef FLOATX80
     float_status_t status;
 #endif
+    // Precision (24 or 53) that basic arithmetic can be computed at on the host, or 0 if it has to use softfloat
+    int fast_precision;
 };
 extern struct fpu fpu;
 #endif
@@ -43,7 +43,22 @@ typedef __insn_t* (*insn_handler_t)(__insn_t*);
 #define I_SET_OP(i, j) i |= (j) << I_OP_SHIFT
 #define I_SET_SEG_BASE(i, j) i |= (j) << I_SEG_SHIFT
 
-// Represents one decoded CPU instruction. Takes up 16 bytes on 32-bit, 20 bytes (padded out to 24 bytes) on 64-bit
+// Handlers are stored as 32-bit offsets from op_trace_end instead of full pointers, which keeps struct
+// decoded_instruction at 16 bytes (four instructions per cache line) on 64-bit hosts. Every handler, as well as code
+// generated by the dynamic recompiler, must be within 2 GB of op_trace_end. Define HANDLER_POINTERS to store full
+// pointers instead (24 bytes on 64-bit hosts), which tools/cpubench.c uses to compare the two layouts.
+#ifdef HANDLER_POINTERS
+#define I_HANDLER(i) ((i)->handler)
+#define I_SET_HANDLER(i, h) ((i)->handler = (insn_handler_t)(h))
+#else
+__insn_t* op_trace_end(__insn_t* i);
+#define I_HANDLER_BASE ((uintptr_t)op_trace_end)
+#define I_HANDLER(i) ((insn_handler_t)(I_HANDLER_BASE + (intptr_t)(i)->handler))
+#define I_SET_HANDLER(i, h) ((i)->handler = (int32_t)((uintptr_t)(h)-I_HANDLER_BASE))
+#endif
+
+// Represents one decoded CPU instruction. Takes up 16 bytes on both 32-bit and 64-bit hosts, unless HANDLER_POINTERS is
+// defined
 struct decoded_instruction {
     // Various flags holding x86 instruction operands like effective address, length, and source/dest
     uint32_t flags;
@@ -66,7 +81,12 @@ struct decoded_instruction {
         int8_t disp8s;
     };
 
+    // Use I_HANDLER and I_SET_HANDLER to access this
+#ifdef HANDLER_POINTERS
     insn_handler_t handler;
+#else
+    int32_t handler; // Offset from I_HANDLER_BASE
+#endif
 };
 
 #endif
\ No newline at end of file
@@ -50,6 +50,12 @@ OPTYPE op_arith_r32i32(struct decoded_instruction* i);
 OPTYPE op_arith_r32e32(struct decoded_instruction* i);
 OPTYPE op_arith_e32r32(struct decoded_instruction* i);
 OPTYPE op_arith_e32i32(struct decoded_instruction* i);
+OPTYPE op_arith_r8r8_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r8i8_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r16r16_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r16i16_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r32r32_nf(struct decoded_instruction* i);
+OPTYPE op_arith_r32i32_nf(struct decoded_instruction* i);
 
 OPTYPE op_shift_r8cl(struct decoded_instruction* i);
 OPTYPE op_shift_r8i8(struct decoded_instruction* i);
@@ -108,6 +114,12 @@ OPTYPE op_dec_r16(struct decoded_instruction* i);
 OPTYPE op_dec_e16(struct decoded_instruction* i);
 OPTYPE op_dec_r32(struct decoded_instruction* i);
 OPTYPE op_dec_e32(struct decoded_instruction* i);
+OPTYPE op_inc_r8_nf(struct decoded_instruction* i);
+OPTYPE op_inc_r16_nf(struct decoded_instruction* i);
+OPTYPE op_inc_r32_nf(struct decoded_instruction* i);
+OPTYPE op_dec_r8_nf(struct decoded_instruction* i);
+OPTYPE op_dec_r16_nf(struct decoded_instruction* i);
+OPTYPE op_dec_r32_nf(struct decoded_instruction* i);
 
 OPTYPE op_not_r8(struct decoded_instruction* i);
 OPTYPE op_not_e8(struct decoded_instruction* i);
@@ -212,6 +224,7 @@ OPTYPE op_jle32(struct decoded_instruction* i);
 OPTYPE op_jnle16(struct decoded_instruction* i);
 OPTYPE op_jnle32(struct decoded_instruction* i);
 // <<< END AUTOGENERATE "jcc" >>>
+OPTYPE op_dec_r32_jnz32(struct decoded_instruction* i);
 
 OPTYPE op_call_j16(struct decoded_instruction* i);
 OPTYPE op_call_j32(struct decoded_instruction* i);
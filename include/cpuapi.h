@@ -31,8 +31,63 @@ struct cpu_config
     struct cpuid_level_info features[FEATURE_SIZE_MAX];
 };
 
+// Sizes of the internal caches of the CPU. Fields that are zero are set to their default values.
+struct cpu_cache_config
+{
+    int trace_info_entries; // Number of traces that can be indexed at once for each code/address size. Rounded up to a power of two
+    int trace_cache_size; // Number of decoded instructions that the trace cache can hold
+    int max_trace_size; // Maximum number of instructions per trace, up to 63
+    int tlb_entries; // Number of TLB entries that can be filled before the whole TLB is flushed
+};
+
+struct cpu_cache_stats
+{
+    // Trace cache lookups, and the number of them that were satisfied by a trace's successor links
+    uint64_t trace_hits, trace_link_hits, trace_misses;
+    // Number of times the whole trace cache was thrown away, and the number of times a single region was evicted
+    uint64_t trace_flushes, trace_evictions;
+    // TLB entries filled in by the page walker, full and non-global TLB flushes, and flushes caused by a full TLB
+    uint64_t tlb_fills, tlb_flushes, tlb_nonglobal_flushes, tlb_full_flushes;
+    // Page walks that found their page directory entry in the cache, and the ones that had to read it from memory
+    uint64_t pde_cache_hits, pde_cache_misses;
+    // CR3 loads that found the TLB entries of the new address space saved from an earlier switch, and the number of
+    // entries that were still valid and put back into the TLB
+    uint64_t tlb_context_hits, tlb_context_restores;
+
+    // Current occupancy. These are filled in by cpu_get_cache_stats
+    uint32_t trace_cache_usage, trace_cache_size, tlb_entry_count, tlb_entries;
+};
+
+// x87 operations that can be computed on host floating point, see cpu_set_fpu_fast_mode
+enum {
+    FPU_STAT_FADD,
+    FPU_STAT_FMUL,
+    FPU_STAT_FSUB,
+    FPU_STAT_FSUBR,
+    FPU_STAT_FDIV,
+    FPU_STAT_FDIVR,
+    FPU_STAT_FSQRT,
+    FPU_STAT_OPS
+};
+
+struct cpu_fpu_stats
+{
+    // Number of times each operation was computed on the host, and the number of times it went through softfloat
+    uint64_t fast[FPU_STAT_OPS], softfloat[FPU_STAT_OPS];
+};
+
 int cpu_init(void);
 void cpu_reset(void);
+// Reallocates the trace cache and TLB bookkeeping using the given sizes. cfg can be NULL to use the defaults.
+int cpu_set_cache_config(struct cpu_cache_config* cfg);
+void cpu_get_cache_stats(struct cpu_cache_stats* stats);
+void cpu_reset_cache_stats(void);
+// Lets FADD, FMUL, FSUB(R), FDIV(R) and FSQRT run on host floats/doubles while the control word selects 24 or 53-bit
+// precision, rounds to nearest, and masks every exception. Operands or results that softfloat would treat specially
+// (denormals, infinities, NaNs, anything that overflows or underflows the host format) still go through softfloat.
+void cpu_set_fpu_fast_mode(int enabled);
+void cpu_get_fpu_stats(struct cpu_fpu_stats* stats);
+void cpu_reset_fpu_stats(void);
 int cpu_init_mem(int size);
 int cpu_add_rom(int addr, int size, void *data);
 int cpu_set_cpuid(struct cpu_config *cfg);
@@ -81,6 +136,17 @@ void *cpu_get_ram_ptr(void);
 
 void cpu_write_mem(uint32_t addr, void* data, uint32_t length);
 void cpu_init_dma(uint32_t page);
+// Returns a pointer that a device can use to transfer length bytes to or from guest RAM at addr directly. Code and page
+// directory entries cached from the range are invalidated, as if cpu_init_dma had been called for each page. Returns
+// NULL if the range is not entirely in RAM, in which case the device has to use cpu_write_mem.
+void* cpu_get_dma_ptr(uint32_t addr, uint32_t length);
+
+// Maps device memory, such as a linear framebuffer, at a physical address so that the CPU accesses it directly instead
+// of going through the MMIO handlers registered there. Only whole pages are mapped. Pass NULL to remove the mapping.
+void cpu_map_device_ram(uint32_t base, uint32_t size, void* ptr);
+// Copies a bitmap of the device memory pages that the CPU wrote to since the last call into dirty (one bit per page),
+// and clears it. Returns nonzero if any page was written.
+int cpu_get_device_ram_dirty(uint32_t* dirty);
 
 // Is there an APIC connected to the CPU in some way??
 int cpu_apic_connected(void);
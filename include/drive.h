@@ -32,6 +32,16 @@ typedef int (*drive_read_func)(void* this, void* cb_ptr, void* buffer, uint32_t
 typedef int (*drive_write_func)(void* this, void* cb_ptr, void* buffer, uint32_t size, drv_offset_t offset, drive_cb cb);
 typedef int (*drive_prefetch_func)(void* this, void* cb_ptr, uint32_t size, drv_offset_t offset, drive_cb cb);
 
+// One buffer of a vectored request
+struct drive_iovec {
+    void* buffer;
+    uint32_t length;
+};
+// Vectored versions of read and write that transfer consecutive bytes of the image to or from several buffers. They are
+// only used on data that has already been prefetched, so they always complete synchronously.
+typedef int (*drive_readv_func)(void* this, struct drive_iovec* iov, int iovcnt, drv_offset_t offset);
+typedef int (*drive_writev_func)(void* this, struct drive_iovec* iov, int iovcnt, drv_offset_t offset);
+
 struct drive_info {
     // Mostly a collection of functions
     int type; // from enum above
@@ -43,6 +53,8 @@ struct drive_info {
 
     // Modify backing image file?
     int modify_backing_file;
+    // Most memory, in bytes, that the sync and async drivers use to cache blocks. 0 means no limit
+    uint32_t cache_size;
 
     void* data; // Some internal to the current disk driver (file descriptors, etc.)
     int driver;
@@ -50,6 +62,8 @@ struct drive_info {
     drive_read_func read;
     drive_write_func write;
     drive_prefetch_func prefetch;
+    drive_readv_func readv;
+    drive_writev_func writev;
 
     void (*state)(void* this, char* path);
 };
@@ -66,11 +80,14 @@ int drive_init(struct drive_info* info, char* path);
 
 int drive_sync_init(struct drive_info* info, char* path);
 int drive_async_init(struct drive_info* info, char* path);
+int drive_mmap_init(struct drive_info* info, char* path);
 int drive_simple_init(struct drive_info* info, char* path);
 
 int drive_read(struct drive_info*, void*, void*, uint32_t, drv_offset_t, drive_cb);
 int drive_write(struct drive_info*, void*, void*, uint32_t, drv_offset_t, drive_cb);
 int drive_prefetch(struct drive_info*, void*, uint32_t, drv_offset_t, drive_cb);
+int drive_readv(struct drive_info*, struct drive_iovec*, int, drv_offset_t);
+int drive_writev(struct drive_info*, struct drive_iovec*, int, drv_offset_t);
 
 // Cancel transfers in progress
 void drive_cancel_transfers(void);
@@ -27,6 +27,7 @@ void io_writed(uint32_t port, uint32_t data);
 void io_handle_mmio_write(uint32_t addr, uint32_t data, int size);
 uint32_t io_handle_mmio_read(uint32_t addr, int size);
 int io_addr_mmio_read(uint32_t addr);
+void io_mmio_debug(void);
 
 void io_init(void);
 
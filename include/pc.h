@@ -89,6 +89,12 @@ struct pc_settings {
 
     struct cpu_config cpu;
 
+    // Trace cache and TLB sizes. Zero means that the CPU's default is used.
+    struct cpu_cache_config cpu_cache;
+
+    // Run x87 arithmetic on host doubles when the guest uses reduced precision, see cpu_set_fpu_fast_mode
+    int fpu_fast;
+
     struct virtio_cfg virtio[MAX_VIRTIO_DEVICES];
 
     int boot_kernel;
@@ -0,0 +1,39 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+// Everything that the CPU got from devices while a recording was running. src/record.c writes these to a file called
+// "events" in the savestate directory, and tools/cpubench.c plays them back.
+
+#define RECORD_MAGIC 0x52434448 // "HDCR"
+
+enum {
+    RECORD_IO_READ, // An IN instruction read "data" from port "addr"
+    RECORD_MMIO_READ, // The CPU read "data" from a memory mapped device at "addr"
+    RECORD_INTERRUPT, // A hardware interrupt with vector "data" was raised
+    RECORD_DMA, // A device wrote "data" bytes to RAM at "addr". The bytes follow the event in the file
+    RECORD_A20 // The A20 gate was set to "data"
+};
+
+struct record_header {
+    uint32_t magic;
+    uint32_t apic_enabled;
+};
+
+struct record_event {
+    uint64_t cycles; // cpu_get_cycles() at the time of the event
+    uint32_t phys_eip; // Lets the replay check that it is still running the same code
+    uint8_t type;
+    uint8_t size; // Size of an I/O read in bytes. For memory mapped reads, the size argument to io_handle_mmio_read
+    uint16_t unused;
+    uint32_t addr;
+    uint32_t data;
+};
+
+// Starts writing events to the savestate directory at the given path
+void record_start(char* path);
+// Called by io_handle_mmio_read, since memory mapped reads have no instrumentation callback
+void record_mmio_read(uint32_t addr, uint32_t data, int size);
+
+#endif
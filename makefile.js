@@ -36,7 +36,7 @@ var end_flags = [], fincc_flags = [];
 // -D_REENTRANT".split(" "));
 // flags.push.apply(flags, "-L/usr/lib/x86_64-linux-gnu -lSDL -lSDLmain".split("
 // "));
-end_flags = "-lSDL -lSDLmain -lm -lz".split(" ");
+end_flags = "-lSDL -lSDLmain -lm -lz -lpthread".split(" ");
 
 if (os.endianness() === "BE") {
     console.warn("WARNING: This emulator has not been tested on big-endian platforms and may not work.");
@@ -87,6 +87,7 @@ for (var i = 0; i < argv.length; i++) {
             break;
         case "win32":
             build_type = "win32";
+            end_flags.splice(end_flags.indexOf("-lpthread"), 1);
             end_flags.push("-lgdi32", "-lcomdlg32");
             break;
         case "libcpu":
@@ -126,6 +127,16 @@ for (var i = 0; i < argv.length; i++) {
         case "--instrument":
             flags.push("-DINSTRUMENT");
             break;
+        case "--record":
+            // src/record.c provides the instrumentation callbacks
+            flags.push("-DINSTRUMENT", "-DRECORD");
+            break;
+        case "--enable-dynarec":
+            flags.push("-DDYNAREC");
+            break;
+        case "--enable-smc-protect":
+            flags.push("-DSMC_PROTECT");
+            break;
         case "--profile":
             end_flags.push("-pg");
             break;
@@ -176,6 +187,9 @@ for (var i = 0; i < argv.length; i++) {
             console.log(" --output [path]            Set output file to path");
             console.log(
                 " --instrument               Enable instrumentation callbacks");
+            console.log(" --record                   Record device input for tools/cpubench.c (implies --instrument)");
+            console.log(" --enable-dynarec           Compile hot traces to x86-64 code");
+            console.log(" --enable-smc-protect       Detect self-modifying code with host page protection");
             console.log(" --profile                  Compile with -pg");
             console.log(" --disable-debug            Compile without debugging information");
             console.log(" --enable-wasm              Compile for WASM target");
@@ -216,6 +230,7 @@ if (result.indexOf(".js") !== -1 && build_type == "libcpu") {
 if (result.indexOf(".js") !== -1 || result.indexOf(".wasm") !== -1) {
     end_flags.splice(end_flags.indexOf("-lSDLmain"), 1);
     end_flags.splice(end_flags.indexOf("-lz"), 1);
+    end_flags.splice(end_flags.indexOf("-lpthread"), 1);
 }
 flags.push("-D" + build_type.toUpperCase() + "_BUILD");
 
@@ -262,6 +277,9 @@ function find_file_append() {
     if (flags.indexOf("-O") !== -1) id |= 256;
     if (flags.indexOf("-DLIBCPU") !== -1) id |= 512;
     if (flags.indexOf("SIDE_MODULE=1") !== -1) id |= 1024;
+    if (flags.indexOf("-DDYNAREC") !== -1) id |= 0x40000000;
+    if (flags.indexOf("-DSMC_PROTECT") !== -1) id |= 0x20000000;
+    if (flags.indexOf("-DRECORD") !== -1) id |= 0x10000000;
 
     // Hash the name of the build
     var x = 0;
@@ -7,9 +7,9 @@ int cpu_access_read8(uint32_t addr, uint32_t tag, int shift)
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr >> 12) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr >> 12) + addr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     // Check for MMIO areas
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
@@ -19,28 +19,58 @@ int cpu_access_read8(uint32_t addr, uint32_t tag, int shift)
     cpu.read_result = *(uint8_t*)host_ptr;
     return 0;
 }
-int cpu_access_read16(uint32_t addr, uint32_t tag, int shift)
+// Makes sure that both pages touched by an access that crosses a page boundary are translated, so that a fault on the
+// second page is raised before anything is done to the first one
+static int access_translate_split(uint32_t addr, uint32_t end, int shift)
 {
-    // Split across page boundaries.
-    if (addr & 1) {
-        uint32_t res = 0;
-        for (int i = 0, j = 0; i < 2; i++, j += 8) {
-            if (cpu_access_read8(addr + i, cpu.tlb_tags[(addr + i) >> 12] >> shift, shift))
-                return 1;
-            res |= cpu.read_result << j;
-        }
-        cpu.read_result = res;
-        return 0;
+    if ((TLB_TAGS(end >> 12) >> shift & 2) && cpu_mmu_translate(end, shift))
+        return 1;
+    // Filling in the second entry flushes the first one if the TLB was full
+    if ((TLB_TAGS(addr >> 12) >> shift & 2) && cpu_mmu_translate(addr, shift))
+        return 1;
+    return 0;
+}
+
+// Unaligned accesses are only split up into bytes if they cross a page or touch MMIO, since devices expect aligned
+// accesses. Anything else is done with a single host load or store.
+static int access_read_bytes(uint32_t addr, int size, int shift)
+{
+    uint32_t res = 0;
+    for (int i = 0, j = 0; i < size; i++, j += 8) {
+        if (cpu_access_read8(addr + i, TLB_TAGS((addr + i) >> 12) >> shift, shift))
+            return 1;
+        res |= cpu.read_result << j;
     }
+    cpu.read_result = res;
+    return 0;
+}
+static int access_write_bytes(uint32_t addr, uint32_t data, int size, int shift)
+{
+    for (int i = 0, j = 0; i < size; i++, j += 8) {
+        if (cpu_access_write8(addr + i, data >> j, TLB_TAGS((addr + i) >> 12) >> shift, shift))
+            return 1;
+    }
+    return 0;
+}
 
+int cpu_access_read16(uint32_t addr, uint32_t tag, int shift)
+{
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr >> 12) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    // Split across page boundaries.
+    if ((addr & 0xFFF) == 0xFFF) {
+        if (access_translate_split(addr, addr + 1, shift))
+            return 1;
+        return access_read_bytes(addr, 2, shift);
+    }
+    void* host_ptr = TLB_PTR(addr >> 12) + addr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
+        if (addr & 1)
+            return access_read_bytes(addr, 2, shift);
         cpu.read_result = io_handle_mmio_read(phys, 1);
         return 0;
     }
@@ -49,25 +79,21 @@ int cpu_access_read16(uint32_t addr, uint32_t tag, int shift)
 }
 int cpu_access_read32(uint32_t addr, uint32_t tag, int shift)
 {
-    if (addr & 3) {
-        uint32_t res = 0;
-        for (int i = 0, j = 0; i < 4; i++, j += 8) {
-            if (cpu_access_read8(addr + i, cpu.tlb_tags[(addr + i) >> 12] >> shift, shift))
-                return 1;
-            res |= cpu.read_result << j;
-        }
-        cpu.read_result = res;
-        return 0;
-    }
-
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr >> 12) >> shift;
+    }
+    if ((addr & 0xFFF) > 0xFFC) {
+        if (access_translate_split(addr, addr + 3, shift))
+            return 1;
+        return access_read_bytes(addr, 4, shift);
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr >> 12) + addr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
+        if (addr & 3)
+            return access_read_bytes(addr, 4, shift);
         cpu.read_result = io_handle_mmio_read(phys, 2);
         return 0;
     }
@@ -80,69 +106,86 @@ int cpu_access_write8(uint32_t addr, uint32_t data, uint32_t tag, int shift)
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr >> 12) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr >> 12) + addr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
 
+    if (phys - cpu.devram_base < cpu.devram_size) {
+        cpu_mmu_devram_write(addr, phys);
+        *(uint8_t*)host_ptr = data;
+        return 0;
+    }
     // Check for MMIO areas
     if ((phys >= 0xA0000 && phys < 0x100000) || (phys >= cpu.memory_size)) {
         io_handle_mmio_write(phys, data, 0);
         return 0;
     }
     if (cpu_smc_has_code(phys))
-        cpu_smc_invalidate(addr, phys);
+        cpu_smc_invalidate(addr, phys, 1);
+    cpu_mmu_pde_write(phys, 1);
     *(uint8_t*)host_ptr = data;
     return 0;
 }
 int cpu_access_write16(uint32_t addr, uint32_t data, uint32_t tag, int shift)
 {
-    if (addr & 1) {
-        for (int i = 0, j = 0; i < 2; i++, j += 8) {
-            if (cpu_access_write8(addr + i, data >> j, cpu.tlb_tags[(addr + i) >> 12] >> shift, shift))
-                return 1;
-        }
-        return 0;
-    }
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr >> 12) >> shift;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    if ((addr & 0xFFF) == 0xFFF) {
+        if (access_translate_split(addr, addr + 1, shift))
+            return 1;
+        return access_write_bytes(addr, data, 2, shift);
+    }
+    void* host_ptr = TLB_PTR(addr >> 12) + addr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
+    if (phys - cpu.devram_base < cpu.devram_size) {
+        cpu_mmu_devram_write(addr, phys);
+        *(uint16_t*)host_ptr = data;
+        return 0;
+    }
     if ((phys >= 0xA0000 && phys < 0x100000) || (phys >= cpu.memory_size)) {
+        if (addr & 1)
+            return access_write_bytes(addr, data, 2, shift);
         io_handle_mmio_write(phys, data, 1);
         return 0;
     }
-    if (cpu_smc_has_code(phys))
-        cpu_smc_invalidate(addr, phys);
+    if (cpu_smc_has_code(phys) || cpu_smc_has_code(phys + 1))
+        cpu_smc_invalidate(addr, phys, 2);
+    cpu_mmu_pde_write(phys, 2);
     *(uint16_t*)host_ptr = data;
     return 0;
 }
 int cpu_access_write32(uint32_t addr, uint32_t data, uint32_t tag, int shift)
 {
-    if (addr & 3) {
-        for (int i = 0, j = 0; i < 4; i++, j += 8) {
-            if (cpu_access_write8(addr + i, data >> j, cpu.tlb_tags[(addr + i) >> 12] >> shift, shift))
-                return 1;
-        }
-        return 0;
-    }
-
     if (tag & 2) {
         if (cpu_mmu_translate(addr, shift))
             return 1;
-        tag = cpu.tlb_tags[addr >> 12] >> shift;
+        tag = TLB_TAGS(addr >> 12) >> shift;
+    }
+    if ((addr & 0xFFF) > 0xFFC) {
+        if (access_translate_split(addr, addr + 3, shift))
+            return 1;
+        return access_write_bytes(addr, data, 4, shift);
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr >> 12) + addr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
+    if (phys - cpu.devram_base < cpu.devram_size) {
+        cpu_mmu_devram_write(addr, phys);
+        *(uint32_t*)host_ptr = data;
+        return 0;
+    }
     if ((phys >= 0xA0000 && phys < 0x100000) || (phys >= cpu.memory_size)) {
+        if (addr & 3)
+            return access_write_bytes(addr, data, 4, shift);
         io_handle_mmio_write(phys, data, 2);
         return 0;
     }
-    if (cpu_smc_has_code(phys))
-        cpu_smc_invalidate(addr, phys);
+    if (cpu_smc_has_code(phys) || cpu_smc_has_code(phys + 3))
+        cpu_smc_invalidate(addr, phys, 4);
+    cpu_mmu_pde_write(phys, 4);
     *(uint32_t*)host_ptr = data;
     return 0;
 }
@@ -154,7 +197,7 @@ int cpu_access_verify(uint32_t addr, uint32_t end, int shift)
     uint32_t tag;
     if ((addr ^ end) & ~0xFFF) {
         // Check two pages
-        tag = cpu.tlb_tags[addr >> 12];
+        tag = TLB_TAGS(addr >> 12);
         if (tag & 2) {
             if (cpu_mmu_translate(addr, shift))
                 return 1;
@@ -163,7 +206,7 @@ int cpu_access_verify(uint32_t addr, uint32_t end, int shift)
         end = addr;
 
     // Check the second page, or the first one if it's a single page access
-    tag = cpu.tlb_tags[end >> 12];
+    tag = TLB_TAGS(end >> 12);
     if (tag & 2) {
         if (cpu_mmu_translate(end, shift))
             return 1;
@@ -213,15 +256,15 @@ void readphys(uint32_t lin, int bytes)
 
 uint32_t lin2phys(uint32_t addr)
 {
-    uint8_t tag = cpu.tlb_tags[addr >> 12];
+    uint8_t tag = TLB_TAGS(addr >> 12);
     if (tag & 2) {
         if (cpu_mmu_translate(addr, TLB_SYSTEM_READ)) {
             printf("ERROR TRANSLATING ADDRESS %08x\n", addr);
             return 1;
         }
-        tag = cpu.tlb_tags[addr >> 12] >> TLB_SYSTEM_READ;
+        tag = TLB_TAGS(addr >> 12) >> TLB_SYSTEM_READ;
     }
-    void* host_ptr = cpu.tlb[addr >> 12] + addr;
+    void* host_ptr = TLB_PTR(addr >> 12) + addr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     return phys;
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "cpu/instrument.h"
 #include "cpuapi.h"
 #include "devices.h"
+#include <stdlib.h>
 #include <string.h>
 
 struct cpu cpu;
@@ -24,12 +25,18 @@ void cpu_set_a20(int a20_enabled)
 
 int cpu_init_mem(int size)
 {
+#ifdef SMC_PROTECT
+    cpu.mem = cpu_smc_init_mem(size);
+#else
     cpu.mem = calloc(1, size);
+#endif
     memset(cpu.mem + 0xC0000, -1, 0x40000);
     cpu.memory_size = size;
 
     cpu.smc_has_code_length = (size + 4095) >> 12;
     cpu.smc_has_code = calloc(4, cpu.smc_has_code_length);
+    cpu.smc_traces = calloc(sizeof(struct trace_info*), cpu.smc_has_code_length);
+    cpu.pde_cache_refs = calloc(sizeof(uint16_t), cpu.smc_has_code_length);
 
 // It's possible that instrumentation callbacks will need a physical pointer to RAM
 #ifdef INSTRUMENT
@@ -59,6 +66,11 @@ int cpu_run(int cycles)
     uint64_t begin = cpu_get_cycles();
 
     while (1) {
+#ifdef SMC_PROTECT
+        // Code pages that the guest (or a device) has written to, see cpu/smc.c
+        if (cpu.smc_faults)
+            cpu_smc_handle_faults();
+#endif
         // Check for interrupts
         if (cpu.intr_line_state) {
             // Check for validity
@@ -104,6 +116,7 @@ int cpu_run(int cycles)
     //  - A device requested a fast return
     //  - We have run "cycles" operations.
     // In the case of the former, cpu.hlt_counter will contain the number of cycles still in cpu.cycles_to_run
+    // A fused instruction pair at the very end of the slice counts as two, so this can be one more than "cycles"
     int cycles_run = cpu_get_cycles() - begin;
     cpu.cycle_offset = 0;
     return cycles_run;
@@ -205,10 +218,8 @@ void cpu_reset(void)
     cpu_update_mxcsr();
 
     // Reset TLB
-    memset(cpu.tlb, 0, sizeof(void*) * (1 << 20));
-    memset(cpu.tlb_tags, 0xFF, 1 << 20);
-    memset(cpu.tlb_attrs, 0xFF, 1 << 20);
-    cpu_mmu_tlb_flush();
+    cpu_mmu_tlb_reset();
+    cpu_mmu_pde_cache_flush();
 }
 
 int cpu_apic_connected(void)
@@ -266,11 +277,14 @@ static void cpu_state(void)
     state_field(obj, 8, "cpu.ia32_efer", &cpu.ia32_efer);
     state_field(obj, 12, "cpu.sysenter", &cpu.sysenter);
     // <<< END AUTOGENERATE "state" >>>
+    if (state_is_reading())
+        cpu_smc_clear_pages(); // Code bits are stale after loading, and protected pages can't be read into
     state_file(cpu.memory_size, "ram", cpu.mem);
 
     if (state_is_reading()) {
         cpu_trace_flush(); // Remove all residual code traces
         cpu_mmu_tlb_flush(); // Remove all stale TLB entries
+        cpu_mmu_pde_cache_flush(); // The page tables were replaced along with the rest of RAM
         cpu_prot_update_cpl(); // Update cpu.tlb_shift_*
         cpu_update_mxcsr();
 
@@ -290,12 +304,120 @@ int cpu_init(void)
 #ifdef INSTRUMENT
     cpu_instrument_init();
 #endif
+#ifdef DYNAREC
+    cpu_jit_init();
+#endif
+    cpu_mmu_tlb_reset();
+    return cpu_set_cache_config(NULL);
+}
+
+int cpu_set_cache_config(struct cpu_cache_config* cfg)
+{
+    struct cpu_cache_config defaults = { 0 };
+    if (!cfg)
+        cfg = &defaults;
+
+    uint32_t trace_info_entries = cfg->trace_info_entries > 0 ? cfg->trace_info_entries : DEFAULT_TRACE_INFO_ENTRIES,
+             trace_cache_size = cfg->trace_cache_size > 0 ? cfg->trace_cache_size : DEFAULT_TRACE_CACHE_SIZE,
+             tlb_entries = cfg->tlb_entries > 0 ? cfg->tlb_entries : DEFAULT_TLB_ENTRIES;
+    int max_trace_size = cfg->max_trace_size > 0 ? cfg->max_trace_size : DEFAULT_MAX_TRACE_SIZE;
+
+    if (max_trace_size < 2 || max_trace_size > MAX_TRACE_SIZE) {
+        CPU_LOG("Maximum trace size must be between 2 and %d instructions\n", MAX_TRACE_SIZE);
+        return -1;
+    }
+    // Every region must be able to hold a few traces of maximum size.
+    if (trace_cache_size < (uint32_t)(TRACE_REGIONS * max_trace_size * 4)) {
+        CPU_LOG("Trace cache must hold at least %d instructions\n", TRACE_REGIONS * max_trace_size * 4);
+        return -1;
+    }
+    // The set index is computed with a mask, so the number of sets has to be a power of two
+    uint32_t entries = TRACE_WAYS;
+    while (entries < trace_info_entries)
+        entries <<= 1;
+
+    // Allocate everything before the old arrays are freed, so that the CPU keeps its current caches if this fails
+    uint32_t* tlb_entry_indexes = calloc(tlb_entries, sizeof(uint32_t));
+    struct tlb_source* tlb_entry_sources = calloc(tlb_entries, sizeof(struct tlb_source));
+    struct decoded_instruction* trace_cache = calloc(trace_cache_size, sizeof(struct decoded_instruction));
+    struct trace_info* trace_info = calloc(entries * TRACE_PARTITIONS, sizeof(struct trace_info));
+    struct tlb_saved_entry* context_entries[TLB_CONTEXTS];
+    int failed = !tlb_entry_indexes || !tlb_entry_sources || !trace_cache || !trace_info;
+    for (int i = 0; i < TLB_CONTEXTS; i++)
+        failed |= !(context_entries[i] = calloc(tlb_entries, sizeof(struct tlb_saved_entry)));
+    if (failed) {
+        free(tlb_entry_indexes);
+        free(tlb_entry_sources);
+        free(trace_cache);
+        free(trace_info);
+        for (int i = 0; i < TLB_CONTEXTS; i++)
+            free(context_entries[i]);
+        CPU_LOG("Unable to allocate memory for trace cache and TLB\n");
+        return -1;
+    }
+
+    // Entries in the old index array can't be flushed after it's gone
+    if (cpu.tlb_entry_indexes)
+        cpu_mmu_tlb_flush();
+    free(cpu.tlb_entry_indexes);
+    free(cpu.tlb_entry_sources);
+    free(cpu.trace_cache);
+    free(cpu.trace_info);
+    cpu.tlb_entry_indexes = tlb_entry_indexes;
+    cpu.tlb_entry_sources = tlb_entry_sources;
+    cpu.trace_cache = trace_cache;
+    cpu.trace_info = trace_info;
+    for (int i = 0; i < TLB_CONTEXTS; i++) {
+        free(cpu.tlb_contexts[i].entries);
+        cpu.tlb_contexts[i].entries = context_entries[i];
+    }
+
+    cpu.max_tlb_entries = tlb_entries;
+    cpu.trace_info_entries = entries;
+    cpu.trace_sets = entries / TRACE_WAYS;
+    cpu.trace_cache_size = trace_cache_size;
+    cpu.trace_region_size = trace_cache_size / TRACE_REGIONS;
+    cpu.max_trace_size = max_trace_size;
+    cpu_smc_clear_traces(); // The lists pointed into the old index array
+
+    cpu_trace_flush(); // Also gives every trace cache region a valid generation
     return 0;
 }
 
+void cpu_get_cache_stats(struct cpu_cache_stats* stats)
+{
+    *stats = cpu.stats;
+    stats->trace_cache_usage = cpu.trace_cache_usage;
+    stats->trace_cache_size = cpu.trace_cache_size;
+    stats->tlb_entry_count = cpu.tlb_entry_count;
+    stats->tlb_entries = cpu.max_tlb_entries;
+}
+
+void cpu_reset_cache_stats(void)
+{
+    memset(&cpu.stats, 0, sizeof(struct cpu_cache_stats));
+}
+
 void cpu_init_dma(uint32_t page)
 {
     cpu_smc_invalidate_page(page);
+    cpu_mmu_pde_write(page & ~0xFFF, 4096);
+}
+
+void* cpu_get_dma_ptr(uint32_t addr, uint32_t length)
+{
+#ifdef INSTRUMENT
+    // The instrumentation has to see the data, so make the device go through cpu_write_mem
+    UNUSED(addr);
+    UNUSED(length);
+    return NULL;
+#else
+    if (!length || addr >= cpu.memory_size || length > cpu.memory_size - addr)
+        return NULL;
+    for (uint32_t page = addr & ~0xFFF; page < addr + length; page += 4096)
+        cpu_init_dma(page);
+    return cpu.mem8 + addr;
+#endif
 }
 
 void cpu_write_mem(uint32_t addr, void* data, uint32_t length)
@@ -336,4 +458,21 @@ void cpu_debug(void)
     printf("CS:EIP: %04x:%08x (lin: %08x) Physical EIP: %08x\n", cpu.seg[CS], VIRT_EIP(), LIN_EIP(), cpu.phys_eip);
     printf("Translation mode: %d-bit\n", cpu.state_hash ? 16 : 32);
     printf("Physical RAM base: %p Cycles to run: %d Cycles executed: %d\n", cpu.mem, cpu.cycles_to_run, (uint32_t)cpu_get_cycles());
+    struct cpu_cache_stats* st = &cpu.stats;
+    printf("Trace cache: %d/%d used, %llu hits (%llu linked), %llu misses, %llu flushes, %llu evictions\n", cpu.trace_cache_usage, cpu.trace_cache_size,
+        (unsigned long long)st->trace_hits, (unsigned long long)st->trace_link_hits, (unsigned long long)st->trace_misses,
+        (unsigned long long)st->trace_flushes, (unsigned long long)st->trace_evictions);
+    printf("TLB: %d/%d used, %llu fills, %llu flushes (%llu non-global, %llu when full)\n", cpu.tlb_entry_count, cpu.max_tlb_entries,
+        (unsigned long long)st->tlb_fills, (unsigned long long)st->tlb_flushes, (unsigned long long)st->tlb_nonglobal_flushes,
+        (unsigned long long)st->tlb_full_flushes);
+    printf("PDE cache: %llu hits, %llu misses\n", (unsigned long long)st->pde_cache_hits, (unsigned long long)st->pde_cache_misses);
+    printf("TLB contexts: %llu hits, %llu entries restored\n", (unsigned long long)st->tlb_context_hits, (unsigned long long)st->tlb_context_restores);
+
+    static const char* fpu_ops[FPU_STAT_OPS] = { "fadd", "fmul", "fsub", "fsubr", "fdiv", "fdivr", "fsqrt" };
+    struct cpu_fpu_stats fst;
+    cpu_get_fpu_stats(&fst);
+    printf("FPU (host/softfloat):");
+    for (int i = 0; i < FPU_STAT_OPS; i++)
+        printf(" %s %llu/%llu", fpu_ops[i], (unsigned long long)fst.fast[i], (unsigned long long)fst.softfloat[i]);
+    printf("\n");
 }
\ No newline at end of file
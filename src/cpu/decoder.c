@@ -471,7 +471,7 @@ static int decode_invalid(struct decoded_instruction* i)
         printf("%02x ", rawp[i]);
     printf("\n");
     CPU_LOG("Unknown opcode: %02x\n", rawp[0]);
-    i->handler = op_ud_exception;
+    I_SET_HANDLER(i, op_ud_exception);
     i->flags = 0;
     return 1;
 }
@@ -486,7 +486,7 @@ static int decode_invalid0F(struct decoded_instruction* i)
         printf("%02x ", rawp[i]);
     printf("\n");
     CPU_LOG("Unknown opcode: 0F %02x\n", rawp[0]);
-    i->handler = op_ud_exception;
+    I_SET_HANDLER(i, op_ud_exception);
     i->flags = 0;
     return 1;
 }
@@ -609,7 +609,7 @@ done:
     return return_value;
 error:
     sse_prefix = 0;
-    i->handler = op_ud_exception;
+    I_SET_HANDLER(i, op_ud_exception);
     return 1;
 }
 
@@ -654,7 +654,7 @@ static int decode_jcc8(struct decoded_instruction* i)
 {
     i->flags = 0;
     int cond = rawp[-1] & 15;
-    i->handler = SIZEOP(jcc16[cond], jcc32[cond]);
+    I_SET_HANDLER(i, SIZEOP(jcc16[cond], jcc32[cond]));
     i->imm32 = rbs();
     return 0;
 }
@@ -662,7 +662,7 @@ static int decode_jccv(struct decoded_instruction* i)
 {
     i->flags = 0;
     int cond = rawp[-1] & 15;
-    i->handler = SIZEOP(jcc16[cond], jcc32[cond]);
+    I_SET_HANDLER(i, SIZEOP(jcc16[cond], jcc32[cond]));
     i->imm32 = rvs();
     return 0;
 }
@@ -671,9 +671,9 @@ static int decode_cmov(struct decoded_instruction* i)
     uint8_t cond = rawp[-1] & 15, modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_cmov_r16e16, op_cmov_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_cmov_r16e16, op_cmov_r32e32));
     else
-        i->handler = SIZEOP(op_cmov_r16r16, op_cmov_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_cmov_r16r16, op_cmov_r32r32));
     I_SET_OP(i->flags, cond);
     return 0;
 }
@@ -682,9 +682,9 @@ static int decode_setcc(struct decoded_instruction* i)
     uint8_t cond = rawp[-1] & 15, modrm = rb();
     i->flags = parse_modrm(i, modrm, 1);
     if (modrm < 0xC0)
-        i->handler = op_setcc_e8;
+        I_SET_HANDLER(i, op_setcc_e8);
     else
-        i->handler = op_setcc_r8;
+        I_SET_HANDLER(i, op_setcc_r8);
     I_SET_OP(i->flags, cond);
     return 0;
 }
@@ -693,7 +693,7 @@ static int decode_mov_rbib(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RM8(flags, rawp[-1] & 7);
     i->flags = flags;
-    i->handler = op_mov_r8i8;
+    I_SET_HANDLER(i, op_mov_r8i8);
     i->imm32 = rb();
     return 0;
 }
@@ -702,7 +702,7 @@ static int decode_mov_rviv(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RMv(flags, rawp[-1] & 7);
     i->flags = flags;
-    i->handler = SIZEOP(op_mov_r16i16, op_mov_r32i32);
+    I_SET_HANDLER(i, SIZEOP(op_mov_r16i16, op_mov_r32i32));
     i->imm32 = rv();
     return 0;
 }
@@ -711,7 +711,7 @@ static int decode_push_rv(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RMv(flags, rawp[-1] & 7);
     i->flags = flags;
-    i->handler = SIZEOP(op_push_r16, op_push_r32);
+    I_SET_HANDLER(i, SIZEOP(op_push_r16, op_push_r32));
     return 0;
 }
 static int decode_pop_rv(struct decoded_instruction* i)
@@ -719,7 +719,7 @@ static int decode_pop_rv(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RMv(flags, rawp[-1] & 7);
     i->flags = flags;
-    i->handler = SIZEOP(op_pop_r16, op_pop_r32);
+    I_SET_HANDLER(i, SIZEOP(op_pop_r16, op_pop_r32));
     return 0;
 }
 static int decode_push_sv(struct decoded_instruction* i)
@@ -727,7 +727,7 @@ static int decode_push_sv(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RM(flags, rawp[-1] >> 3 & 3);
     i->flags = flags;
-    i->handler = SIZEOP(op_push_s16, op_push_s32);
+    I_SET_HANDLER(i, SIZEOP(op_push_s16, op_push_s32));
     return 0;
 }
 static int decode_pop_sv(struct decoded_instruction* i)
@@ -735,19 +735,19 @@ static int decode_pop_sv(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RM(flags, rawp[-1] >> 3 & 3);
     i->flags = flags;
-    i->handler = SIZEOP(op_pop_s16, op_pop_s32);
+    I_SET_HANDLER(i, SIZEOP(op_pop_s16, op_pop_s32));
     return 0;
 }
 static int decode_inc_rv(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_inc_r16, op_inc_r32);
+    I_SET_HANDLER(i, SIZEOP(op_inc_r16, op_inc_r32));
     i->flags = 0;
     I_SET_RMv(i->flags, rawp[-1] & 7);
     return 0;
 }
 static int decode_dec_rv(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_dec_r16, op_dec_r32);
+    I_SET_HANDLER(i, SIZEOP(op_dec_r16, op_dec_r32));
     i->flags = 0;
     I_SET_RMv(i->flags, rawp[-1] & 7);
     return 0;
@@ -758,13 +758,13 @@ static int decode_fpu(struct decoded_instruction* i)
     if (modrm < 0xC0) {
         i->flags = parse_modrm(i, modrm, 2);
         I_SET_OP(i->flags, state_hash & 1);
-        i->handler = op_fpu_mem;
+        I_SET_HANDLER(i, op_fpu_mem);
     } else {
         int flags = 0;
         I_SET_REG(flags, modrm >> 3 & 7);
         i->flags = flags;
         I_SET_OP(i->flags, state_hash & 1);
-        i->handler = op_fpu_reg;
+        I_SET_HANDLER(i, op_fpu_reg);
     }
     i->imm32 = (opcode << 8 & 0x700) | modrm; // FPU opcode as featured in Intel manual
     return 0;
@@ -777,7 +777,7 @@ static int decode_arith_00(struct decoded_instruction* i)
     int flags = parse_modrm(i, modrm, 1);
     I_SET_OP(flags, op);
     i->flags = flags;
-    i->handler = REGOP(op_arith_e8r8, op_arith_r8r8);
+    I_SET_HANDLER(i, REGOP(op_arith_e8r8, op_arith_r8r8));
     return 0;
 }
 static int decode_arith_01(struct decoded_instruction* i)
@@ -787,7 +787,7 @@ static int decode_arith_01(struct decoded_instruction* i)
     int flags = parse_modrm(i, modrm, 0);
     I_SET_OP(flags, op);
     i->flags = flags;
-    i->handler = REGOP(SIZEOP(op_arith_e16r16, op_arith_e32r32), SIZEOP(op_arith_r16r16, op_arith_r32r32));
+    I_SET_HANDLER(i, REGOP(SIZEOP(op_arith_e16r16, op_arith_e32r32), SIZEOP(op_arith_r16r16, op_arith_r32r32)));
     return 0;
 }
 static int decode_arith_02(struct decoded_instruction* i)
@@ -798,10 +798,10 @@ static int decode_arith_02(struct decoded_instruction* i)
     I_SET_OP(flags, op);
     if (modrm < 0xC0) {
         i->flags = flags;
-        i->handler = op_arith_r8e8;
+        I_SET_HANDLER(i, op_arith_r8e8);
     } else {
         i->flags = swap_rm_reg(flags);
-        i->handler = op_arith_r8r8;
+        I_SET_HANDLER(i, op_arith_r8r8);
     }
     return 0;
 }
@@ -813,10 +813,10 @@ static int decode_arith_03(struct decoded_instruction* i)
     I_SET_OP(flags, op);
     if (modrm < 0xC0) {
         i->flags = flags;
-        i->handler = SIZEOP(op_arith_r16e16, op_arith_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_arith_r16e16, op_arith_r32e32));
     } else {
         i->flags = swap_rm_reg(flags);
-        i->handler = SIZEOP(op_arith_r16r16, op_arith_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_arith_r16r16, op_arith_r32r32));
     }
     return 0;
 }
@@ -824,7 +824,7 @@ static int decode_arith_04(struct decoded_instruction* i)
 {
     i->flags = 0;
     I_SET_OP(i->flags, rawp[-1] >> 3 & 7);
-    i->handler = op_arith_r8i8;
+    I_SET_HANDLER(i, op_arith_r8i8);
     i->imm8 = rb();
     return 0;
 }
@@ -832,7 +832,7 @@ static int decode_arith_05(struct decoded_instruction* i)
 {
     i->flags = 0;
     I_SET_OP(i->flags, rawp[-1] >> 3 & 7);
-    i->handler = SIZEOP(op_arith_r16i16, op_arith_r32i32);
+    I_SET_HANDLER(i, SIZEOP(op_arith_r16i16, op_arith_r32i32));
     i->imm32 = rv();
     return 0;
 }
@@ -842,45 +842,45 @@ static int decode_xchg(struct decoded_instruction* i)
     i->flags = 0;
     // R/M is already implied to be zero
     I_SET_REGv(i->flags, rawp[-1] & 7);
-    i->handler = SIZEOP(op_xchg_r16r16, op_xchg_r32r32);
+    I_SET_HANDLER(i, SIZEOP(op_xchg_r16r16, op_xchg_r32r32));
     return 0;
 }
 static int decode_bswap(struct decoded_instruction* i)
 {
     i->flags = 0;
     I_SET_RMv(i->flags, rawp[-1] & 7);
-    i->handler = SIZEOP(op_bswap_r16, op_bswap_r32);
+    I_SET_HANDLER(i, SIZEOP(op_bswap_r16, op_bswap_r32));
     return 0;
 }
 
 static int decode_ud(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_ud_exception;
+    I_SET_HANDLER(i, op_ud_exception);
     return 1;
 }
 
 static int decode_27(struct decoded_instruction* i)
 {
-    i->handler = op_daa;
+    I_SET_HANDLER(i, op_daa);
     i->flags = 0;
     return 0;
 }
 static int decode_2F(struct decoded_instruction* i)
 {
-    i->handler = op_das;
+    I_SET_HANDLER(i, op_das);
     i->flags = 0;
     return 0;
 }
 static int decode_37(struct decoded_instruction* i)
 {
-    i->handler = op_aaa;
+    I_SET_HANDLER(i, op_aaa);
     i->flags = 0;
     return 0;
 }
 static int decode_3F(struct decoded_instruction* i)
 {
-    i->handler = op_aas;
+    I_SET_HANDLER(i, op_aas);
     i->flags = 0;
     return 0;
 }
@@ -889,7 +889,7 @@ static int decode_38(struct decoded_instruction* i)
     uint8_t modrm = rb();
     int flags = parse_modrm(i, modrm, 1);
     i->flags = flags;
-    i->handler = REGOP(op_cmp_e8r8, op_cmp_r8r8);
+    I_SET_HANDLER(i, REGOP(op_cmp_e8r8, op_cmp_r8r8));
     return 0;
 }
 static int decode_39(struct decoded_instruction* i)
@@ -897,7 +897,7 @@ static int decode_39(struct decoded_instruction* i)
     uint8_t modrm = rb();
     int flags = parse_modrm(i, modrm, 0);
     i->flags = flags;
-    i->handler = REGOP(SIZEOP(op_cmp_e16r16, op_cmp_e32r32), SIZEOP(op_cmp_r16r16, op_cmp_r32r32));
+    I_SET_HANDLER(i, REGOP(SIZEOP(op_cmp_e16r16, op_cmp_e32r32), SIZEOP(op_cmp_r16r16, op_cmp_r32r32)));
     return 0;
 }
 static int decode_3A(struct decoded_instruction* i)
@@ -906,10 +906,10 @@ static int decode_3A(struct decoded_instruction* i)
     int flags = parse_modrm(i, modrm, 1);
     if (modrm < 0xC0) {
         i->flags = flags;
-        i->handler = op_cmp_r8e8;
+        I_SET_HANDLER(i, op_cmp_r8e8);
     } else {
         i->flags = swap_rm_reg(flags);
-        i->handler = op_cmp_r8r8;
+        I_SET_HANDLER(i, op_cmp_r8r8);
     }
     return 0;
 }
@@ -919,24 +919,24 @@ static int decode_3B(struct decoded_instruction* i)
     int flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0) {
         i->flags = flags;
-        i->handler = SIZEOP(op_cmp_r16e16, op_cmp_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_cmp_r16e16, op_cmp_r32e32));
     } else {
         i->flags = swap_rm_reg(flags);
-        i->handler = SIZEOP(op_cmp_r16r16, op_cmp_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_cmp_r16r16, op_cmp_r32r32));
     }
     return 0;
 }
 static int decode_3C(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_cmp_r8i8;
+    I_SET_HANDLER(i, op_cmp_r8i8);
     i->imm8 = rb();
     return 0;
 }
 static int decode_3D(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_cmp_r16i16, op_cmp_r32i32);
+    I_SET_HANDLER(i, SIZEOP(op_cmp_r16i16, op_cmp_r32i32));
     i->imm32 = rv();
     return 0;
 }
@@ -944,13 +944,13 @@ static int decode_3D(struct decoded_instruction* i)
 static int decode_60(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_pusha, op_pushad);
+    I_SET_HANDLER(i, SIZEOP(op_pusha, op_pushad));
     return 0;
 }
 static int decode_61(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_popa, op_popad);
+    I_SET_HANDLER(i, SIZEOP(op_popa, op_popad));
     return 0;
 }
 static int decode_62(struct decoded_instruction* i)
@@ -958,11 +958,11 @@ static int decode_62(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if(modrm >= 0xC0){
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     }
     i->flags = parse_modrm(i, modrm, 0);
-    i->handler = SIZEOP(op_bound_r16e16, op_bound_r32e32);
+    I_SET_HANDLER(i, SIZEOP(op_bound_r16e16, op_bound_r32e32));
     return 0;
 }
 static int decode_63(struct decoded_instruction* i)
@@ -973,16 +973,16 @@ static int decode_63(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     state_hash = old_state_hash;
     if (modrm < 0xC0)
-        i->handler = op_arpl_e16;
+        I_SET_HANDLER(i, op_arpl_e16);
     else
-        i->handler = op_arpl_r16;
+        I_SET_HANDLER(i, op_arpl_r16);
     return 0;
 }
 // 64 -- 67 are prefixes
 static int decode_68(struct decoded_instruction* i)
 {
     i->imm32 = rv();
-    i->handler = SIZEOP(op_push_i16, op_push_i32);
+    I_SET_HANDLER(i, SIZEOP(op_push_i16, op_push_i32));
     i->flags = 0;
     return 0;
 }
@@ -990,14 +990,14 @@ static int decode_69(struct decoded_instruction* i)
 {
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
-    i->handler = REGOP(SIZEOP(op_imul_r16e16i16, op_imul_r32e32i32), SIZEOP(op_imul_r16r16i16, op_imul_r32r32i32));
+    I_SET_HANDLER(i, REGOP(SIZEOP(op_imul_r16e16i16, op_imul_r32e32i32), SIZEOP(op_imul_r16r16i16, op_imul_r32r32i32)));
     i->imm32 = rvs();
     return 0;
 }
 static int decode_6A(struct decoded_instruction* i)
 {
     i->imm32 = rbs();
-    i->handler = SIZEOP(op_push_i16, op_push_i32);
+    I_SET_HANDLER(i, SIZEOP(op_push_i16, op_push_i32));
     i->flags = 0;
     return 0;
 }
@@ -1005,7 +1005,7 @@ static int decode_6B(struct decoded_instruction* i)
 {
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
-    i->handler = REGOP(SIZEOP(op_imul_r16e16i16, op_imul_r32e32i32), SIZEOP(op_imul_r16r16i16, op_imul_r32r32i32));
+    I_SET_HANDLER(i, REGOP(SIZEOP(op_imul_r16e16i16, op_imul_r32e32i32), SIZEOP(op_imul_r16r16i16, op_imul_r32r32i32)));
     i->imm32 = rbs();
     return 0;
 }
@@ -1014,7 +1014,7 @@ static int decode_6C(struct decoded_instruction* i)
     if (!(state_hash & 4))
         i->flags = 0;
 
-    i->handler = state_hash & STATE_ADDR16 ? op_insb16 : op_insb32;
+    I_SET_HANDLER(i, state_hash & STATE_ADDR16 ? op_insb16 : op_insb32);
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
     return 0;
 }
@@ -1026,7 +1026,7 @@ static int decode_6D(struct decoded_instruction* i)
         op_insd32, op_insw32, // STATE_CODE16 set, STATE_ADDR16 not set
         op_insd16, op_insw16 // STATE_CODE16 set, STATE_ADDR16 set
     };
-    i->handler = atbl[state_hash & 3];
+    I_SET_HANDLER(i, atbl[state_hash & 3]);
     return 0;
 }
 static int decode_6E(struct decoded_instruction* i)
@@ -1034,7 +1034,7 @@ static int decode_6E(struct decoded_instruction* i)
     if (!(state_hash & 4))
         i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = state_hash & STATE_ADDR16 ? op_outsb16 : op_outsb32;
+    I_SET_HANDLER(i, state_hash & STATE_ADDR16 ? op_outsb16 : op_outsb32);
     return 0;
 }
 static int decode_6F(struct decoded_instruction* i)
@@ -1046,7 +1046,7 @@ static int decode_6F(struct decoded_instruction* i)
         op_outsd32, op_outsw32, // STATE_CODE16 set, STATE_ADDR16 not set
         op_outsd16, op_outsw16 // STATE_CODE16 set, STATE_ADDR16 set
     };
-    i->handler = atbl[state_hash & 3];
+    I_SET_HANDLER(i, atbl[state_hash & 3]);
     return 0;
 }
 // 70 ~ 7F are jcc opcodes
@@ -1056,10 +1056,10 @@ static int decode_80(struct decoded_instruction* i)
     int flags = parse_modrm(i, modrm, 1);
     i->imm8 = rb();
     if ((modrm & 0x38) == 0x38) {
-        i->handler = REGOP(op_cmp_e8i8, op_cmp_r8i8);
+        I_SET_HANDLER(i, REGOP(op_cmp_e8i8, op_cmp_r8i8));
     } else {
         I_SET_OP(flags, modrm >> 3 & 7);
-        i->handler = REGOP(op_arith_e8i8, op_arith_r8i8);
+        I_SET_HANDLER(i, REGOP(op_arith_e8i8, op_arith_r8i8));
     }
     i->flags = flags;
     return 0;
@@ -1070,10 +1070,10 @@ static int decode_81(struct decoded_instruction* i)
     int flags = parse_modrm(i, modrm, 0);
     i->imm32 = rvs();
     if ((modrm & 0x38) == 0x38) {
-        i->handler = SIZEOP(REGOP(op_cmp_e16i16, op_cmp_r16i16), REGOP(op_cmp_e32i32, op_cmp_r32i32));
+        I_SET_HANDLER(i, SIZEOP(REGOP(op_cmp_e16i16, op_cmp_r16i16), REGOP(op_cmp_e32i32, op_cmp_r32i32)));
     } else {
         I_SET_OP(flags, modrm >> 3 & 7);
-        i->handler = SIZEOP(REGOP(op_arith_e16i16, op_arith_r16i16), REGOP(op_arith_e32i32, op_arith_r32i32));
+        I_SET_HANDLER(i, SIZEOP(REGOP(op_arith_e16i16, op_arith_r16i16), REGOP(op_arith_e32i32, op_arith_r32i32)));
     }
     i->flags = flags;
     return 0;
@@ -1084,10 +1084,10 @@ static int decode_83(struct decoded_instruction* i)
     int flags = parse_modrm(i, modrm, 0);
     i->imm32 = rbs();
     if ((modrm & 0x38) == 0x38) {
-        i->handler = SIZEOP(REGOP(op_cmp_e16i16, op_cmp_r16i16), REGOP(op_cmp_e32i32, op_cmp_r32i32));
+        I_SET_HANDLER(i, SIZEOP(REGOP(op_cmp_e16i16, op_cmp_r16i16), REGOP(op_cmp_e32i32, op_cmp_r32i32)));
     } else {
         I_SET_OP(flags, modrm >> 3 & 7);
-        i->handler = SIZEOP(REGOP(op_arith_e16i16, op_arith_r16i16), REGOP(op_arith_e32i32, op_arith_r32i32));
+        I_SET_HANDLER(i, SIZEOP(REGOP(op_arith_e16i16, op_arith_r16i16), REGOP(op_arith_e32i32, op_arith_r32i32)));
     }
     i->flags = flags;
     return 0;
@@ -1097,9 +1097,9 @@ static int decode_84(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 1);
     if (modrm < 0xC0)
-        i->handler = op_test_e8r8;
+        I_SET_HANDLER(i, op_test_e8r8);
     else
-        i->handler = op_test_r8r8;
+        I_SET_HANDLER(i, op_test_r8r8);
     return 0;
 }
 static int decode_85(struct decoded_instruction* i)
@@ -1107,9 +1107,9 @@ static int decode_85(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_test_e16r16, op_test_e32r32);
+        I_SET_HANDLER(i, SIZEOP(op_test_e16r16, op_test_e32r32));
     else
-        i->handler = SIZEOP(op_test_r16r16, op_test_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_test_r16r16, op_test_r32r32));
     return 0;
 }
 
@@ -1118,9 +1118,9 @@ static int decode_86(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 1);
     if (modrm < 0xC0)
-        i->handler = op_xchg_r8e8;
+        I_SET_HANDLER(i, op_xchg_r8e8);
     else
-        i->handler = op_xchg_r8r8;
+        I_SET_HANDLER(i, op_xchg_r8r8);
     return 0;
 }
 static int decode_87(struct decoded_instruction* i)
@@ -1128,9 +1128,9 @@ static int decode_87(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_xchg_r16e16, op_xchg_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_xchg_r16e16, op_xchg_r32e32));
     else
-        i->handler = SIZEOP(op_xchg_r16r16, op_xchg_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_xchg_r16r16, op_xchg_r32r32));
     return 0;
 }
 
@@ -1139,16 +1139,16 @@ static int decode_88(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 1);
     if (modrm < 0xC0)
-        i->handler = op_mov_e8r8;
+        I_SET_HANDLER(i, op_mov_e8r8);
     else
-        i->handler = op_mov_r8r8;
+        I_SET_HANDLER(i, op_mov_r8r8);
     return 0;
 }
 static int decode_89(struct decoded_instruction* i)
 {
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
-    i->handler = REGOP(SIZEOP(op_mov_e16r16, op_mov_e32r32), SIZEOP(op_mov_r16r16, op_mov_r32r32));
+    I_SET_HANDLER(i, REGOP(SIZEOP(op_mov_e16r16, op_mov_e32r32), SIZEOP(op_mov_r16r16, op_mov_r32r32)));
     return 0;
 }
 static int decode_8A(struct decoded_instruction* i)
@@ -1156,10 +1156,10 @@ static int decode_8A(struct decoded_instruction* i)
     uint8_t modrm = rb();
     int flags = parse_modrm(i, modrm, 1);
     if (modrm < 0xC0)
-        i->handler = op_mov_r8e8;
+        I_SET_HANDLER(i, op_mov_r8e8);
     else {
         flags = swap_rm_reg(flags);
-        i->handler = op_mov_r8r8;
+        I_SET_HANDLER(i, op_mov_r8r8);
     }
     i->flags = flags;
     return 0;
@@ -1169,10 +1169,10 @@ static int decode_8B(struct decoded_instruction* i)
     uint8_t modrm = rb();
     int flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_mov_r16e16, op_mov_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_mov_r16e16, op_mov_r32e32));
     else {
         flags = swap_rm_reg(flags);
-        i->handler = SIZEOP(op_mov_r16r16, op_mov_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_mov_r16r16, op_mov_r32r32));
     }
     i->flags = flags;
     return 0;
@@ -1182,21 +1182,21 @@ static int decode_8C(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 2);
     if (modrm < 0xC0)
-        i->handler = op_mov_e16s16;
+        I_SET_HANDLER(i, op_mov_e16s16);
     else
-        i->handler = SIZEOP(op_mov_r16s16, op_mov_r32s16);
+        I_SET_HANDLER(i, SIZEOP(op_mov_r16s16, op_mov_r32s16));
     return 0;
 }
 static int decode_8D(struct decoded_instruction* i)
 {
     uint8_t modrm = rb();
     if (modrm >= 0xC0) {
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         i->flags = 0;
         return 1;
     }
     i->flags = parse_modrm(i, modrm, 0);
-    i->handler = SIZEOP(op_lea_r16e16, op_lea_r32e32);
+    I_SET_HANDLER(i, SIZEOP(op_lea_r16e16, op_lea_r32e32));
     return 0;
 }
 static int decode_8E(struct decoded_instruction* i)
@@ -1207,9 +1207,9 @@ static int decode_8E(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 2);
     state_hash = old_state_hash;
     if (modrm < 0xC0)
-        i->handler = op_mov_s16e16;
+        I_SET_HANDLER(i, op_mov_s16e16);
     else
-        i->handler = op_mov_s16r16;
+        I_SET_HANDLER(i, op_mov_s16r16);
     return 0;
 }
 static int decode_8F(struct decoded_instruction* i)
@@ -1217,36 +1217,36 @@ static int decode_8F(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm >= 0xC0) {
         i->flags = parse_modrm(i, modrm, 0);
-        i->handler = SIZEOP(op_pop_r16, op_pop_r32);
+        I_SET_HANDLER(i, SIZEOP(op_pop_r16, op_pop_r32));
     } else {
         i->flags = parse_modrm(i, modrm, 0);
-        i->handler = SIZEOP(op_pop_e16, op_pop_e32);
+        I_SET_HANDLER(i, SIZEOP(op_pop_e16, op_pop_e32));
     }
     return 0;
 }
 static int decode_90(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_nop;
+    I_SET_HANDLER(i, op_nop);
     return 0;
 }
 
 static int decode_98(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_cbw, op_cwde);
+    I_SET_HANDLER(i, SIZEOP(op_cbw, op_cwde));
     return 0;
 }
 static int decode_99(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_cwd, op_cdq);
+    I_SET_HANDLER(i, SIZEOP(op_cwd, op_cdq));
     return 0;
 }
 static int decode_9A(struct decoded_instruction* i)
 {
     // Far call
-    i->handler = SIZEOP(op_callf16_ap, op_callf32_ap);
+    I_SET_HANDLER(i, SIZEOP(op_callf16_ap, op_callf32_ap));
     i->imm32 = rv();
     i->disp16 = rw();
     i->flags = 0;
@@ -1254,38 +1254,38 @@ static int decode_9A(struct decoded_instruction* i)
 }
 static int decode_9B(struct decoded_instruction* i)
 {
-    i->handler = op_fwait;
+    I_SET_HANDLER(i, op_fwait);
     i->flags = 0;
     return 0;
 }
 static int decode_9C(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_pushf, op_pushfd);
+    I_SET_HANDLER(i, SIZEOP(op_pushf, op_pushfd));
     return 0;
 }
 static int decode_9D(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_popf, op_popfd);
+    I_SET_HANDLER(i, SIZEOP(op_popf, op_popfd));
     return 0;
 }
 static int decode_9E(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_sahf;
+    I_SET_HANDLER(i, op_sahf);
     return 0;
 }
 static int decode_9F(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_lahf;
+    I_SET_HANDLER(i, op_lahf);
     return 0;
 }
 
 static int decode_A0(struct decoded_instruction* i)
 {
-    i->handler = op_mov_alm8;
+    I_SET_HANDLER(i, op_mov_alm8);
     i->imm32 = state_hash & STATE_ADDR16 ? rw() : rd();
     i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
@@ -1293,7 +1293,7 @@ static int decode_A0(struct decoded_instruction* i)
 }
 static int decode_A1(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_mov_axm16, op_mov_eaxm32);
+    I_SET_HANDLER(i, SIZEOP(op_mov_axm16, op_mov_eaxm32));
     i->imm32 = state_hash & STATE_ADDR16 ? rw() : rd();
     i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
@@ -1301,7 +1301,7 @@ static int decode_A1(struct decoded_instruction* i)
 }
 static int decode_A2(struct decoded_instruction* i)
 {
-    i->handler = op_mov_m8al;
+    I_SET_HANDLER(i, op_mov_m8al);
     i->imm32 = state_hash & STATE_ADDR16 ? rw() : rd();
     i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
@@ -1309,7 +1309,7 @@ static int decode_A2(struct decoded_instruction* i)
 }
 static int decode_A3(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_mov_m16ax, op_mov_m32eax);
+    I_SET_HANDLER(i, SIZEOP(op_mov_m16ax, op_mov_m32eax));
     i->imm32 = state_hash & STATE_ADDR16 ? rw() : rd();
     i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
@@ -1321,7 +1321,7 @@ static int decode_A4(struct decoded_instruction* i)
     if (!(state_hash & 4))
         i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = state_hash & STATE_ADDR16 ? op_movsb16 : op_movsb32;
+    I_SET_HANDLER(i, state_hash & STATE_ADDR16 ? op_movsb16 : op_movsb32);
     return 0;
 }
 static int decode_A5(struct decoded_instruction* i)
@@ -1331,16 +1331,16 @@ static int decode_A5(struct decoded_instruction* i)
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
     switch (state_hash & 3) {
     case 0: // 32 bit address, 32-bit data
-        i->handler = op_movsd32;
+        I_SET_HANDLER(i, op_movsd32);
         break;
     case STATE_CODE16: // 32 bit address, 16-bit data
-        i->handler = op_movsw32;
+        I_SET_HANDLER(i, op_movsw32);
         break;
     case STATE_ADDR16: // 16 bit address, 32-bit data
-        i->handler = op_movsd16;
+        I_SET_HANDLER(i, op_movsd16);
         break;
     case STATE_ADDR16 | STATE_CODE16: // 16 bit address, 16-bit data
-        i->handler = op_movsw16;
+        I_SET_HANDLER(i, op_movsw16);
         break;
     }
     return 0;
@@ -1351,7 +1351,7 @@ static int decode_A6(struct decoded_instruction* i)
     if (!(state_hash & 4))
         i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = state_hash & STATE_ADDR16 ? op_cmpsb16 : op_cmpsb32;
+    I_SET_HANDLER(i, state_hash & STATE_ADDR16 ? op_cmpsb16 : op_cmpsb32);
     return 0;
 }
 static int decode_A7(struct decoded_instruction* i)
@@ -1361,16 +1361,16 @@ static int decode_A7(struct decoded_instruction* i)
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
     switch (state_hash & 3) {
     case 0: // 32 bit address, 32-bit data
-        i->handler = op_cmpsd32;
+        I_SET_HANDLER(i, op_cmpsd32);
         break;
     case STATE_CODE16: // 32 bit address, 16-bit data
-        i->handler = op_cmpsw32;
+        I_SET_HANDLER(i, op_cmpsw32);
         break;
     case STATE_ADDR16: // 16 bit address, 32-bit data
-        i->handler = op_cmpsd16;
+        I_SET_HANDLER(i, op_cmpsd16);
         break;
     case STATE_ADDR16 | STATE_CODE16: // 16 bit address, 16-bit data
-        i->handler = op_cmpsw16;
+        I_SET_HANDLER(i, op_cmpsw16);
         break;
     }
     return 0;
@@ -1378,14 +1378,14 @@ static int decode_A7(struct decoded_instruction* i)
 
 static int decode_A8(struct decoded_instruction* i)
 {
-    i->handler = op_test_r8i8;
+    I_SET_HANDLER(i, op_test_r8i8);
     i->flags = 0; // Set R/M to 0
     i->imm8 = rb();
     return 0;
 }
 static int decode_A9(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_test_r16i16, op_test_r32i32);
+    I_SET_HANDLER(i, SIZEOP(op_test_r16i16, op_test_r32i32));
     i->flags = 0;
     i->imm32 = rv();
     return 0;
@@ -1396,7 +1396,7 @@ static int decode_AA(struct decoded_instruction* i)
     if (!(state_hash & 4))
         i->flags = 0;
     //if(PTR_TO_PHYS(rawp) == 0x108796)__asm__("int3");
-    i->handler = state_hash & STATE_ADDR16 ? op_stosb16 : op_stosb32;
+    I_SET_HANDLER(i, state_hash & STATE_ADDR16 ? op_stosb16 : op_stosb32);
     return 0;
 }
 static int decode_AB(struct decoded_instruction* i)
@@ -1405,16 +1405,16 @@ static int decode_AB(struct decoded_instruction* i)
         i->flags = 0;
     switch (state_hash & 3) {
     case 0: // 32 bit address, 32-bit data
-        i->handler = op_stosd32;
+        I_SET_HANDLER(i, op_stosd32);
         break;
     case STATE_CODE16: // 32 bit address, 16-bit data
-        i->handler = op_stosw32;
+        I_SET_HANDLER(i, op_stosw32);
         break;
     case STATE_ADDR16: // 16 bit address, 32-bit data
-        i->handler = op_stosd16;
+        I_SET_HANDLER(i, op_stosd16);
         break;
     case STATE_ADDR16 | STATE_CODE16: // 16 bit address, 16-bit data
-        i->handler = op_stosw16;
+        I_SET_HANDLER(i, op_stosw16);
         break;
     }
     return 0;
@@ -1424,7 +1424,7 @@ static int decode_AC(struct decoded_instruction* i)
     if (!(state_hash & 4))
         i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = state_hash & STATE_ADDR16 ? op_lodsb16 : op_lodsb32;
+    I_SET_HANDLER(i, state_hash & STATE_ADDR16 ? op_lodsb16 : op_lodsb32);
     return 0;
 }
 static int decode_AD(struct decoded_instruction* i)
@@ -1434,16 +1434,16 @@ static int decode_AD(struct decoded_instruction* i)
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
     switch (state_hash & 3) {
     case 0: // 32 bit address, 32-bit data
-        i->handler = op_lodsd32;
+        I_SET_HANDLER(i, op_lodsd32);
         break;
     case STATE_CODE16: // 32 bit address, 16-bit data
-        i->handler = op_lodsw32;
+        I_SET_HANDLER(i, op_lodsw32);
         break;
     case STATE_ADDR16: // 16 bit address, 32-bit data
-        i->handler = op_lodsd16;
+        I_SET_HANDLER(i, op_lodsd16);
         break;
     case STATE_ADDR16 | STATE_CODE16: // 16 bit address, 16-bit data
-        i->handler = op_lodsw16;
+        I_SET_HANDLER(i, op_lodsw16);
         break;
     }
     return 0;
@@ -1452,7 +1452,7 @@ static int decode_AE(struct decoded_instruction* i)
 {
     if (!(state_hash & 4))
         i->flags = 0;
-    i->handler = state_hash & STATE_ADDR16 ? op_scasb16 : op_scasb32;
+    I_SET_HANDLER(i, state_hash & STATE_ADDR16 ? op_scasb16 : op_scasb32);
     return 0;
 }
 static int decode_AF(struct decoded_instruction* i)
@@ -1461,16 +1461,16 @@ static int decode_AF(struct decoded_instruction* i)
         i->flags = 0;
     switch (state_hash & 3) {
     case 0:
-        i->handler = op_scasd32;
+        I_SET_HANDLER(i, op_scasd32);
         break;
     case STATE_CODE16:
-        i->handler = op_scasw32;
+        I_SET_HANDLER(i, op_scasw32);
         break;
     case STATE_ADDR16:
-        i->handler = op_scasd16;
+        I_SET_HANDLER(i, op_scasd16);
         break;
     case STATE_ADDR16 | STATE_CODE16:
-        i->handler = op_scasw16;
+        I_SET_HANDLER(i, op_scasw16);
         break;
     }
     return 0;
@@ -1482,9 +1482,9 @@ static int decode_C0(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 1);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
-        i->handler = op_shift_e8i8;
+        I_SET_HANDLER(i, op_shift_e8i8);
     else
-        i->handler = op_shift_r8i8;
+        I_SET_HANDLER(i, op_shift_r8i8);
     i->imm8 = rb();
     return 0;
 }
@@ -1494,22 +1494,22 @@ static int decode_C1(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_shift_e16i16, op_shift_e32i32);
+        I_SET_HANDLER(i, SIZEOP(op_shift_e16i16, op_shift_e32i32));
     else
-        i->handler = SIZEOP(op_shift_r16i16, op_shift_r32i32);
+        I_SET_HANDLER(i, SIZEOP(op_shift_r16i16, op_shift_r32i32));
     i->imm8 = rb();
     return 0;
 }
 static int decode_C2(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_ret16_iw, op_ret32_iw);
+    I_SET_HANDLER(i, SIZEOP(op_ret16_iw, op_ret32_iw));
     i->imm16 = rw();
     i->flags = 0;
     return 1;
 }
 static int decode_C3(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_ret16, op_ret32);
+    I_SET_HANDLER(i, SIZEOP(op_ret16, op_ret32));
     i->flags = 0;
     return 1;
 }
@@ -1518,11 +1518,11 @@ static int decode_C4(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm >= 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         i->flags = parse_modrm(i, modrm, 0);
-        i->handler = SIZEOP(op_les_r16e16, op_les_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_les_r16e16, op_les_r32e32));
     }
     return 0;
 }
@@ -1531,11 +1531,11 @@ static int decode_C5(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm >= 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         i->flags = parse_modrm(i, modrm, 0);
-        i->handler = SIZEOP(op_lds_r16e16, op_lds_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_lds_r16e16, op_lds_r32e32));
     }
     return 0;
 }
@@ -1545,14 +1545,14 @@ static int decode_C6(struct decoded_instruction* i)
     if(modrm >> 3 & 7) {
         // TODO: RTX instructions
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     }
     i->flags = parse_modrm(i, modrm, 1);
     if (modrm >= 0xC0)
-        i->handler = op_mov_r8i8;
+        I_SET_HANDLER(i, op_mov_r8i8);
     else
-        i->handler = op_mov_e8i8;
+        I_SET_HANDLER(i, op_mov_e8i8);
     i->imm8 = rb();
     return 0;
 }
@@ -1562,21 +1562,21 @@ static int decode_C7(struct decoded_instruction* i)
     if(modrm >> 3 & 7) {
         // TODO: RTX instructions
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     }
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm >= 0xC0)
-        i->handler = SIZEOP(op_mov_r16i16, op_mov_r32i32);
+        I_SET_HANDLER(i, SIZEOP(op_mov_r16i16, op_mov_r32i32));
     else
-        i->handler = SIZEOP(op_mov_e16i16, op_mov_e32i32);
+        I_SET_HANDLER(i, SIZEOP(op_mov_e16i16, op_mov_e32i32));
     i->imm32 = rv();
     return 0;
 }
 static int decode_C8(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_enter16, op_enter32);
+    I_SET_HANDLER(i, SIZEOP(op_enter16, op_enter32));
     i->imm16 = rw();
     i->disp8 = rb();
     return 0;
@@ -1584,47 +1584,47 @@ static int decode_C8(struct decoded_instruction* i)
 static int decode_C9(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_leave16, op_leave32);
+    I_SET_HANDLER(i, SIZEOP(op_leave16, op_leave32));
     return 0;
 }
 static int decode_CA(struct decoded_instruction* i)
 {
     i->flags = 0;
     i->imm16 = rw();
-    i->handler = SIZEOP(op_retf16, op_retf32);
+    I_SET_HANDLER(i, SIZEOP(op_retf16, op_retf32));
     return 1;
 }
 static int decode_CB(struct decoded_instruction* i)
 {
     i->flags = 0;
     i->imm16 = 0;
-    i->handler = SIZEOP(op_retf16, op_retf32);
+    I_SET_HANDLER(i, SIZEOP(op_retf16, op_retf32));
     return 1;
 }
 static int decode_CC(struct decoded_instruction* i)
 {
     i->flags = 0;
     i->imm8 = 3;
-    i->handler = op_int;
+    I_SET_HANDLER(i, op_int);
     return 1;
 }
 static int decode_CD(struct decoded_instruction* i)
 {
     i->flags = 0;
     i->imm8 = rb();
-    i->handler = op_int;
+    I_SET_HANDLER(i, op_int);
     return 1;
 }
 static int decode_CE(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_into;
+    I_SET_HANDLER(i, op_into);
     return 0;
 }
 static int decode_CF(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = SIZEOP(op_iret16, op_iret32);
+    I_SET_HANDLER(i, SIZEOP(op_iret16, op_iret32));
     return 1;
 }
 
@@ -1634,9 +1634,9 @@ static int decode_D0(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 1);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
-        i->handler = op_shift_e8i8;
+        I_SET_HANDLER(i, op_shift_e8i8);
     else
-        i->handler = op_shift_r8i8;
+        I_SET_HANDLER(i, op_shift_r8i8);
     i->imm8 = 1;
     return 0;
 }
@@ -1646,9 +1646,9 @@ static int decode_D1(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_shift_e16i16, op_shift_e32i32);
+        I_SET_HANDLER(i, SIZEOP(op_shift_e16i16, op_shift_e32i32));
     else
-        i->handler = SIZEOP(op_shift_r16i16, op_shift_r32i32);
+        I_SET_HANDLER(i, SIZEOP(op_shift_r16i16, op_shift_r32i32));
     i->imm8 = 1;
     return 0;
 }
@@ -1658,9 +1658,9 @@ static int decode_D2(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 1);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
-        i->handler = op_shift_e8cl;
+        I_SET_HANDLER(i, op_shift_e8cl);
     else
-        i->handler = op_shift_r8cl;
+        I_SET_HANDLER(i, op_shift_r8cl);
     i->imm8 = 1;
     return 0;
 }
@@ -1670,36 +1670,36 @@ static int decode_D3(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     I_SET_OP(i->flags, modrm >> 3 & 7);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_shift_e16cl, op_shift_e32cl);
+        I_SET_HANDLER(i, SIZEOP(op_shift_e16cl, op_shift_e32cl));
     else
-        i->handler = SIZEOP(op_shift_r16cl, op_shift_r32cl);
+        I_SET_HANDLER(i, SIZEOP(op_shift_r16cl, op_shift_r32cl));
     return 0;
 }
 static int decode_D4(struct decoded_instruction* i)
 {
     i->flags = 0;
     i->imm8 = rb();
-    i->handler = op_aam;
+    I_SET_HANDLER(i, op_aam);
     return 0;
 }
 static int decode_D5(struct decoded_instruction* i)
 {
     i->flags = 0;
     i->imm8 = rb();
-    i->handler = op_aad;
+    I_SET_HANDLER(i, op_aad);
     return 0;
 }
 static int decode_D7(struct decoded_instruction* i)
 {
     i->flags = 0;
     I_SET_SEG_BASE(i->flags, seg_prefix[0]);
-    i->handler = (state_hash & STATE_ADDR16) ? op_xlat16 : op_xlat32;
+    I_SET_HANDLER(i, (state_hash & STATE_ADDR16) ? op_xlat16 : op_xlat32);
     return 0;
 }
 
 static int decode_E0(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_loopnz_rel16, op_loopnz_rel32);
+    I_SET_HANDLER(i, SIZEOP(op_loopnz_rel16, op_loopnz_rel32));
     i->flags = 0;
     i->disp32 = state_hash & STATE_ADDR16 ? 0xFFFF : -1;
     i->imm32 = rbs();
@@ -1707,7 +1707,7 @@ static int decode_E0(struct decoded_instruction* i)
 }
 static int decode_E1(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_loopz_rel16, op_loopz_rel32);
+    I_SET_HANDLER(i, SIZEOP(op_loopz_rel16, op_loopz_rel32));
     i->flags = 0;
     i->disp32 = state_hash & STATE_ADDR16 ? 0xFFFF : -1;
     i->imm32 = rbs();
@@ -1715,7 +1715,7 @@ static int decode_E1(struct decoded_instruction* i)
 }
 static int decode_E2(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_loop_rel16, op_loop_rel32);
+    I_SET_HANDLER(i, SIZEOP(op_loop_rel16, op_loop_rel32));
     i->flags = 0;
     i->disp32 = state_hash & STATE_ADDR16 ? 0xFFFF : -1;
     i->imm32 = rbs();
@@ -1723,7 +1723,7 @@ static int decode_E2(struct decoded_instruction* i)
 }
 static int decode_E3(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_jecxz_rel16, op_jecxz_rel32);
+    I_SET_HANDLER(i, SIZEOP(op_jecxz_rel16, op_jecxz_rel32));
     i->disp32 = state_hash & STATE_ADDR16 ? 0xFFFF : -1;
     i->flags = 0;
     i->imm32 = rbs();
@@ -1731,42 +1731,42 @@ static int decode_E3(struct decoded_instruction* i)
 }
 static int decode_E4(struct decoded_instruction* i)
 {
-    i->handler = op_in_i8al;
+    I_SET_HANDLER(i, op_in_i8al);
     i->flags = 0;
     i->imm8 = rb();
     return 0;
 }
 static int decode_E5(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_in_i8ax, op_in_i8eax);
+    I_SET_HANDLER(i, SIZEOP(op_in_i8ax, op_in_i8eax));
     i->flags = 0;
     i->imm8 = rb();
     return 0;
 }
 static int decode_E6(struct decoded_instruction* i)
 {
-    i->handler = op_out_i8al;
+    I_SET_HANDLER(i, op_out_i8al);
     i->flags = 0;
     i->imm8 = rb();
     return 0;
 }
 static int decode_E7(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_out_i8ax, op_out_i8eax);
+    I_SET_HANDLER(i, SIZEOP(op_out_i8ax, op_out_i8eax));
     i->flags = 0;
     i->imm8 = rb();
     return 0;
 }
 static int decode_E8(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_call_j16, op_call_j32);
+    I_SET_HANDLER(i, SIZEOP(op_call_j16, op_call_j32));
     i->flags = 0;
     i->imm32 = rvs();
     return 1;
 }
 static int decode_E9(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_jmp_rel16, op_jmp_rel32);
+    I_SET_HANDLER(i, SIZEOP(op_jmp_rel16, op_jmp_rel32));
     i->flags = 0;
     i->imm32 = rvs();
     return 1;
@@ -1774,7 +1774,7 @@ static int decode_E9(struct decoded_instruction* i)
 static int decode_EA(struct decoded_instruction* i)
 {
     // Far jump
-    i->handler = op_jmpf;
+    I_SET_HANDLER(i, op_jmpf);
     i->imm32 = rv();
     i->disp16 = rw();
     i->flags = 0;
@@ -1783,45 +1783,45 @@ static int decode_EA(struct decoded_instruction* i)
 static int decode_EB(struct decoded_instruction* i)
 {
     // Far jump
-    i->handler = SIZEOP(op_jmp_rel16, op_jmp_rel32);
+    I_SET_HANDLER(i, SIZEOP(op_jmp_rel16, op_jmp_rel32));
     i->imm32 = rbs();
     i->flags = 0;
     return 1;
 }
 static int decode_EC(struct decoded_instruction* i)
 {
-    i->handler = op_in_dxal;
+    I_SET_HANDLER(i, op_in_dxal);
     i->flags = 0;
     return 0;
 }
 static int decode_ED(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_in_dxax, op_in_dxeax);
+    I_SET_HANDLER(i, SIZEOP(op_in_dxax, op_in_dxeax));
     i->flags = 0;
     return 0;
 }
 static int decode_EE(struct decoded_instruction* i)
 {
-    i->handler = op_out_dxal;
+    I_SET_HANDLER(i, op_out_dxal);
     i->flags = 0;
     return 0;
 }
 static int decode_EF(struct decoded_instruction* i)
 {
-    i->handler = SIZEOP(op_out_dxax, op_out_dxeax);
+    I_SET_HANDLER(i, SIZEOP(op_out_dxax, op_out_dxeax));
     i->flags = 0;
     return 0;
 }
 
 static int decode_F4(struct decoded_instruction* i)
 {
-    i->handler = op_hlt;
+    I_SET_HANDLER(i, op_hlt);
     i->flags = 0;
     return 1;
 }
 static int decode_F5(struct decoded_instruction* i)
 {
-    i->handler = op_cmc;
+    I_SET_HANDLER(i, op_cmc);
     i->flags = 0;
     return 0;
 }
@@ -1833,36 +1833,36 @@ static int decode_F6(struct decoded_instruction* i)
         switch (modrm >> 3 & 7) {
         case 0:
         case 1:
-            i->handler = op_test_e8i8;
+            I_SET_HANDLER(i, op_test_e8i8);
             i->imm8 = rb();
             break;
         case 2:
-            i->handler = op_not_e8;
+            I_SET_HANDLER(i, op_not_e8);
             break;
         case 3:
-            i->handler = op_neg_e8;
+            I_SET_HANDLER(i, op_neg_e8);
             break;
         default:
             I_SET_OP(i->flags, reg);
-            i->handler = op_muldiv_e8;
+            I_SET_HANDLER(i, op_muldiv_e8);
             break;
         }
     else
         switch (modrm >> 3 & 7) {
         case 0:
         case 1:
-            i->handler = op_test_r8i8;
+            I_SET_HANDLER(i, op_test_r8i8);
             i->imm8 = rb();
             break;
         case 2:
-            i->handler = op_not_r8;
+            I_SET_HANDLER(i, op_not_r8);
             break;
         case 3:
-            i->handler = op_neg_r8;
+            I_SET_HANDLER(i, op_neg_r8);
             break;
         default:
             I_SET_OP(i->flags, reg);
-            i->handler = op_muldiv_r8;
+            I_SET_HANDLER(i, op_muldiv_r8);
             break;
         }
     return 0;
@@ -1876,74 +1876,74 @@ static int decode_F7(struct decoded_instruction* i)
         switch (modrm >> 3 & 7) {
         case 0:
         case 1:
-            i->handler = SIZEOP(op_test_e16i16, op_test_e32i32);
+            I_SET_HANDLER(i, SIZEOP(op_test_e16i16, op_test_e32i32));
             i->imm32 = rv();
             break;
         case 2:
-            i->handler = SIZEOP(op_not_e16, op_not_e32);
+            I_SET_HANDLER(i, SIZEOP(op_not_e16, op_not_e32));
             break;
         case 3:
-            i->handler = SIZEOP(op_neg_e16, op_neg_e32);
+            I_SET_HANDLER(i, SIZEOP(op_neg_e16, op_neg_e32));
             break;
         default:
             I_SET_OP(i->flags, reg);
-            i->handler = SIZEOP(op_muldiv_e16, op_muldiv_e32);
+            I_SET_HANDLER(i, SIZEOP(op_muldiv_e16, op_muldiv_e32));
             break;
         }
     else
         switch (modrm >> 3 & 7) {
         case 0:
         case 1:
-            i->handler = SIZEOP(op_test_r16i16, op_test_r32i32);
+            I_SET_HANDLER(i, SIZEOP(op_test_r16i16, op_test_r32i32));
             i->imm32 = rv();
             break;
         case 2:
-            i->handler = SIZEOP(op_not_r16, op_not_r32);
+            I_SET_HANDLER(i, SIZEOP(op_not_r16, op_not_r32));
             break;
         case 3:
-            i->handler = SIZEOP(op_neg_r16, op_neg_r32);
+            I_SET_HANDLER(i, SIZEOP(op_neg_r16, op_neg_r32));
             break;
         default:
             I_SET_OP(i->flags, reg);
-            i->handler = SIZEOP(op_muldiv_r16, op_muldiv_r32);
+            I_SET_HANDLER(i, SIZEOP(op_muldiv_r16, op_muldiv_r32));
             break;
         }
     return 0;
 }
 static int decode_F8(struct decoded_instruction* i)
 {
-    i->handler = op_clc;
+    I_SET_HANDLER(i, op_clc);
     i->flags = 0;
     return 0;
 }
 static int decode_F9(struct decoded_instruction* i)
 {
-    i->handler = op_stc;
+    I_SET_HANDLER(i, op_stc);
     i->flags = 0;
     return 0;
 }
 
 static int decode_FA(struct decoded_instruction* i)
 {
-    i->handler = op_cli;
+    I_SET_HANDLER(i, op_cli);
     i->flags = 0;
     return 0;
 }
 static int decode_FB(struct decoded_instruction* i)
 {
-    i->handler = op_sti;
+    I_SET_HANDLER(i, op_sti);
     i->flags = 0;
     return 0;
 }
 static int decode_FC(struct decoded_instruction* i)
 {
-    i->handler = op_cld;
+    I_SET_HANDLER(i, op_cld);
     i->flags = 0;
     return 0;
 }
 static int decode_FD(struct decoded_instruction* i)
 {
-    i->handler = op_std;
+    I_SET_HANDLER(i, op_std);
     i->flags = 0;
     return 0;
 }
@@ -1955,25 +1955,25 @@ static int decode_FE(struct decoded_instruction* i)
     if (modrm < 0xC0) // MOD != 3
         switch (modrm >> 3 & 7) {
         case 0:
-            i->handler = op_inc_e8;
+            I_SET_HANDLER(i, op_inc_e8);
             break;
         case 1:
-            i->handler = op_dec_e8;
+            I_SET_HANDLER(i, op_dec_e8);
             break;
         default:
-            i->handler = op_ud_exception;
+            I_SET_HANDLER(i, op_ud_exception);
             return 1;
         }
     else
         switch (modrm >> 3 & 7) {
         case 0:
-            i->handler = op_inc_r8;
+            I_SET_HANDLER(i, op_inc_r8);
             break;
         case 1:
-            i->handler = op_dec_r8;
+            I_SET_HANDLER(i, op_dec_r8);
             break;
         default:
-            i->handler = op_ud_exception;
+            I_SET_HANDLER(i, op_ud_exception);
             return 1;
         }
     return 0;
@@ -1985,53 +1985,53 @@ static int decode_FF(struct decoded_instruction* i)
     if (modrm < 0xC0) // MOD != 3
         switch (modrm >> 3 & 7) {
         case 0:
-            i->handler = SIZEOP(op_inc_e16, op_inc_e32);
+            I_SET_HANDLER(i, SIZEOP(op_inc_e16, op_inc_e32));
             return 0;
         case 1:
-            i->handler = SIZEOP(op_dec_e16, op_dec_e32);
+            I_SET_HANDLER(i, SIZEOP(op_dec_e16, op_dec_e32));
             return 0;
         case 2:
-            i->handler = SIZEOP(op_call_e16, op_call_e32);
+            I_SET_HANDLER(i, SIZEOP(op_call_e16, op_call_e32));
             return 1;
         case 3:
-            i->handler = SIZEOP(op_callf_e16, op_callf_e32);
+            I_SET_HANDLER(i, SIZEOP(op_callf_e16, op_callf_e32));
             return 1;
         case 4:
-            i->handler = SIZEOP(op_jmp_e16, op_jmp_e32);
+            I_SET_HANDLER(i, SIZEOP(op_jmp_e16, op_jmp_e32));
             return 1;
         case 5:
-            i->handler = SIZEOP(op_jmpf_e16, op_jmpf_e32);
+            I_SET_HANDLER(i, SIZEOP(op_jmpf_e16, op_jmpf_e32));
             return 1;
         case 6:
-            i->handler = SIZEOP(op_push_e16, op_push_e32);
+            I_SET_HANDLER(i, SIZEOP(op_push_e16, op_push_e32));
             return 0;
         case 7:
-            i->handler = op_ud_exception;
+            I_SET_HANDLER(i, op_ud_exception);
             return 1;
         }
     else
         switch (modrm >> 3 & 7) {
         case 0:
-            i->handler = SIZEOP(op_inc_r16, op_inc_r32);
+            I_SET_HANDLER(i, SIZEOP(op_inc_r16, op_inc_r32));
             return 0;
         case 1:
-            i->handler = SIZEOP(op_dec_r16, op_dec_r32);
+            I_SET_HANDLER(i, SIZEOP(op_dec_r16, op_dec_r32));
             return 0;
         case 2:
-            i->handler = SIZEOP(op_call_r16, op_call_r32);
+            I_SET_HANDLER(i, SIZEOP(op_call_r16, op_call_r32));
             return 1;
         case 4:
-            i->handler = SIZEOP(op_jmp_r16, op_jmp_r32);
+            I_SET_HANDLER(i, SIZEOP(op_jmp_r16, op_jmp_r32));
             return 1;
         case 6:
-            i->handler = SIZEOP(op_push_r16, op_push_r32);
+            I_SET_HANDLER(i, SIZEOP(op_push_r16, op_push_r32));
             return 0;
         case 3: // callf
         case 5: // jmpf
-            i->handler = op_ud_exception;
+            I_SET_HANDLER(i, op_ud_exception);
             return 1;
         case 7:
-            i->handler = op_ud_exception;
+            I_SET_HANDLER(i, op_ud_exception);
             return 1;
         }
     CPU_FATAL("unreachable");
@@ -2048,10 +2048,10 @@ static int decode_0F00(struct decoded_instruction* i)
         state_hash = old_state_hash;
         if (modrm & 8) {
             // VERW
-            i->handler = modrm < 0xC0 ? op_verw_e16 : op_verw_r16;
+            I_SET_HANDLER(i, modrm < 0xC0 ? op_verw_e16 : op_verw_r16);
         } else {
             // VERR
-            i->handler = modrm < 0xC0 ? op_verr_e16 : op_verr_r16;
+            I_SET_HANDLER(i, modrm < 0xC0 ? op_verr_e16 : op_verr_r16);
         }
         return 0;
     }
@@ -2061,13 +2061,13 @@ static int decode_0F00(struct decoded_instruction* i)
         case 0:
         case 1:
             i->imm8 = reg == 0 ? SEG_LDTR : SEG_TR;
-            i->handler = op_str_sldt_e16;
+            I_SET_HANDLER(i, op_str_sldt_e16);
             break;
         case 2:
-            i->handler = op_lldt_e16;
+            I_SET_HANDLER(i, op_lldt_e16);
             break;
         case 3:
-            i->handler = op_ltr_e16;
+            I_SET_HANDLER(i, op_ltr_e16);
             break;
         default:
             CPU_FATAL("Unknown opcode 0F 00 /%d\n", reg);
@@ -2078,13 +2078,13 @@ static int decode_0F00(struct decoded_instruction* i)
         case 1:
             i->imm8 = reg == 0 ? SEG_LDTR : SEG_TR;
             i->disp32 = state_hash & STATE_CODE16 ? 0xFFFF : -1;
-            i->handler = op_str_sldt_r16;
+            I_SET_HANDLER(i, op_str_sldt_r16);
             break;
         case 2:
-            i->handler = op_lldt_r16;
+            I_SET_HANDLER(i, op_lldt_r16);
             break;
         case 3:
-            i->handler = op_ltr_r16;
+            I_SET_HANDLER(i, op_ltr_r16);
             break;
         default:
             CPU_FATAL("Unknown opcode 0F 00 /%d\n", reg);
@@ -2099,52 +2099,52 @@ static int decode_0F01(struct decoded_instruction* i)
     if (modrm < 0xC0) {
         switch (reg) {
         case 0:
-            i->handler = op_sgdt_e32;
+            I_SET_HANDLER(i, op_sgdt_e32);
             break;
         case 1:
-            i->handler = op_sidt_e32;
+            I_SET_HANDLER(i, op_sidt_e32);
             break;
         case 2:
-            i->handler = SIZEOP(op_lgdt_e16, op_lgdt_e32);
+            I_SET_HANDLER(i, SIZEOP(op_lgdt_e16, op_lgdt_e32));
             break;
         case 3:
-            i->handler = SIZEOP(op_lidt_e16, op_lidt_e32);
+            I_SET_HANDLER(i, SIZEOP(op_lidt_e16, op_lidt_e32));
             break;
         case 4:
-            i->handler = op_smsw_e16;
+            I_SET_HANDLER(i, op_smsw_e16);
             break;
         case 5: // Note: No such opcode as 0F 01 /5
-            i->handler = op_ud_exception;
+            I_SET_HANDLER(i, op_ud_exception);
             return 1;
         case 6:
-            i->handler = op_lmsw_e16;
+            I_SET_HANDLER(i, op_lmsw_e16);
             break;
         case 7:
-            i->handler = op_invlpg_e8;
+            I_SET_HANDLER(i, op_invlpg_e8);
             break;
         }
     } else {
         int lmsw_temp;
         switch (reg) {
         case 4:
-            i->handler = SIZEOP(op_smsw_r16, op_smsw_r32);
+            I_SET_HANDLER(i, SIZEOP(op_smsw_r16, op_smsw_r32));
             break;
         case 1:
             i->flags = 0;
-            i->handler = op_nop;
+            I_SET_HANDLER(i, op_nop);
             break;
         case 0:
         case 2:
         case 3:
         case 5:
         case 7:
-            i->handler = op_ud_exception;
+            I_SET_HANDLER(i, op_ud_exception);
             return 1;
         case 6:
             lmsw_temp = I_RM(i->flags);
             i->flags &= ~(0xF << I_RM_SHIFT); // XXX extra hacky
             I_SET_RM(i->flags, lmsw_temp << 1); // Make it into a 16-bit register
-            i->handler = op_lmsw_r16;
+            I_SET_HANDLER(i, op_lmsw_r16);
             break;
         }
     }
@@ -2156,9 +2156,9 @@ static int decode_0F02(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_lar_r16e16, op_lar_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_lar_r16e16, op_lar_r32e32));
     else
-        i->handler = SIZEOP(op_lar_r16r16, op_lar_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_lar_r16r16, op_lar_r32r32));
     return 0;
 }
 static int decode_0F03(struct decoded_instruction* i)
@@ -2166,28 +2166,28 @@ static int decode_0F03(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_lsl_r16e16, op_lsl_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_lsl_r16e16, op_lsl_r32e32));
     else
-        i->handler = SIZEOP(op_lsl_r16r16, op_lsl_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_lsl_r16r16, op_lsl_r32r32));
     return 0;
 }
 
 static int decode_0F06(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_clts;
+    I_SET_HANDLER(i, op_clts);
     return 0;
 }
 static int decode_0F09(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_wbinvd;
+    I_SET_HANDLER(i, op_wbinvd);
     return 0;
 }
 static int decode_0F0B(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_ud_exception;
+    I_SET_HANDLER(i, op_ud_exception);
     return 1;
 }
 
@@ -2236,7 +2236,7 @@ static const int decode_sse10_17_tbl[8 * 4] = {
 static int decode_sse10_17(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_10_17;
+    I_SET_HANDLER(i, op_sse_10_17);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sse10_17_tbl[opcode << 2 | sse_prefix];
@@ -2247,7 +2247,7 @@ static int decode_0F18(struct decoded_instruction* i)
     uint8_t modrm = rb();
     parse_modrm(i, modrm, 0); // We're just parsing ModR/M to find how many bytes to skip
     i->flags = 0;
-    i->handler = op_prefetchh;
+    I_SET_HANDLER(i, op_prefetchh);
     return 0;
 }
 
@@ -2255,7 +2255,7 @@ static int decode_0F1F(struct decoded_instruction* i){
     uint8_t modrm = rb();
     parse_modrm(i, modrm, 0);
     i->flags = 0;
-    i->handler = op_nop;
+    I_SET_HANDLER(i, op_nop);
     return 0;
 }
 
@@ -2264,14 +2264,14 @@ static int decode_0F20(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm < 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         int flags = 0;
         I_SET_REG(flags, modrm >> 3 & 7);
         I_SET_RM(flags, modrm & 7);
         i->flags = flags;
-        i->handler = op_mov_r32cr;
+        I_SET_HANDLER(i, op_mov_r32cr);
     }
     // End the trace here since we might be flushing the TLB
     return 1;
@@ -2281,14 +2281,14 @@ static int decode_0F21(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm < 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         int flags = 0;
         I_SET_REG(flags, modrm >> 3 & 7);
         I_SET_RM(flags, modrm & 7);
         i->flags = flags;
-        i->handler = op_mov_r32dr;
+        I_SET_HANDLER(i, op_mov_r32dr);
     }
     return 0;
 }
@@ -2297,14 +2297,14 @@ static int decode_0F22(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm < 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         int flags = 0;
         I_SET_REG(flags, modrm >> 3 & 7);
         I_SET_RM(flags, modrm & 7);
         i->flags = flags;
-        i->handler = op_mov_crr32;
+        I_SET_HANDLER(i, op_mov_crr32);
     }
     return 1;
 }
@@ -2313,14 +2313,14 @@ static int decode_0F23(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm < 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         int flags = 0;
         I_SET_REG(flags, modrm >> 3 & 7);
         I_SET_RM(flags, modrm & 7);
         i->flags = flags;
-        i->handler = op_mov_drr32;
+        I_SET_HANDLER(i, op_mov_drr32);
     }
     return 0;
 }
@@ -2372,7 +2372,7 @@ static const int decode_sse28_2F_tbl[8 * 4] = {
 static int decode_sse28_2F(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_28_2F;
+    I_SET_HANDLER(i, op_sse_28_2F);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sse28_2F_tbl[opcode << 2 | sse_prefix] | ((opcode & 1) << 4);
@@ -2382,19 +2382,19 @@ static int decode_sse28_2F(struct decoded_instruction* i){
 static int decode_0F30(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_wrmsr;
+    I_SET_HANDLER(i, op_wrmsr);
     return 0;
 }
 static int decode_0F31(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_rdtsc;
+    I_SET_HANDLER(i, op_rdtsc);
     return 0;
 }
 static int decode_0F32(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_rdmsr;
+    I_SET_HANDLER(i, op_rdmsr);
     return 0;
 }
 
@@ -2407,8 +2407,8 @@ static int decode_0F38(struct decoded_instruction* i)
 
     uint8_t modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    if(sse_prefix == SSE_PREFIX_66) i->handler = op_sse_6638;
-    else i->handler = op_sse_38;
+    if(sse_prefix == SSE_PREFIX_66) I_SET_HANDLER(i, op_sse_6638);
+    else I_SET_HANDLER(i, op_sse_38);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     return 0;
@@ -2417,7 +2417,7 @@ static int decode_0F38(struct decoded_instruction* i)
 static int decode_sysenter_sysexit(struct decoded_instruction* i) // 0F34, 0F35
 {
     i->flags = 0;
-    i->handler = rawp[-1] & 1 ? op_sysexit : op_sysenter;
+    I_SET_HANDLER(i, rawp[-1] & 1 ? op_sysexit : op_sysenter);
     return 0;
 }
 
@@ -2465,7 +2465,7 @@ static const int decode_sse50_57_tbl[8 * 4] = {
 static int decode_sse50_57(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_50_57;
+    I_SET_HANDLER(i, op_sse_50_57);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sse50_57_tbl[opcode << 2 | sse_prefix] | ((opcode & 1) << 4);
@@ -2515,7 +2515,7 @@ static const int decode_sse58_5F_tbl[8 * 4] = {
 static int decode_sse58_5F(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_58_5F;
+    I_SET_HANDLER(i, op_sse_58_5F);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sse58_5F_tbl[opcode << 2 | sse_prefix];
@@ -2551,7 +2551,7 @@ static const int decode_sse60_67_tbl[8 * 2] = {
 static int decode_sse60_67(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_60_67;
+    I_SET_HANDLER(i, op_sse_60_67);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sse60_67_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
@@ -2602,7 +2602,7 @@ static const int decode_sse68_6F_tbl[8 * 4] = {
 static int decode_sse68_6F(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_68_6F;
+    I_SET_HANDLER(i, op_sse_68_6F);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sse68_6F_tbl[opcode << 2 | sse_prefix] | ((opcode & 1) << 4);
@@ -2679,7 +2679,7 @@ static const int rm_table_pshift_sse[24] = {
 static int decode_sse70_76(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_70_76;
+    I_SET_HANDLER(i, op_sse_70_76);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     // Get the opcode information from the table
@@ -2704,7 +2704,7 @@ static int decode_sse70_76(struct decoded_instruction* i){
 static int decode_0F77(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_emms;
+    I_SET_HANDLER(i, op_emms);
     return 0;
 }
 
@@ -2719,9 +2719,9 @@ static int decode_sse7C_7D(struct decoded_instruction* i)
     uint8_t opcode = rawp[-1] & 1, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
     if(sse_prefix != SSE_PREFIX_F2 && sse_prefix != SSE_PREFIX_66)
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
     else 
-        i->handler = op_sse_7C_7D;
+        I_SET_HANDLER(i, op_sse_7C_7D);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_7C_7F[opcode << 1 | (sse_prefix == SSE_PREFIX_F2)];
@@ -2742,7 +2742,7 @@ static const int decode_7E_7F[2 * 4] = {
 static int decode_sse7E_7F(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 1, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_7E_7F;
+    I_SET_HANDLER(i, op_sse_7E_7F);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_7E_7F[opcode << 2 | sse_prefix];
@@ -2754,7 +2754,7 @@ static int decode_0FA0(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RM(flags, FS);
     i->flags = flags;
-    i->handler = SIZEOP(op_push_s16, op_push_s32);
+    I_SET_HANDLER(i, SIZEOP(op_push_s16, op_push_s32));
     return 0;
 }
 static int decode_0FA1(struct decoded_instruction* i)
@@ -2762,13 +2762,13 @@ static int decode_0FA1(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RM(flags, FS);
     i->flags = flags;
-    i->handler = SIZEOP(op_pop_s16, op_pop_s32);
+    I_SET_HANDLER(i, SIZEOP(op_pop_s16, op_pop_s32));
     return 0;
 }
 static int decode_0FA2(struct decoded_instruction* i)
 {
     i->flags = 0;
-    i->handler = op_cpuid;
+    I_SET_HANDLER(i, op_cpuid);
     return 0;
 }
 static int decode_0FA3(struct decoded_instruction* i)
@@ -2777,11 +2777,11 @@ static int decode_0FA3(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 0);
-        i->handler = SIZEOP(op_bt_e16, op_bt_e32);
+        I_SET_HANDLER(i, SIZEOP(op_bt_e16, op_bt_e32));
     } else {
         i->disp32 = -1;
         i->imm32 = 0;
-        i->handler = SIZEOP(op_bt_r16, op_bt_r32);
+        I_SET_HANDLER(i, SIZEOP(op_bt_r16, op_bt_r32));
     }
     return 0;
 }
@@ -2791,9 +2791,9 @@ static int decode_0FA4(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     i->imm8 = rb();
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_shld_e16r16i8, op_shld_e32r32i8);
+        I_SET_HANDLER(i, SIZEOP(op_shld_e16r16i8, op_shld_e32r32i8));
     else
-        i->handler = SIZEOP(op_shld_r16r16i8, op_shld_r32r32i8);
+        I_SET_HANDLER(i, SIZEOP(op_shld_r16r16i8, op_shld_r32r32i8));
     return 0;
 }
 static int decode_0FA5(struct decoded_instruction* i)
@@ -2801,9 +2801,9 @@ static int decode_0FA5(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_shld_e16r16cl, op_shld_e32r32cl);
+        I_SET_HANDLER(i, SIZEOP(op_shld_e16r16cl, op_shld_e32r32cl));
     else
-        i->handler = SIZEOP(op_shld_r16r16cl, op_shld_r32r32cl);
+        I_SET_HANDLER(i, SIZEOP(op_shld_r16r16cl, op_shld_r32r32cl));
     return 0;
 }
 
@@ -2812,7 +2812,7 @@ static int decode_0FA8(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RM(flags, GS);
     i->flags = flags;
-    i->handler = SIZEOP(op_push_s16, op_push_s32);
+    I_SET_HANDLER(i, SIZEOP(op_push_s16, op_push_s32));
     return 0;
 }
 static int decode_0FA9(struct decoded_instruction* i)
@@ -2820,7 +2820,7 @@ static int decode_0FA9(struct decoded_instruction* i)
     int flags = 0;
     I_SET_RM(flags, GS);
     i->flags = flags;
-    i->handler = SIZEOP(op_pop_s16, op_pop_s32);
+    I_SET_HANDLER(i, SIZEOP(op_pop_s16, op_pop_s32));
     return 0;
 }
 
@@ -2830,11 +2830,11 @@ static int decode_0FAB(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 0);
-        i->handler = SIZEOP(op_bts_e16, op_bts_e32);
+        I_SET_HANDLER(i, SIZEOP(op_bts_e16, op_bts_e32));
     } else {
         i->disp32 = -1;
         i->imm32 = 0;
-        i->handler = SIZEOP(op_bts_r16, op_bts_r32);
+        I_SET_HANDLER(i, SIZEOP(op_bts_r16, op_bts_r32));
     }
     return 0;
 }
@@ -2844,9 +2844,9 @@ static int decode_0FAC(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     i->imm8 = rb();
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_shrd_e16r16i8, op_shrd_e32r32i8);
+        I_SET_HANDLER(i, SIZEOP(op_shrd_e16r16i8, op_shrd_e32r32i8));
     else
-        i->handler = SIZEOP(op_shrd_r16r16i8, op_shrd_r32r32i8);
+        I_SET_HANDLER(i, SIZEOP(op_shrd_r16r16i8, op_shrd_r32r32i8));
     return 0;
 }
 static int decode_0FAD(struct decoded_instruction* i)
@@ -2854,9 +2854,9 @@ static int decode_0FAD(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_shrd_e16r16cl, op_shrd_e32r32cl);
+        I_SET_HANDLER(i, SIZEOP(op_shrd_e16r16cl, op_shrd_e32r32cl));
     else
-        i->handler = SIZEOP(op_shrd_r16r16cl, op_shrd_r32r32cl);
+        I_SET_HANDLER(i, SIZEOP(op_shrd_r16r16cl, op_shrd_r32r32cl));
     return 0;
 }
 static int decode_0FAE(struct decoded_instruction* i)
@@ -2867,47 +2867,47 @@ static int decode_0FAE(struct decoded_instruction* i)
     switch(modrm >> 3 & 7){
         case 0:
             if(modrm >= 0xC0) {
-                i->handler = op_ud_exception;
+                I_SET_HANDLER(i, op_ud_exception);
                 return 1;
             }else 
-                i->handler = op_fxsave;
+                I_SET_HANDLER(i, op_fxsave);
             break;
         case 1:
             if(modrm >= 0xC0) {
-                i->handler = op_ud_exception;
+                I_SET_HANDLER(i, op_ud_exception);
                 return 1;
             }else 
-                i->handler = op_fxrstor;
+                I_SET_HANDLER(i, op_fxrstor);
             break;
         case 2:
             if(modrm >= 0xC0){
-                i->handler = op_ud_exception;
+                I_SET_HANDLER(i, op_ud_exception);
                 return 1;
             } else
-                i->handler = op_ldmxcsr;
+                I_SET_HANDLER(i, op_ldmxcsr);
             break;
         case 3:
             if(modrm >= 0xC0){
-                i->handler = op_ud_exception;
+                I_SET_HANDLER(i, op_ud_exception);
                 return 1;
             } else
-                i->handler = op_stmxcsr;
+                I_SET_HANDLER(i, op_stmxcsr);
             break;
         case 4: 
-            i->handler = op_ud_exception;
+            I_SET_HANDLER(i, op_ud_exception);
             return 1;
         case 6:
         case 5:
         case 7: // *fence or clflush
             // Whether or not CPUID is supported, we have to support this opcode since Windows 7 crashes if you trigger a #UD here. 
-            i->handler = op_mfence;
+            I_SET_HANDLER(i, op_mfence);
             break;
         default:
             CPU_FATAL("Unknown opcode: 0F AE /%d\n", modrm >> 3 & 7);
     }
     return 0;
 #else
-    i->handler = op_ud_exception;
+    I_SET_HANDLER(i, op_ud_exception);
     return 1;
 #endif
 }
@@ -2916,16 +2916,16 @@ static int decode_0FAF(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_imul_r16e16, op_imul_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_imul_r16e16, op_imul_r32e32));
     else
-        i->handler = SIZEOP(op_imul_r16r16, op_imul_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_imul_r16r16, op_imul_r32r32));
     return 0;
 }
 static int decode_0FB0(struct decoded_instruction* i)
 {
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 1);
-    i->handler = modrm < 0xC0 ? op_cmpxchg_e8r8 : op_cmpxchg_r8r8;
+    I_SET_HANDLER(i, modrm < 0xC0 ? op_cmpxchg_e8r8 : op_cmpxchg_r8r8);
     return 0;
 }
 static int decode_0FB1(struct decoded_instruction* i)
@@ -2933,9 +2933,9 @@ static int decode_0FB1(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (state_hash & STATE_CODE16)
-        i->handler = modrm < 0xC0 ? op_cmpxchg_e16r16 : op_cmpxchg_r16r16;
+        I_SET_HANDLER(i, modrm < 0xC0 ? op_cmpxchg_e16r16 : op_cmpxchg_r16r16);
     else
-        i->handler = modrm < 0xC0 ? op_cmpxchg_e32r32 : op_cmpxchg_r32r32;
+        I_SET_HANDLER(i, modrm < 0xC0 ? op_cmpxchg_e32r32 : op_cmpxchg_r32r32);
     return 0;
 }
 static int decode_0FB2(struct decoded_instruction* i)
@@ -2943,11 +2943,11 @@ static int decode_0FB2(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm >= 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         i->flags = parse_modrm(i, modrm, 0);
-        i->handler = SIZEOP(op_lss_r16e16, op_lss_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_lss_r16e16, op_lss_r32e32));
     }
     return 0;
 }
@@ -2957,11 +2957,11 @@ static int decode_0FB3(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 0);
-        i->handler = SIZEOP(op_btr_e16, op_btr_e32);
+        I_SET_HANDLER(i, SIZEOP(op_btr_e16, op_btr_e32));
     } else {
         i->disp32 = -1;
         i->imm32 = 0;
-        i->handler = SIZEOP(op_btr_r16, op_btr_r32);
+        I_SET_HANDLER(i, SIZEOP(op_btr_r16, op_btr_r32));
     }
     return 0;
 }
@@ -2970,11 +2970,11 @@ static int decode_0FB4(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm >= 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         i->flags = parse_modrm(i, modrm, 0);
-        i->handler = SIZEOP(op_lfs_r16e16, op_lfs_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_lfs_r16e16, op_lfs_r32e32));
     }
     return 0;
 }
@@ -2983,11 +2983,11 @@ static int decode_0FB5(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm >= 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         i->flags = parse_modrm(i, modrm, 0);
-        i->handler = SIZEOP(op_lgs_r16e16, op_lgs_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_lgs_r16e16, op_lgs_r32e32));
     }
     return 0;
 }
@@ -3000,7 +3000,7 @@ static int decode_0FB6(struct decoded_instruction* i)
         op_movzx_r32r8, op_movzx_r16r8,
         op_movzx_r32e8, op_movzx_r16e8
     };
-    i->handler = movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)];
+    I_SET_HANDLER(i, movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)]);
     return 0;
 }
 static int decode_0FB7(struct decoded_instruction* i)
@@ -3012,7 +3012,7 @@ static int decode_0FB7(struct decoded_instruction* i)
         op_movzx_r32r16, op_mov_r16r16,
         op_movzx_r32e16, op_mov_r16e16
     };
-    i->handler = movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)];
+    I_SET_HANDLER(i, movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)]);
     return 0;
 }
 
@@ -3022,7 +3022,7 @@ static int decode_0FBA(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     if ((modrm & 0x20) == 0) {
         // REG values 0 ... 3 are invalid
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     }
     i->imm8 = rb();
@@ -3030,16 +3030,16 @@ static int decode_0FBA(struct decoded_instruction* i)
         I_SET_OP(i->flags, 1);
         switch (modrm >> 3 & 7) {
         case 4:
-            i->handler = SIZEOP(op_bt_e16, op_bt_e32);
+            I_SET_HANDLER(i, SIZEOP(op_bt_e16, op_bt_e32));
             break;
         case 5:
-            i->handler = SIZEOP(op_bts_e16, op_bts_e32);
+            I_SET_HANDLER(i, SIZEOP(op_bts_e16, op_bts_e32));
             break;
         case 6:
-            i->handler = SIZEOP(op_btr_e16, op_btr_e32);
+            I_SET_HANDLER(i, SIZEOP(op_btr_e16, op_btr_e32));
             break;
         case 7:
-            i->handler = SIZEOP(op_btc_e16, op_btc_e32);
+            I_SET_HANDLER(i, SIZEOP(op_btc_e16, op_btc_e32));
             break;
         }
     } else {
@@ -3047,16 +3047,16 @@ static int decode_0FBA(struct decoded_instruction* i)
         i->disp32 = 0;
         switch (modrm >> 3 & 7) {
         case 4:
-            i->handler = SIZEOP(op_bt_r16, op_bt_r32);
+            I_SET_HANDLER(i, SIZEOP(op_bt_r16, op_bt_r32));
             break;
         case 5:
-            i->handler = SIZEOP(op_bts_r16, op_bts_r32);
+            I_SET_HANDLER(i, SIZEOP(op_bts_r16, op_bts_r32));
             break;
         case 6:
-            i->handler = SIZEOP(op_btr_r16, op_btr_r32);
+            I_SET_HANDLER(i, SIZEOP(op_btr_r16, op_btr_r32));
             break;
         case 7:
-            i->handler = SIZEOP(op_btc_r16, op_btc_r32);
+            I_SET_HANDLER(i, SIZEOP(op_btc_r16, op_btc_r32));
             break;
         }
     }
@@ -3068,11 +3068,11 @@ static int decode_0FBB(struct decoded_instruction* i)
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0) {
         I_SET_OP(i->flags, 0);
-        i->handler = SIZEOP(op_btc_e16, op_btc_e32);
+        I_SET_HANDLER(i, SIZEOP(op_btc_e16, op_btc_e32));
     } else {
         i->disp32 = -1;
         i->imm32 = 0;
-        i->handler = SIZEOP(op_btc_r16, op_btc_r32);
+        I_SET_HANDLER(i, SIZEOP(op_btc_r16, op_btc_r32));
     }
     return 0;
 }
@@ -3081,9 +3081,9 @@ static int decode_0FBC(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_bsf_r16e16, op_bsf_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_bsf_r16e16, op_bsf_r32e32));
     else
-        i->handler = SIZEOP(op_bsf_r16r16, op_bsf_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_bsf_r16r16, op_bsf_r32r32));
     return 0;
 }
 static int decode_0FBD(struct decoded_instruction* i)
@@ -3091,9 +3091,9 @@ static int decode_0FBD(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_bsr_r16e16, op_bsr_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_bsr_r16e16, op_bsr_r32e32));
     else
-        i->handler = SIZEOP(op_bsr_r16r16, op_bsr_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_bsr_r16r16, op_bsr_r32r32));
     return 0;
 }
 
@@ -3106,7 +3106,7 @@ static int decode_0FBE(struct decoded_instruction* i)
         op_movsx_r32r8, op_movsx_r16r8,
         op_movsx_r32e8, op_movsx_r16e8
     };
-    i->handler = movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)];
+    I_SET_HANDLER(i, movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)]);
     return 0;
 }
 static int decode_0FBF(struct decoded_instruction* i)
@@ -3118,7 +3118,7 @@ static int decode_0FBF(struct decoded_instruction* i)
         op_movsx_r32r16, op_mov_r16r16,
         op_movsx_r32e16, op_mov_r16e16
     };
-    i->handler = movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)];
+    I_SET_HANDLER(i, movzx[(modrm < 0xC0) << 1 | (state_hash & STATE_CODE16)]);
     return 0;
 }
 
@@ -3127,9 +3127,9 @@ static int decode_0FC0(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 1);
     if (modrm >= 0xC0)
-        i->handler = op_xadd_r8r8;
+        I_SET_HANDLER(i, op_xadd_r8r8);
     else
-        i->handler = op_xadd_r8e8;
+        I_SET_HANDLER(i, op_xadd_r8e8);
     return 0;
 }
 static int decode_0FC1(struct decoded_instruction* i)
@@ -3137,9 +3137,9 @@ static int decode_0FC1(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
     if (modrm >= 0xC0)
-        i->handler = SIZEOP(op_xadd_r16r16, op_xadd_r32r32);
+        I_SET_HANDLER(i, SIZEOP(op_xadd_r16r16, op_xadd_r32r32));
     else
-        i->handler = SIZEOP(op_xadd_r16e16, op_xadd_r32e32);
+        I_SET_HANDLER(i, SIZEOP(op_xadd_r16e16, op_xadd_r32e32));
     return 0;
 }
 static int decode_0FC7(struct decoded_instruction* i)
@@ -3147,11 +3147,11 @@ static int decode_0FC7(struct decoded_instruction* i)
     uint8_t modrm = rb();
     if (modrm >= 0xC0) {
         i->flags = 0;
-        i->handler = op_ud_exception;
+        I_SET_HANDLER(i, op_ud_exception);
         return 1;
     } else {
         i->flags = parse_modrm(i, modrm, 6); // 32-bit reg, 32-bit rm
-        i->handler = op_cmpxchg8b_e32;
+        I_SET_HANDLER(i, op_cmpxchg8b_e32);
         return 0;
     }
 }
@@ -3184,7 +3184,7 @@ static const int decode_sseC2_C6_tbl[5 * 4] = {
 static int decode_sseC2_C6(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_C2_C6;
+    I_SET_HANDLER(i, op_sse_C2_C6);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     opcode -= 2; // C2 --> C0 for easy lookup
@@ -3232,7 +3232,7 @@ static const int decode_sseD0_D7_tbl[8 * 4] = {
 static int decode_sseD0_D7(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_D0_D7;
+    I_SET_HANDLER(i, op_sse_D0_D7);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     opcode--;
@@ -3268,7 +3268,7 @@ static const int decode_sseD8_DF_tbl[8 * 2] = {
 static int decode_sseD8_DF(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_D8_DF;
+    I_SET_HANDLER(i, op_sse_D8_DF);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sseD8_DF_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
@@ -3318,7 +3318,7 @@ static const int decode_sseE0_E7_tbl[8 * 4] = {
 static int decode_sseE0_E7(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_E0_E7;
+    I_SET_HANDLER(i, op_sse_E0_E7);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sseE0_E7_tbl[opcode << 2 | sse_prefix];
@@ -3354,7 +3354,7 @@ static const int decode_sseE8_EF_tbl[8 * 2] = {
 static int decode_sseE8_EF(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_E8_EF;
+    I_SET_HANDLER(i, op_sse_E8_EF);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sseE8_EF_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
@@ -3386,7 +3386,7 @@ static const int decode_sseF1_F7_tbl[7 * 2] = {
 static int decode_sseF1_F7(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_F1_F7;
+    I_SET_HANDLER(i, op_sse_F1_F7);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     opcode--;
@@ -3420,16 +3420,132 @@ static const int decode_sseF8_FE_tbl[7 * 2] = {
 static int decode_sseF8_FE(struct decoded_instruction* i){
     uint8_t opcode = rawp[-1] & 7, modrm = rb();
     int flags = parse_modrm(i, modrm, 6);
-    i->handler = op_sse_F8_FE;
+    I_SET_HANDLER(i, op_sse_F8_FE);
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
     i->imm8 = decode_sseF8_FE_tbl[opcode << 1 | (sse_prefix == SSE_PREFIX_66)];
     return 0;
 }
 
+#ifndef INSTRUMENT
+// The passes below rewrite traces after they have been decoded. Both are disabled for instrumented builds, which expect
+// every instruction to run on its own and compare the flags after each one.
+
+// Flag liveness. After a trace has been decoded, it is walked backwards, and ALU instructions whose flags are overwritten
+// before anything can read them are switched to handlers that don't update the lazy flags state. Unrecognized
+// instructions and anything that might raise an exception count as reading the flags, since exception handlers see them
+// in EFLAGS. The CPU loop can still stop between two instructions of a trace when the time slice runs out or a device
+// requests a fast return, and a hardware interrupt taken there pushes EFLAGS without the skipped flags. Those are only
+// exact at trace boundaries and exceptions. Execution resumes at an instruction that overwrites them before reading them,
+// so only the copy on the interrupt handler's stack (or a debugger) can tell.
+
+// Register forms of ADD, OR, ADC, SBB, AND, SUB, and XOR, and their flag-free counterparts
+static const insn_handler_t alu_handlers[][2] = {
+    { op_arith_r8r8, op_arith_r8r8_nf },
+    { op_arith_r8i8, op_arith_r8i8_nf },
+    { op_arith_r16r16, op_arith_r16r16_nf },
+    { op_arith_r16i16, op_arith_r16i16_nf },
+    { op_arith_r32r32, op_arith_r32r32_nf },
+    { op_arith_r32i32, op_arith_r32i32_nf },
+    { op_inc_r8, op_inc_r8_nf },
+    { op_inc_r16, op_inc_r16_nf },
+    { op_inc_r32, op_inc_r32_nf },
+    { op_dec_r8, op_dec_r8_nf },
+    { op_dec_r16, op_dec_r16_nf },
+    { op_dec_r32, op_dec_r32_nf }
+};
+#define ALU_INCDEC 6 // Index of the first INC/DEC handler. These preserve CF, so they read the flags before them
+// Overwrite all flags, don't read them, and can't fault
+static const insn_handler_t flag_writers[] = {
+    op_cmp_r8r8, op_cmp_r8i8, op_cmp_r16r16, op_cmp_r16i16, op_cmp_r32r32, op_cmp_r32i32,
+    op_test_r8r8, op_test_r8i8, op_test_r16r16, op_test_r16i16, op_test_r32r32, op_test_r32i32
+};
+// Neither touch the flags nor fault
+static const insn_handler_t flag_transparent[] = {
+    op_nop, op_mov_r8i8, op_mov_r16i16, op_mov_r32i32, op_mov_r8r8, op_mov_r16r16, op_mov_r32r32,
+    op_lea_r16e16, op_lea_r32e32, op_xchg_r8r8, op_xchg_r16r16, op_xchg_r32r32,
+    op_movzx_r16r8, op_movzx_r32r8, op_movzx_r32r16, op_movsx_r16r8, op_movsx_r32r8, op_movsx_r32r16
+};
+
+static int find_handler(const insn_handler_t* list, int length, insn_handler_t handler)
+{
+    for (int i = 0; i < length; i++)
+        if (list[i] == handler)
+            return 1;
+    return 0;
+}
+
+static void optimize_flags(struct decoded_instruction* i, int count)
+{
+    int dead = 0; // Set if the current flags are overwritten before anything reads them
+    for (int k = count - 1; k >= 0; k--) {
+        insn_handler_t handler = I_HANDLER(&i[k]);
+        if (find_handler(flag_transparent, sizeof(flag_transparent) / sizeof(insn_handler_t), handler))
+            continue;
+
+        int alu = -1;
+        for (int j = 0; j < (int)(sizeof(alu_handlers) / sizeof(alu_handlers[0])); j++)
+            if (alu_handlers[j][0] == handler)
+                alu = j;
+        if (alu >= ALU_INCDEC) {
+            // Without flags, INC and DEC don't read CF either, so the flags stay dead
+            if (dead)
+                I_SET_HANDLER(&i[k], alu_handlers[alu][1]);
+        } else if (alu >= 0) {
+            int op = I_OP(i[k].flags);
+            if (op == 2 || op == 3) // ADC and SBB read CF
+                dead = 0;
+            else {
+                if (dead)
+                    I_SET_HANDLER(&i[k], alu_handlers[alu][1]);
+                dead = 1;
+            }
+        } else
+            dead = find_handler(flag_writers, sizeof(flag_writers) / sizeof(insn_handler_t), handler);
+    }
+}
+
+// Macro-op fusion. "dec r32; jnz" is replaced with a handler that executes both instructions (see op_dec_r32_jnz32 in
+// opcodes.c). The jump is left as it is and skipped over at run time. This runs after optimize_flags so that DEC is still
+// recognized there.
+#ifdef CPU_BENCH
+static int fusion_enabled = 1;
+#endif
+static void fuse_instructions(struct decoded_instruction* i, int count)
+{
+#ifdef CPU_BENCH
+    if (!fusion_enabled)
+        return;
+#endif
+    for (int k = 0; k < count - 1; k++) {
+        if (I_HANDLER(&i[k]) == op_dec_r32 && I_HANDLER(&i[k + 1]) == op_jnz32) {
+            I_SET_HANDLER(&i[k], op_dec_r32_jnz32);
+            k++; // The jump can't be the start of another pair
+        }
+    }
+}
+#endif
+
+#ifdef CPU_BENCH
+// Lets tools/cpubench.c compare traces with and without macro-op fusion
+void cpu_set_fusion(int enabled)
+{
+#ifndef INSTRUMENT
+    fusion_enabled = enabled;
+#else
+    UNUSED(enabled);
+#endif
+    // Traces that have already been decoded keep their handlers
+    cpu_trace_flush();
+}
+#endif
+
 static void set_smc(int length, uint32_t lin)
 {
-    cpu.tlb_tags[lin >> 12] |= 0x44; // Mark both user and supervisor write TLBs as SMC
+#ifdef SMC_PROTECT
+    if (!cpu.smc_protect)
+#endif
+        TLB_TAGS(lin >> 12) |= 0x44; // Mark both user and supervisor write TLBs as SMC
     int b128 = ((cpu.phys_eip + length) >> 7) - (cpu.phys_eip >> 7) + 1;
     for (int i = 0; i < b128; i++)
         cpu_smc_set_code(cpu.phys_eip + (i << 7));
@@ -3458,28 +3574,35 @@ int cpu_decode(struct trace_info* info, struct decoded_instruction* i)
             if (maximum_insn_length > 15 || find_instruction_length(maximum_insn_length) == -1) {
                 if (instructions_translated != 0) {
                     // End the trace here
-                    i->handler = op_trace_end;
+                    I_SET_HANDLER(i, op_trace_end);
                     instructions_translated++;
                     int length = (uintptr_t)rawp - (uintptr_t)rawp_base;
                     if(instructions_mask != 0){ 
                     info->phys = cpu.phys_eip;
-                    info->state_hash = cpu.state_hash;
-                    info->flags = length;
+                    info->flags = length | instructions_translated << TRACE_INSNS_SHIFT;
+#ifdef DYNAREC
+                    info->calls = 0;
+#endif
                     info->ptr = original;
+                    info->taken = info->fallthrough = NULL;
+#ifndef INSTRUMENT
+                    optimize_flags(original, instructions_translated);
+                    fuse_instructions(original, instructions_translated);
+#endif
                     set_smc(length, LIN_EIP());
                     }
                     return instructions_translated & instructions_mask;
                 }
                 uint32_t lin_eip = LIN_EIP();
 
-#define EXCEPTION_HANDLER          \
-    do {                           \
-        i->handler = op_trace_end; \
-        return 0;                  \
+#define EXCEPTION_HANDLER               \
+    do {                                \
+        I_SET_HANDLER(i, op_trace_end); \
+        return 0;                       \
     } while (0)
                     uint32_t next_page = (lin_eip + 15) & ~0xFFF;
-                    uint8_t tlb_tag = cpu.tlb_tags[next_page >> 12];
-                    if (TLB_ENTRY_INVALID8(next_page, tlb_tag, cpu.tlb_shift_read) || cpu.tlb_attrs[next_page >> 12] & TLB_ATTR_NX) {
+                    uint8_t tlb_tag = TLB_TAGS(next_page >> 12);
+                    if (TLB_ENTRY_INVALID8(next_page, tlb_tag, cpu.tlb_shift_read) || TLB_ATTRS(next_page >> 12) & TLB_ATTR_NX) {
                         if (cpu_mmu_translate(next_page, cpu.tlb_shift_read | 8)) 
                             EXCEPTION_HANDLER;
                     }
@@ -3509,18 +3632,25 @@ int cpu_decode(struct trace_info* info, struct decoded_instruction* i)
         i->flags = (i->flags & ~15) | ((uintptr_t)rawp - (uintptr_t)prev_rawp);
         ++i;
 
-        if (end_of_trace || instructions_translated >= (MAX_TRACE_SIZE-1)) {
+        if (end_of_trace || instructions_translated >= (cpu.max_trace_size - 1)) {
             if (!end_of_trace) {
                 // Handles the case where trace is too long or is a single-instruction trace.
-                i->handler = op_trace_end;
+                I_SET_HANDLER(i, op_trace_end);
                 instructions_translated++;
             }
             int length = (uintptr_t)rawp - (uintptr_t)rawp_base;
             if (instructions_mask != 0) { // Don't commit page split traces
                 info->phys = cpu.phys_eip;
-                info->state_hash = cpu.state_hash;
-                info->flags = length;
+                info->flags = length | instructions_translated << TRACE_INSNS_SHIFT;
+#ifdef DYNAREC
+                info->calls = 0;
+#endif
                 info->ptr = original;
+                info->taken = info->fallthrough = NULL;
+#ifndef INSTRUMENT
+                optimize_flags(original, instructions_translated);
+                fuse_instructions(original, instructions_translated);
+#endif
                 set_smc(length, LIN_EIP());
             }
             return instructions_translated & instructions_mask;
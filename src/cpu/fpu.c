@@ -33,14 +33,15 @@ FADD:
 
 #ifndef LIBCPU
 #define FPU_DEBUG
-#ifdef FPU_DEBUG
-#include <math.h>
-#endif
 #endif
 
 #include "cpu/cpu.h"
 #include "cpu/instrument.h"
 #include "devices.h"
+#include <fenv.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
 #define EXCEPTION_HANDLER return 1
 
 #define FLOATX80
@@ -122,6 +123,15 @@ static const floatx80* Constants[8] = {
 
 struct fpu fpu;
 
+// Fast mode needs host arithmetic that rounds every operation to the precision of its type (i.e. not a 32-bit x87 host)
+#if FLT_EVAL_METHOD == 0
+#define FPU_FAST_HOST 1
+#else
+#define FPU_FAST_HOST 0
+#endif
+static int fast_mode;
+static struct cpu_fpu_stats fpu_stats;
+
 // FLDCW
 static void fpu_set_control_word(uint16_t control_word)
 {
@@ -163,6 +173,205 @@ static void fpu_set_control_word(uint16_t control_word)
     fpu.status.float_suppress_exception = 0;
     fpu.status.float_exception_masks = control_word & 0x3F;
     fpu.status.denormals_are_zeros = 0;
+
+    // The host can't trap on exceptions or round in any other direction, so those cases have to go through softfloat
+    fpu.fast_precision = 0;
+    if (fast_mode && rounding == FPU_ROUND_NEAREST && (control_word & 0x3F) == 0x3F) {
+        if (precision == FPU_PRECISION_24)
+            fpu.fast_precision = 24;
+        else if (precision == FPU_PRECISION_53)
+            fpu.fast_precision = 53;
+    }
+}
+
+void cpu_set_fpu_fast_mode(int enabled)
+{
+    fast_mode = enabled && FPU_FAST_HOST;
+    fpu_set_control_word(fpu.control_word);
+}
+void cpu_get_fpu_stats(struct cpu_fpu_stats* stats)
+{
+    *stats = fpu_stats;
+}
+void cpu_reset_fpu_stats(void)
+{
+    memset(&fpu_stats, 0, sizeof(struct cpu_fpu_stats));
+}
+
+// Converts a to a double if it is zero or a normal number whose mantissa fits in the given precision and whose exponent
+// fits in the host format. Returns 1 for anything that softfloat might handle specially.
+static int fpu_fast_unpack(floatx80 a, int precision, double* result)
+{
+    int exponent = a.exp & 0x7FFF, min = precision == 24 ? -126 : -1022, max = precision == 24 ? 127 : 1023;
+    uint64_t bits = (uint64_t)(a.exp >> 15) << 63;
+    if (exponent || a.fraction) {
+        exponent -= 16383;
+        if (!(a.fraction >> 63) || exponent < min || exponent > max || a.fraction << precision)
+            return 1;
+        bits |= (uint64_t)(exponent + 1023) << 52 | a.fraction << 1 >> 12;
+    }
+    memcpy(result, &bits, 8);
+    return 0;
+}
+
+// Converts a zero or normal double back. Returns 1 for denormals, which are normal numbers on the x87.
+static int fpu_fast_pack(double d, floatx80* result)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, 8);
+    int exponent = bits >> 52 & 0x7FF;
+    uint16_t sign = bits >> 63 << 15;
+    if (exponent == 0x7FF || (exponent == 0 && bits << 1))
+        return 1;
+    if (exponent == 0) {
+        result->exp = sign;
+        result->fraction = 0;
+    } else {
+        result->exp = sign | (exponent - 1023 + 16383);
+        result->fraction = (uint64_t)1 << 63 | bits << 12 >> 1;
+    }
+    return 0;
+}
+
+// Checks if the host rounded an inexact result away from zero, which softfloat reports in C1. The sign of the rounding
+// error comes from the exact residual of the operation: the error term of a TwoSum for add and sub, an FMA for the
+// others. Operands and results of 24-bit operations are doubles that hold floats, so the same code works for both.
+static int fpu_fast_rounded_up(int op, double x, double y, double res)
+{
+    double d, s, bb;
+    switch (op) {
+    case 0:
+    case 4:
+        // TwoSum: the exact sum is s plus the error term. For 24-bit results, s - res is exact since the two are so close
+        if (op == 4)
+            y = -y;
+        s = x + y;
+        bb = s - x;
+        d = s - res;
+        if (d == 0)
+            d = (x - (s - bb)) + (y - bb);
+        break;
+    case 1:
+        s = x * y;
+        d = s - res;
+        if (d == 0)
+            d = fma(x, y, -s);
+        break;
+    case 2:
+        d = fma(-res, res, x); // x - res^2, so the exact root is larger than res if this is positive
+        break;
+    default:
+        d = fma(-res, y, x); // The exact quotient is res + d / y
+        if (y < 0)
+            d = -d;
+        break;
+    }
+    return res > 0 ? d < 0 : d > 0;
+}
+
+// Computes a basic operation on the host, selected by the low three bits of its opcode (0: add, 1: mul, 4: sub, 6: div),
+// or 2 for a square root of a. Returns 1 if the operation has to be done with softfloat instead.
+static int fpu_fast_arith(int op, floatx80 a, floatx80 b, floatx80* result)
+{
+    double x, y, res;
+    if (fpu_fast_unpack(a, fpu.fast_precision, &x) || fpu_fast_unpack(b, fpu.fast_precision, &y))
+        return 1;
+
+    // The operands are volatile so that the operation can't be moved outside of the flag checks
+    feclearexcept(FE_ALL_EXCEPT);
+    if (fpu.fast_precision == 24) {
+        volatile float fx = x, fy = y, fres;
+        switch (op) {
+        case 0:
+            fres = fx + fy;
+            break;
+        case 1:
+            fres = fx * fy;
+            break;
+        case 2:
+            fres = sqrtf(fx);
+            break;
+        case 4:
+            fres = fx - fy;
+            break;
+        default:
+            fres = fx / fy;
+            break;
+        }
+        if (fres != 0 && fabsf(fres) < FLT_MIN)
+            return 1;
+        res = fres;
+    } else {
+        volatile double dx = x, dy = y, dres;
+        switch (op) {
+        case 0:
+            dres = dx + dy;
+            break;
+        case 1:
+            dres = dx * dy;
+            break;
+        case 2:
+            dres = sqrt(dx);
+            break;
+        case 4:
+            dres = dx - dy;
+            break;
+        default:
+            dres = dx / dy;
+            break;
+        }
+        res = dres;
+    }
+    int flags = fetestexcept(FE_ALL_EXCEPT);
+    if (flags & ~FE_INEXACT || fpu_fast_pack(res, result))
+        return 1;
+    if (flags & FE_INEXACT) {
+        fpu.status.float_exception_flags |= float_flag_inexact;
+        if (fpu_fast_rounded_up(op, x, y, res))
+            set_float_rounding_up(&fpu.status);
+    }
+    return 0;
+}
+
+static const int arith_stats[8] = { FPU_STAT_FADD, FPU_STAT_FMUL, -1, -1, FPU_STAT_FSUB, FPU_STAT_FSUBR, FPU_STAT_FDIV, FPU_STAT_FDIVR };
+
+// FADD, FMUL, FSUB, FSUBR, FDIV, and FDIVR, selected by the low three bits of their opcodes. a is always ST0.
+static floatx80 fpu_arith(int op, floatx80 a, floatx80 b)
+{
+    floatx80 result;
+    int stat = arith_stats[op];
+    if (op == 5 || op == 7) { // FSUBR and FDIVR
+        result = a;
+        a = b;
+        b = result;
+        op--;
+    }
+    // Flags that are already set came from converting a memory operand, which softfloat might have to deal with
+    if (fpu.fast_precision && !fpu.status.float_exception_flags && !fpu_fast_arith(op, a, b, &result)) {
+        fpu_stats.fast[stat]++;
+        return result;
+    }
+    fpu_stats.softfloat[stat]++;
+    switch (op) {
+    case 0:
+        return floatx80_add(a, b, &fpu.status);
+    case 1:
+        return floatx80_mul(a, b, &fpu.status);
+    case 4:
+        return floatx80_sub(a, b, &fpu.status);
+    default:
+        return floatx80_div(a, b, &fpu.status);
+    }
+}
+static floatx80 fpu_sqrt(floatx80 a)
+{
+    floatx80 result;
+    if (fpu.fast_precision && !fpu_fast_arith(2, a, a, &result)) {
+        fpu_stats.fast[FPU_STAT_FSQRT]++;
+        return result;
+    }
+    fpu_stats.softfloat[FPU_STAT_FSQRT]++;
+    return floatx80_sqrt(a, &fpu.status);
 }
 
 static void fpu_state(void)
@@ -751,26 +960,8 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
         if (fpu_check_stack_underflow(0, 1) || fpu_check_stack_underflow(st_index, 1))
             FPU_ABORT();
 
-        switch (smaller_opcode & 7) {
-        case 0: // FADD - Floating point add
-            dst = floatx80_add(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
-            break;
-        case 1: // FMUL - Floating point multiply
-            dst = floatx80_mul(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
-            break;
-        case 4: // FSUB - Floating point subtract
-            dst = floatx80_sub(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
-            break;
-        case 5: // FSUBR - Floating point subtract reverse
-            dst = floatx80_sub(fpu_get_st(st_index), fpu_get_st(0), &fpu.status);
-            break;
-        case 6: // FDIV - Floating point divide
-            dst = floatx80_div(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
-            break;
-        case 7: // FDIVR - Floating point divide reverse
-            dst = floatx80_div(fpu_get_st(st_index), fpu_get_st(0), &fpu.status);
-            break;
-        }
+        // FADD, FMUL, FSUB, FSUBR, FDIV, or FDIVR
+        dst = fpu_arith(smaller_opcode & 7, fpu_get_st(0), fpu_get_st(st_index));
         if (!fpu_check_exceptions()) {
             if (smaller_opcode & 32) {
                 fpu_set_st(st_index, dst);
@@ -1025,7 +1216,7 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
             }
             return 0;
         case 2: // FSQRT - Compute sqrt(ST0)
-            dest = floatx80_sqrt(fpu_get_st(0), &fpu.status);
+            dest = fpu_sqrt(fpu_get_st(0));
             break;
         case 3: { // FSINCOS - Compute sin(ST0) and sin(ST1)
             // TODO: What if exceptions are masked?
@@ -1377,10 +1568,12 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
         floatx80 st0 = fpu_get_st(0);
         switch (op) {
         case 0: // FADD - Floating point add
-            st0 = floatx80_add(st0, temp80, &fpu.status);
-            break;
         case 1: // FMUL - Floating point multiply
-            st0 = floatx80_mul(st0, temp80, &fpu.status);
+        case 4: // FSUB - Floating point subtract
+        case 5: // FSUBR - Floating point subtract with reversed operands
+        case 6: // FDIV - Floating point divide
+        case 7: // FDIVR - Floating point divide with reversed operands
+            st0 = fpu_arith(op, st0, temp80);
             break;
         case 2: // FCOM - Floating point compare
         case 3: // FCOMP - Floating point compare and pop
@@ -1389,18 +1582,6 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
                     fpu_pop();
             }
             return 0;
-        case 4: // FSUB - Floating point subtract
-            st0 = floatx80_sub(st0, temp80, &fpu.status);
-            break;
-        case 5: // FSUBR - Floating point subtract with reversed operands
-            st0 = floatx80_sub(temp80, st0, &fpu.status);
-            break;
-        case 6: // FDIV - Floating point divide
-            st0 = floatx80_div(st0, temp80, &fpu.status);
-            break;
-        case 7: // FDIVR - Floating point divide with reversed operands
-            st0 = floatx80_div(temp80, st0, &fpu.status);
-            break;
         default: // FLD
             if (!fpu_check_exceptions())
                 fpu_push(temp80);
@@ -0,0 +1,380 @@
+// Simple dynamic recompiler for hot traces.
+// Traces that are looked up more than JIT_THRESHOLD times are translated into x86-64 code. Most instructions are compiled
+// into a direct call to their handler, followed by the same checks that cpu_execute does, so that there is no indirect
+// dispatch and no loop overhead between instructions. A handful of very common instructions (register moves, LEA, and
+// 32-bit loads and stores) are emitted inline. Memory accesses use the same TLB fast path as the cpu_read32 and
+// cpu_write32 macros and fall back to calling the handler if the TLB entry is invalid.
+// The compiled code replaces the handler of the first instruction in the trace, so cpu_execute needs no modifications.
+#ifdef DYNAREC
+#include "cpu/cpu.h"
+#include "cpu/opcodes.h"
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if !defined(__x86_64__) || defined(_WIN32)
+#error "The dynamic recompiler only supports x86-64 System V hosts"
+#endif
+
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+// Largest amount of code that a single instruction can compile to, with plenty of room to spare.
+#define JIT_MAX_INSN_SIZE 192
+
+// Handlers are stored as 32-bit offsets (see I_SET_HANDLER), so compiled code has to be close to the rest of the
+// emulator. Keeping the buffer in .bss guarantees that.
+static uint8_t jit_code[JIT_BUFFER_SIZE] __attribute__((aligned(4096)));
+static uint8_t *jit_buffer, *code;
+static uint32_t jit_usage;
+static int jit_reset_pending;
+
+#define CPU_OFFSET(field) (uint32_t) offsetof(struct cpu, field)
+#define REG32_OFFSET(r) (CPU_OFFSET(reg32) + (r)*4)
+
+// Host registers
+enum {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI
+};
+
+static void emit8(uint8_t x)
+{
+    *code++ = x;
+}
+static void emit32(uint32_t x)
+{
+    memcpy(code, &x, 4);
+    code += 4;
+}
+static void emit64(uint64_t x)
+{
+    memcpy(code, &x, 8);
+    code += 8;
+}
+
+// Emits a ModR/M byte referencing [rbx+disp32], which is where struct cpu is kept while compiled code is running
+static void emit_cpu_modrm(int reg, uint32_t offset)
+{
+    emit8(0x80 | reg << 3 | RBX);
+    emit32(offset);
+}
+// mov r64, imm64
+static void emit_mov_imm64(int reg, void* ptr)
+{
+    emit8(0x48);
+    emit8(0xB8 + reg);
+    emit64((uint64_t)(uintptr_t)ptr);
+}
+// jmp/jcc rel32 to an address that has already been emitted
+static void emit_jump(int cond, uint8_t* dest)
+{
+    if (cond < 0)
+        emit8(0xE9);
+    else {
+        emit8(0x0F);
+        emit8(0x80 | cond);
+    }
+    emit32((uint32_t)(dest - (code + 4)));
+}
+
+#define COND_E 4
+#define COND_NE 5
+#define JMP -1
+
+// Calls the handler of an instruction, leaving the next instruction pointer in rax
+static void emit_call_handler(struct decoded_instruction* i, insn_handler_t handler)
+{
+    emit_mov_imm64(RDI, i);
+    emit_mov_imm64(RAX, handler);
+    emit8(0xFF); // call rax
+    emit8(0xD0);
+}
+
+// If the handler branched or raised an exception, let cpu_execute run the new trace
+static void emit_check_next(struct decoded_instruction* i, uint8_t* exit_stub)
+{
+    emit_mov_imm64(RCX, i + 1);
+    emit8(0x48); // cmp rax, rcx
+    emit8(0x39);
+    emit8(0xC8);
+    emit_jump(COND_NE, exit_stub);
+}
+
+#ifndef INSTRUMENT
+// Helpers for emit_native, which leaves everything to the handlers in instrumented builds
+
+// mov r32, [rbx+offset]
+static void emit_load_cpu(int reg, uint32_t offset)
+{
+    emit8(0x8B);
+    emit_cpu_modrm(reg, offset);
+}
+// mov [rbx+offset], r32
+static void emit_store_cpu(int reg, uint32_t offset)
+{
+    emit8(0x89);
+    emit_cpu_modrm(reg, offset);
+}
+// jmp/jcc rel32 to an address that will be patched later with emit_patch_jump
+static uint8_t* emit_jump_forward(int cond)
+{
+    emit_jump(cond, code);
+    return code - 4;
+}
+static void emit_patch_jump(uint8_t* rel)
+{
+    uint32_t dist = (uint32_t)(code - (rel + 4));
+    memcpy(rel, &dist, 4);
+}
+
+// add dword [cpu.phys_eip], length
+static void emit_advance_eip(int length)
+{
+    emit8(0x83);
+    emit_cpu_modrm(0, CPU_OFFSET(phys_eip));
+    emit8(length);
+}
+
+// Computes the effective address of a memory operand into eax, clobbering ecx. Mirrors cpu_get_virtaddr and cpu_get_linaddr
+static void emit_effective_address(struct decoded_instruction* i, int linear)
+{
+    uint32_t flags = i->flags;
+    int base = I_BASE(flags), index = I_INDEX(flags), scale = I_SCALE(flags);
+
+    if (base == EZR) {
+        emit8(0xB8); // mov eax, imm32
+        emit32(i->disp32);
+    } else {
+        emit_load_cpu(RAX, REG32_OFFSET(base));
+        if (i->disp32) {
+            emit8(0x05); // add eax, imm32
+            emit32(i->disp32);
+        }
+    }
+    if (index != EZR) {
+        emit_load_cpu(RCX, REG32_OFFSET(index));
+        if (scale) {
+            emit8(0xC1); // shl ecx, imm8
+            emit8(0xE1);
+            emit8(scale);
+        }
+        emit8(0x01); // add eax, ecx
+        emit8(0xC8);
+    }
+    if (flags & (1 << I_ADDR16_SHIFT)) {
+        emit8(0x0F); // movzx eax, ax
+        emit8(0xB7);
+        emit8(0xC0);
+    }
+    if (linear) {
+        emit8(0x03); // add eax, [cpu.seg_base[seg]]
+        emit_cpu_modrm(RAX, CPU_OFFSET(seg_base) + (I_SEG_BASE(flags)) * 4);
+    }
+}
+
+// Looks up the linear address in eax in the TLB. If the entry is valid for a 32-bit access, rcx will contain the TLB
+// pointer for the page. Otherwise, jumps to the returned location, which needs to be patched. Clobbers rdx, rsi and rdi.
+static uint8_t* emit_tlb_lookup32(uint32_t shift_offset)
+{
+    emit8(0x89); // mov edx, eax
+    emit8(0xC2);
+    emit8(0xC1); // shr edx, 22
+    emit8(0xEA);
+    emit8(12 + TLB_TABLE_SHIFT);
+    emit8(0x48); // mov rdx, [rbx+rdx*8+tlb_dir]
+    emit8(0x8B);
+    emit8(0x94);
+    emit8(0xD3);
+    emit32(CPU_OFFSET(tlb_dir));
+    emit8(0x89); // mov edi, eax
+    emit8(0xC7);
+    emit8(0xC1); // shr edi, 12
+    emit8(0xEF);
+    emit8(12);
+    emit8(0x81); // and edi, TLB_TABLE_ENTRIES - 1
+    emit8(0xE7);
+    emit32(TLB_TABLE_ENTRIES - 1);
+    emit8(0x0F); // movzx esi, byte [rdx+rdi+tags]
+    emit8(0xB6);
+    emit8(0xB4);
+    emit8(0x3A);
+    emit32(offsetof(struct tlb_table, tags));
+    emit_load_cpu(RCX, shift_offset); // mov ecx, [cpu.tlb_shift_*]
+    emit8(0xD3); // shr esi, cl
+    emit8(0xEE);
+    emit8(0x09); // or esi, eax
+    emit8(0xC6);
+    emit8(0xF7); // test esi, 3
+    emit8(0xC6);
+    emit32(3);
+    uint8_t* slow = emit_jump_forward(COND_NE);
+    emit8(0x48); // mov rcx, [rdx+rdi*8+ptr]
+    emit8(0x8B);
+    emit8(0x8C);
+    emit8(0xFA);
+    emit32(offsetof(struct tlb_table, ptr));
+    return slow;
+}
+#endif
+
+// Tries to compile an instruction inline. Returns 0 if the handler has to be called.
+static int emit_native(struct decoded_instruction* i, insn_handler_t handler, uint8_t* exit_stub)
+{
+#ifdef INSTRUMENT
+    // Instrumentation callbacks are run by the handlers themselves
+    UNUSED(i);
+    UNUSED(handler);
+    UNUSED(exit_stub);
+    return 0;
+#else
+    uint32_t flags = i->flags;
+    uint8_t* slow;
+    if (handler == op_mov_r32i32) {
+        emit8(0xC7); // mov dword [cpu.reg32[rm]], imm32
+        emit_cpu_modrm(0, REG32_OFFSET(I_RM(flags)));
+        emit32(i->imm32);
+    } else if (handler == op_mov_r32r32) {
+        emit_load_cpu(RAX, REG32_OFFSET(I_REG(flags)));
+        emit_store_cpu(RAX, REG32_OFFSET(I_RM(flags)));
+    } else if (handler == op_lea_r32e32) {
+        emit_effective_address(i, 0);
+        emit_store_cpu(RAX, REG32_OFFSET(I_REG(flags)));
+    } else if (handler == op_mov_r32e32) {
+        emit_effective_address(i, 1);
+        slow = emit_tlb_lookup32(CPU_OFFSET(tlb_shift_read));
+        emit8(0x8B); // mov eax, [rcx+rax]
+        emit8(0x04);
+        emit8(0x01);
+        emit_store_cpu(RAX, REG32_OFFSET(I_REG(flags)));
+        goto memory_access;
+    } else if (handler == op_mov_e32r32) {
+        emit_effective_address(i, 1);
+        slow = emit_tlb_lookup32(CPU_OFFSET(tlb_shift_write));
+        emit_load_cpu(RDI, REG32_OFFSET(I_REG(flags)));
+        emit8(0x89); // mov [rcx+rax], edi
+        emit8(0x3C);
+        emit8(0x01);
+        goto memory_access;
+    } else
+        return 0;
+
+    emit_advance_eip(I_LENGTH(flags));
+    emit_mov_imm64(RAX, i + 1);
+    return 1;
+
+memory_access:
+    // Fast path done, skip over the call to the handler
+    emit_advance_eip(I_LENGTH(flags));
+    emit_mov_imm64(RAX, i + 1);
+    uint8_t* done = emit_jump_forward(JMP);
+    emit_patch_jump(slow);
+    emit_call_handler(i, handler);
+    emit_check_next(i, exit_stub);
+    emit_patch_jump(done);
+    return 1;
+#endif
+}
+
+void cpu_jit_init(void)
+{
+    jit_buffer = jit_code;
+#ifndef HANDLER_POINTERS
+    intptr_t start = (uintptr_t)jit_buffer - I_HANDLER_BASE, end = start + JIT_BUFFER_SIZE;
+    if (start < INT32_MIN || end > INT32_MAX) {
+        CPU_LOG("Dynamic recompiler buffer is out of range, running in interpreter-only mode\n");
+        jit_buffer = NULL;
+    }
+#endif
+    if (jit_buffer && mprotect(jit_buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC)) {
+        CPU_LOG("Unable to make dynamic recompiler buffer executable, running in interpreter-only mode\n");
+        jit_buffer = NULL;
+    }
+    jit_usage = 0;
+    jit_reset_pending = 0;
+}
+
+// Called whenever the trace cache is flushed. All compiled code is unreachable after the flush, but the buffer cannot be
+// reused until we are sure that none of it is running.
+void cpu_jit_flush(void)
+{
+    jit_reset_pending = 1;
+}
+
+// Called from cpu_execute, before any compiled code could be running
+void cpu_jit_reset(void)
+{
+    if (jit_reset_pending) {
+        jit_usage = 0;
+        jit_reset_pending = 0;
+    }
+}
+
+// Handlers of fused instruction pairs, which return the instruction after the pair
+static int is_fused(insn_handler_t handler)
+{
+    return handler == op_dec_r32_jnz32;
+}
+
+void cpu_jit_compile(struct trace_info* info)
+{
+    struct decoded_instruction* i = info->ptr;
+    int count = TRACE_INSNS(info->flags);
+    // After a flush, the buffer is rewound by the next cpu_execute. Code compiled before then would be overwritten while
+    // its trace is still valid, so leave the trace to the interpreter until it is decoded again.
+    if (!jit_buffer || count < 2 || jit_reset_pending)
+        return;
+    if (jit_usage + (count + 1) * JIT_MAX_INSN_SIZE > JIT_BUFFER_SIZE) {
+        // Out of space. Since old regions of the trace cache are evicted instead of flushed, we may never reach the
+        // next flush on our own. Flushing makes all compiled code unreachable so that the buffer can be reused.
+        cpu_trace_flush();
+        return;
+    }
+
+    code = jit_buffer + jit_usage;
+
+    // Common exit path. rax contains the next instruction that cpu_execute should run.
+    uint8_t* exit_stub = code;
+    emit8(0x5B); // pop rbx
+    emit8(0xC3); // ret
+
+    uint8_t* entry = code;
+    emit8(0x53); // push rbx
+    emit_mov_imm64(RBX, &cpu);
+
+    for (int k = 0; k < count; k++) {
+        insn_handler_t handler = I_HANDLER(&i[k]);
+        if (k == count - 1) {
+            // The last instruction always ends the trace
+            emit_call_handler(&i[k], handler);
+            emit_jump(JMP, exit_stub);
+            break;
+        }
+
+        if (is_fused(handler) && k + 1 < count - 1) {
+            // Fused pairs skip over their second instruction
+            emit_call_handler(&i[k], handler);
+            emit_check_next(&i[k + 1], exit_stub);
+            k++;
+        } else if (!emit_native(&i[k], handler, exit_stub)) {
+            emit_call_handler(&i[k], handler);
+            emit_check_next(&i[k], exit_stub);
+        }
+
+        // Same as the "if (!--cpu.cycles_to_run) break;" in cpu_execute. The final decrement is done by cpu_execute
+        emit8(0x83); // cmp dword [cpu.cycles_to_run], 1
+        emit_cpu_modrm(7, CPU_OFFSET(cycles_to_run));
+        emit8(1);
+        emit_jump(COND_E, exit_stub);
+        emit8(0xFF); // dec dword [cpu.cycles_to_run]
+        emit_cpu_modrm(1, CPU_OFFSET(cycles_to_run));
+    }
+
+    jit_usage = (code - jit_buffer + 15) & ~15;
+    I_SET_HANDLER(&i[0], entry);
+}
+#endif
@@ -350,6 +350,7 @@ int cpu_set_state(int id, uint32_t value)
         break;
     case CPU_STATE_HASH:
         cpu.state_hash = value;
+        cpu_trace_select_partition();
         break;
     case CPU_SEG:
         if (cpu.cr[0] & CR0_PE) {
@@ -384,6 +385,7 @@ void cpu_init_32bit(void)
     cpu.esp_mask = -1;
     // Set translation mode to 32-bit
     cpu.state_hash = 0;
+    cpu_trace_select_partition();
     cpu.memory_size = -1;
 
     cpu.seg_base[CS] = cpu.seg_base[DS] = cpu.seg_base[SS] = 0;
@@ -2,6 +2,8 @@
 #include "cpu/cpu.h"
 #include "cpu/instrument.h"
 #include "io.h"
+#include <stdlib.h>
+#include <string.h>
 
 #define EXCEPTION_HANDLER return 1
 
@@ -13,36 +15,78 @@ void* get_lin_ram_ptr(uint32_t addr, int flags, int* fault);
 #define get_lin_ram_ptr(a, b) NULL
 #endif
 
-void cpu_mmu_tlb_flush(void)
+// Shared by every region of the address space that has no TLB entries
+static struct tlb_table tlb_empty_table;
+
+// Frees every TLB table. Only safe if none of them has valid entries left
+static void tlb_free_tables(void)
 {
-    for (unsigned int i = 0; i < cpu.tlb_entry_count; i++) {
-        uint32_t entry = cpu.tlb_entry_indexes[i];
-        if (entry == (uint32_t)-1)
-            continue; // Don't flush entries we have already flushed
-        cpu.tlb[entry] = NULL;
-        cpu.tlb_tags[entry] = 0xFF;
-        cpu.tlb_entry_indexes[i] = -1;
-        cpu.tlb_attrs[entry] = 0xFF;
+    for (unsigned int i = 0; i < sizeof(cpu.tlb_dir) / sizeof(cpu.tlb_dir[0]); i++) {
+        if (cpu.tlb_dir[i] != &tlb_empty_table)
+            free(cpu.tlb_dir[i]);
+        cpu.tlb_dir[i] = &tlb_empty_table;
     }
-    cpu.tlb_entry_count = 0;
 }
-void cpu_mmu_tlb_flush_nonglobal(void)
+
+// Returns the TLB table that holds the entry for a page, allocating it if needed
+static struct tlb_table* tlb_table_for(uint32_t page)
+{
+    struct tlb_table** slot = &cpu.tlb_dir[page >> TLB_TABLE_SHIFT];
+    if (*slot == &tlb_empty_table) {
+        struct tlb_table* table = malloc(sizeof(struct tlb_table));
+        if (!table)
+            CPU_FATAL("Unable to allocate TLB table\n");
+        memset(table->ptr, 0, sizeof(table->ptr));
+        memset(table->tags, 0xFF, sizeof(table->tags));
+        memset(table->attrs, 0xFF, sizeof(table->attrs));
+        *slot = table;
+    }
+    return *slot;
+}
+
+static void tlb_flush_entries(void)
 {
     for (unsigned int i = 0; i < cpu.tlb_entry_count; i++) {
         uint32_t entry = cpu.tlb_entry_indexes[i];
         if (entry == (uint32_t)-1)
             continue; // Don't flush entries we have already flushed
-        if ((cpu.tlb_attrs[entry] & TLB_ATTR_NON_GLOBAL) == 0)
-            continue;
-        cpu.tlb[entry] = NULL;
-        cpu.tlb_tags[entry] = 0xFF;
+        TLB_PTR(entry) = NULL;
+        TLB_TAGS(entry) = 0xFF;
         cpu.tlb_entry_indexes[i] = -1;
-        cpu.tlb_attrs[entry] = 0xFF;
+        TLB_ATTRS(entry) = 0xFF;
     }
-    cpu.tlb_entry_count = cpu.tlb_entry_count; // We may still have global entries.
+    cpu.tlb_entry_count = 0;
+    cpu.stats.tlb_flushes++;
+}
+void cpu_mmu_tlb_flush(void)
+{
+    tlb_flush_entries();
+    tlb_free_tables();
+    cpu.devram_writable_count = 0;
+    // Saved address spaces were translated under the old paging mode, so they have to go too
+    for (int i = 0; i < TLB_CONTEXTS; i++)
+        cpu.tlb_contexts[i].count = 0;
 }
 
-static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user, int write, int global, int nx)
+// Returns 1 if writes to a page in RAM have to go through the slow path even though the page is writable
+static int tlb_write_check(uint32_t phys)
+{
+#ifdef SMC_PROTECT
+    if (cpu_smc_page_has_code(phys) && !cpu.smc_protect) // Otherwise, the host catches writes to the page for us
+#else
+    if (cpu_smc_page_has_code(phys))
+#endif
+        return 1;
+
+    // Writes to device memory have to mark its pages as dirty
+    if (phys - cpu.devram_base < cpu.devram_size)
+        return 1;
+
+    // Writes to cached page directory entries have to be seen by cpu_mmu_pde_write
+    return phys < cpu.memory_size && cpu.pde_cache_refs && cpu.pde_cache_refs[phys >> 12];
+}
+
+static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user, int write, int global, int nx, struct tlb_source* src)
 {
     // Mask out the A20 gate line here so that we don't have to do it after every access
     phys &= cpu.a20_mask;
@@ -60,14 +104,20 @@ static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user,
         tag = 1;
         tag_write = 1;
     }
+#ifndef LIBCPU
+    // Device memory can be read directly. Writes still take the slow path until cpu_mmu_devram_write lets them through
+    if (phys - cpu.devram_base < cpu.devram_size) {
+        ptr = cpu.devram + (phys - cpu.devram_base);
+        tag = 0;
+    }
+#endif
 
-    if (cpu_smc_page_has_code(phys)) {
-        // Make sure that the flag is set.
+    if (tlb_write_check(phys))
         tag_write = 1;
-    }
 
-    if (cpu.tlb_entry_count >= MAX_TLB_ENTRIES) { // Flush TLB
-        cpu_mmu_tlb_flush();
+    if (cpu.tlb_entry_count >= cpu.max_tlb_entries) { // Flush TLB
+        tlb_flush_entries();
+        cpu.stats.tlb_full_flushes++;
 #ifdef INSTRUMENT
         cpu_instrument_tlb_full();
 #endif
@@ -79,12 +129,225 @@ static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user,
         user_write = (tag_write | ((!user | !write) ? 3 : 0)) << TLB_USER_WRITE;
 
     uint32_t entry = lin >> 12;
+    cpu.stats.tlb_fills++;
+    tlb_table_for(entry);
+    struct tlb_source* dest = &cpu.tlb_entry_sources[cpu.tlb_entry_count];
+    if (src)
+        *dest = *src;
+    else
+        dest->pde_addr = -1;
+    dest->phys = phys;
     cpu.tlb_entry_indexes[cpu.tlb_entry_count++] = entry;
-    cpu.tlb_attrs[entry] = (nx ? TLB_ATTR_NX : 0) | (global ? 0 : TLB_ATTR_NON_GLOBAL);
+    TLB_ATTRS(entry) = (nx ? TLB_ATTR_NX : 0) | (global ? 0 : TLB_ATTR_NON_GLOBAL);
     if (!ptr)
         ptr = get_phys_ram_ptr(phys, write);
-    cpu.tlb[entry] = (void*)(((uintptr_t)ptr) - lin);
-    cpu.tlb_tags[entry] = system_read | system_write | user_read | user_write;
+    TLB_PTR(entry) = (void*)(((uintptr_t)ptr) - lin);
+    TLB_TAGS(entry) = system_read | system_write | user_read | user_write;
+}
+
+// Paging structures in MMIO space can't be read back without side effects
+static int tlb_source_ram(struct tlb_source* src)
+{
+    if (src->pde_addr == (uint32_t)-1)
+        return 0;
+    uint32_t addrs[3] = { src->pdpte_addr, src->pde_addr, src->pte_addr };
+    for (int i = 0; i < 3; i++) {
+        if (addrs[i] != (uint32_t)-1 && (addrs[i] > cpu.memory_size - 8 || (addrs[i] >= 0xA0000 && addrs[i] < 0xC0000)))
+            return 0;
+    }
+    return 1;
+}
+
+// The guest may have changed the page tables of an address space while it wasn't running, since it expects the TLB
+// to be flushed when CR3 is reloaded. A saved entry can only be used if everything it was built from is unchanged.
+static int tlb_source_valid(struct tlb_source* src)
+{
+    if (src->pdpte_addr != (uint32_t)-1) {
+        if (MEM32(src->pdpte_addr) != src->pdpte || MEM32(src->pde_addr + 4) != src->pde2)
+            return 0;
+    }
+    if (MEM32(src->pde_addr) != src->pde)
+        return 0;
+    return src->pte_addr == (uint32_t)-1 || MEM32(src->pte_addr) == src->pte;
+}
+
+static struct tlb_context* tlb_context_find(uint32_t cr3)
+{
+    for (int i = 0; i < TLB_CONTEXTS; i++) {
+        if (cpu.tlb_contexts[i].count && cpu.tlb_contexts[i].cr3 == cr3)
+            return &cpu.tlb_contexts[i];
+    }
+    return NULL;
+}
+
+// Returns an unused context, or the one that was saved the longest time ago
+static struct tlb_context* tlb_context_alloc(uint32_t cr3)
+{
+    struct tlb_context* ctx = tlb_context_find(cr3);
+    for (int i = 0; i < TLB_CONTEXTS && !ctx; i++) {
+        if (!cpu.tlb_contexts[i].count)
+            ctx = &cpu.tlb_contexts[i];
+    }
+    if (!ctx) {
+        ctx = &cpu.tlb_contexts[0];
+        for (int i = 1; i < TLB_CONTEXTS; i++) {
+            if (cpu.tlb_contexts[i].age < ctx->age)
+                ctx = &cpu.tlb_contexts[i];
+        }
+    }
+    ctx->cr3 = cr3;
+    ctx->count = 0;
+    ctx->age = cpu.tlb_context_age++;
+    return ctx;
+}
+
+// Called after CR3 has been written, even if it was reloaded with the same value. Instead of throwing away the non-global entries of the old address space, they
+// are moved into one of a few saved contexts, and the entries of the new address space are put back into the TLB if
+// it was saved earlier. Multitasking guests tend to switch between a handful of address spaces, and every switch
+// would otherwise have to walk the page tables again for every page that the process touches.
+void cpu_mmu_tlb_switch(uint32_t old_cr3)
+{
+    int flush_all = !(cpu.cr[4] & CR4_PGE), switching = (cpu.cr[0] & CR0_PG) && old_cr3 != cpu.cr[3];
+    struct tlb_context* ctx = NULL;
+    if (switching)
+        ctx = tlb_context_alloc(old_cr3);
+
+    // Go from newest to oldest, so that only the most recent fill of a page is saved
+    for (unsigned int i = cpu.tlb_entry_count; i-- > 0;) {
+        uint32_t entry = cpu.tlb_entry_indexes[i];
+        if (entry == (uint32_t)-1)
+            continue;
+        if (TLB_TAGS(entry) == 0xFF) {
+            cpu.tlb_entry_indexes[i] = -1; // Invalidated or already saved
+            continue;
+        }
+        if (!flush_all && (TLB_ATTRS(entry) & TLB_ATTR_NON_GLOBAL) == 0)
+            continue;
+
+        struct tlb_source* src = &cpu.tlb_entry_sources[i];
+        if (ctx && tlb_source_ram(src)) {
+            struct tlb_saved_entry* saved = &ctx->entries[ctx->count++];
+            saved->ptr = TLB_PTR(entry);
+            saved->entry = entry;
+            saved->tags = TLB_TAGS(entry);
+            saved->attrs = TLB_ATTRS(entry);
+            saved->src = *src;
+        }
+        TLB_PTR(entry) = NULL;
+        TLB_TAGS(entry) = 0xFF;
+        TLB_ATTRS(entry) = 0xFF;
+        cpu.tlb_entry_indexes[i] = -1;
+    }
+
+    // Remove the holes left behind by the flushed entries
+    uint32_t count = 0;
+    for (unsigned int i = 0; i < cpu.tlb_entry_count; i++) {
+        if (cpu.tlb_entry_indexes[i] == (uint32_t)-1)
+            continue;
+        cpu.tlb_entry_indexes[count] = cpu.tlb_entry_indexes[i];
+        cpu.tlb_entry_sources[count++] = cpu.tlb_entry_sources[i];
+    }
+    cpu.tlb_entry_count = count;
+    if (flush_all)
+        cpu.stats.tlb_flushes++;
+    else
+        cpu.stats.tlb_nonglobal_flushes++;
+
+    if (!switching || !(ctx = tlb_context_find(cpu.cr[3])))
+        return;
+    cpu.stats.tlb_context_hits++;
+    for (unsigned int i = 0; i < ctx->count && cpu.tlb_entry_count < cpu.max_tlb_entries; i++) {
+        struct tlb_saved_entry* saved = &ctx->entries[i];
+        // Skip pages that a global entry already covers
+        if (TLB_TAGS(saved->entry) != 0xFF || !tlb_source_valid(&saved->src))
+            continue;
+        uint8_t tags = saved->tags;
+        if (tlb_write_check(saved->src.phys)) // Code may have been found in the page in the meantime
+            tags |= 1 << TLB_SYSTEM_WRITE | 1 << TLB_USER_WRITE;
+        tlb_table_for(saved->entry);
+        TLB_PTR(saved->entry) = saved->ptr;
+        TLB_TAGS(saved->entry) = tags;
+        TLB_ATTRS(saved->entry) = saved->attrs;
+        cpu.tlb_entry_sources[cpu.tlb_entry_count] = saved->src;
+        cpu.tlb_entry_indexes[cpu.tlb_entry_count++] = saved->entry;
+        cpu.stats.tlb_context_restores++;
+    }
+    ctx->count = 0;
+}
+
+// Brings the TLB back to its initial state, with every table freed
+void cpu_mmu_tlb_reset(void)
+{
+    memset(tlb_empty_table.ptr, 0, sizeof(tlb_empty_table.ptr));
+    memset(tlb_empty_table.tags, 0xFF, sizeof(tlb_empty_table.tags));
+    memset(tlb_empty_table.attrs, 0xFF, sizeof(tlb_empty_table.attrs));
+    for (unsigned int i = 0; i < sizeof(cpu.tlb_dir) / sizeof(cpu.tlb_dir[0]); i++) {
+        if (!cpu.tlb_dir[i])
+            cpu.tlb_dir[i] = &tlb_empty_table;
+    }
+    cpu_mmu_tlb_flush();
+}
+
+void cpu_map_device_ram(uint32_t base, uint32_t size, void* ptr)
+{
+#ifdef RECORD
+    // src/record.c has to see every read from the device, so leave it to the MMIO handlers
+    ptr = NULL;
+#endif
+    size = ptr ? size & ~0xFFF : 0;
+    if (cpu.devram == ptr && cpu.devram_base == base && cpu.devram_size == size)
+        return;
+    // Entries for the old mapping, or for the MMIO handlers that were there before, are no longer valid
+    cpu_mmu_tlb_flush();
+    free(cpu.devram_dirty);
+    free(cpu.devram_writable);
+    cpu.devram = ptr;
+    cpu.devram_base = base;
+    cpu.devram_size = size;
+    cpu.devram_dirty = NULL;
+    cpu.devram_writable = NULL;
+    if (size) {
+        cpu.devram_dirty = calloc(((size >> 12) + 31) >> 5, 4);
+        cpu.devram_writable = malloc((size >> 12) * 4);
+        if (!cpu.devram_dirty || !cpu.devram_writable)
+            CPU_FATAL("Unable to allocate device memory bitmaps\n");
+    }
+}
+
+// Called by the slow path on a write to device memory. Marks the page as dirty and lets further writes through the TLB
+// entry of lin go straight to memory, until cpu_get_device_ram_dirty protects the page again
+void cpu_mmu_devram_write(uint32_t lin, uint32_t phys)
+{
+    uint32_t page = (phys - cpu.devram_base) >> 12, entry = lin >> 12;
+    cpu.devram_dirty[page >> 5] |= 1 << (page & 31);
+
+    // Only clear the slow path bit of the fields that allow writes in the first place
+    uint8_t tags = TLB_TAGS(entry);
+    if (!(tags & 2 << TLB_SYSTEM_WRITE))
+        tags &= ~(1 << TLB_SYSTEM_WRITE);
+    if (!(tags & 2 << TLB_USER_WRITE))
+        tags &= ~(1 << TLB_USER_WRITE);
+    // Unaligned accesses come here even if the entry is already writable. If the list is full, the page simply stays
+    // write protected, which is slower but still correct
+    if (tags == TLB_TAGS(entry) || cpu.devram_writable_count == cpu.devram_size >> 12)
+        return;
+    TLB_TAGS(entry) = tags;
+    cpu.devram_writable[cpu.devram_writable_count++] = entry;
+}
+
+int cpu_get_device_ram_dirty(uint32_t* dirty)
+{
+    int modified = 0;
+    for (unsigned int i = 0; i < ((cpu.devram_size >> 12) + 31) >> 5; i++) {
+        dirty[i] = cpu.devram_dirty[i];
+        modified |= dirty[i] != 0;
+        cpu.devram_dirty[i] = 0;
+    }
+    // Catch the next write to the pages. If an entry has been replaced in the meantime, its writes are only slowed down
+    for (unsigned int i = 0; i < cpu.devram_writable_count; i++)
+        TLB_TAGS(cpu.devram_writable[i]) |= 1 << TLB_SYSTEM_WRITE | 1 << TLB_USER_WRITE;
+    cpu.devram_writable_count = 0;
+    return modified;
 }
 
 uint32_t cpu_read_phys(uint32_t addr)
@@ -98,8 +361,115 @@ static void cpu_write_phys(uint32_t addr, uint32_t data)
 {
     if (addr >= cpu.memory_size || (addr >= 0xA0000 && addr < 0xC0000))
         io_handle_mmio_write(addr, data, 2);
-    else
+    else {
         MEM32(addr) = data;
+        cpu_mmu_pde_write(addr, 4);
+    }
+}
+
+// Page directory entries are kept in a small direct mapped cache, tagged with CR3 and the paging mode, so that they
+// survive TLB flushes and address space switches. Only entries that are present and already have their accessed bit
+// set are cached, so a cache hit never has to write anything back. Every physical page that a cached entry was read
+// from has its writes routed through the slow path of the TLB, where cpu_mmu_pde_write drops the stale entries.
+#define PDE_CACHE_VALID 4
+
+static uint32_t pde_cache_tag(void)
+{
+    uint32_t tag = (cpu.cr[3] & ~31) | PDE_CACHE_VALID;
+    if (cpu.cr[4] & CR4_PAE)
+        tag |= 1 | (cpu.ia32_efer >> 10 & 2); // EFER.NXE changes which bits are reserved
+    return tag;
+}
+
+static inline struct pde_cache_entry* pde_cache_entry(uint32_t region)
+{
+    return &cpu.pde_cache[(region ^ cpu.cr[3] >> 12) & (PDE_CACHE_SIZE - 1)];
+}
+
+static struct pde_cache_entry* pde_cache_lookup(uint32_t region)
+{
+    struct pde_cache_entry* entry = pde_cache_entry(region);
+    if (entry->tag == pde_cache_tag() && entry->region == region) {
+        cpu.stats.pde_cache_hits++;
+        return entry;
+    }
+    cpu.stats.pde_cache_misses++;
+    return NULL;
+}
+
+static int pde_cache_ram(uint32_t addr)
+{
+    return addr < cpu.memory_size && !(addr >= 0xA0000 && addr < 0xC0000);
+}
+
+static void pde_cache_ref(uint32_t addr)
+{
+    uint32_t page = addr >> 12, base = addr & ~0xFFF;
+    if (cpu.pde_cache_refs[page]++)
+        return;
+
+    // The page may already be mapped writable in the TLB, so take away the fast write path from those entries
+    uint8_t* ptr = get_phys_ram_ptr(base, 0);
+    for (unsigned int i = 0; i < cpu.tlb_entry_count; i++) {
+        uint32_t entry = cpu.tlb_entry_indexes[i];
+        if (entry != (uint32_t)-1 && (uint8_t*)TLB_PTR(entry) + (entry << 12) == ptr)
+            TLB_TAGS(entry) |= 1 << TLB_SYSTEM_WRITE | 1 << TLB_USER_WRITE;
+    }
+}
+
+static void pde_cache_drop(struct pde_cache_entry* entry)
+{
+    if (!entry->tag)
+        return;
+    cpu.pde_cache_refs[entry->pde_addr >> 12]--;
+    if (entry->pdpte_addr != (uint32_t)-1)
+        cpu.pde_cache_refs[entry->pdpte_addr >> 12]--;
+    entry->tag = 0;
+}
+
+static void pde_cache_insert(uint32_t region, uint32_t pdpte_addr, uint32_t pdpte, uint32_t pde_addr, uint32_t pde, uint32_t pde2)
+{
+    if (!cpu.pde_cache_refs || (pde & 0x21) != 0x21)
+        return;
+    if (!pde_cache_ram(pde_addr) || (pdpte_addr != (uint32_t)-1 && !pde_cache_ram(pdpte_addr)))
+        return;
+
+    struct pde_cache_entry* entry = pde_cache_entry(region);
+    pde_cache_drop(entry);
+    pde_cache_ref(pde_addr);
+    if (pdpte_addr != (uint32_t)-1)
+        pde_cache_ref(pdpte_addr);
+    entry->tag = pde_cache_tag();
+    entry->region = region;
+    entry->pdpte_addr = pdpte_addr;
+    entry->pdpte = pdpte;
+    entry->pde_addr = pde_addr;
+    entry->pde = pde;
+    entry->pde2 = pde2;
+}
+
+void cpu_mmu_pde_cache_flush(void)
+{
+    memset(cpu.pde_cache, 0, sizeof(cpu.pde_cache));
+    if (cpu.pde_cache_refs)
+        memset(cpu.pde_cache_refs, 0, cpu.smc_has_code_length * sizeof(uint16_t));
+}
+
+// Called whenever guest RAM is modified through the slow path. Drops the cached entries that overlap the write.
+void cpu_mmu_pde_write(uint32_t phys, uint32_t length)
+{
+    if (!cpu.pde_cache_refs || phys >= cpu.memory_size || !cpu.pde_cache_refs[phys >> 12])
+        return;
+    uint32_t end = phys + length;
+    for (int i = 0; i < PDE_CACHE_SIZE; i++) {
+        struct pde_cache_entry* entry = &cpu.pde_cache[i];
+        if (!entry->tag)
+            continue;
+        // Both kinds of entries are 8 bytes in PAE mode. Without PAE, the extra dword only causes spurious drops
+        if ((entry->pde_addr < end && phys < entry->pde_addr + 8)
+            || (entry->pdpte_addr != (uint32_t)-1 && entry->pdpte_addr < end && phys < entry->pdpte_addr + 8))
+            pde_cache_drop(entry);
+    }
 }
 
 // Checks reserved fields for error. disable for speed.
@@ -117,13 +487,13 @@ int cpu_mmu_translate(uint32_t lin, int shift)
         // Otherwise, continue
     } else {
         int write = shift >> 1 & 1, user = shift >> 2 & 1;
-        cpu_set_tlb_entry(lin & ~0xFFF, lin & ~0xFFF, ptr, write, user, 0, 0);
+        cpu_set_tlb_entry(lin & ~0xFFF, lin & ~0xFFF, ptr, write, user, 0, 0, NULL);
 
         return 0;
     }
 #endif
     if (!(cpu.cr[0] & CR0_PG)) {
-        cpu_set_tlb_entry(lin & ~0xFFF, lin & ~0xFFF, NULL, 1, 1, 0, 0);
+        cpu_set_tlb_entry(lin & ~0xFFF, lin & ~0xFFF, NULL, 1, 1, 0, 0, NULL);
         return 0; // No page faults at all!
     } else {
         int execute = shift & 8;
@@ -143,7 +513,13 @@ int cpu_mmu_translate(uint32_t lin, int shift)
             uint32_t page_directory_entry_addr = cpu.cr[3] + (lin >> 20 & 0xFFC),
                      page_directory_entry = -1, page_table_entry_addr = -1, page_table_entry = -1;
 
-            page_directory_entry = cpu_read_phys(page_directory_entry_addr);
+            struct pde_cache_entry* cached = pde_cache_lookup(lin >> 22);
+            if (cached)
+                page_directory_entry = cached->pde;
+            else {
+                page_directory_entry = cpu_read_phys(page_directory_entry_addr);
+                pde_cache_insert(lin >> 22, -1, 0, page_directory_entry_addr, page_directory_entry, 0);
+            }
 
             if (!(page_directory_entry & 1)) {
                 // Not present
@@ -166,7 +542,8 @@ int cpu_mmu_translate(uint32_t lin, int shift)
 #endif
                 }
                 uint32_t phys = (page_directory_entry & 0xFFC00000) | (lin & 0x3FF000);
-                cpu_set_tlb_entry(lin & ~0xFFF, phys, NULL, user, write, page_directory_entry & 0x100, 0);
+                struct tlb_source src = { 0, -1, page_directory_entry_addr, -1, 0, new_page_dierctory_entry, 0, 0 };
+                cpu_set_tlb_entry(lin & ~0xFFF, phys, NULL, user, write, page_directory_entry & 0x100, 0, &src);
             } else {
                 page_table_entry = cpu_read_phys(page_table_entry_addr);
 
@@ -223,7 +600,8 @@ int cpu_mmu_translate(uint32_t lin, int shift)
 #endif
                 }
                 //if(lin == 0xe1001332) __asm__("int3");
-                cpu_set_tlb_entry(lin & ~0xFFF, page_table_entry & ~0xFFF, NULL, user, write, page_table_entry & 0x100, 0);
+                struct tlb_source src = { 0, -1, page_directory_entry_addr, page_table_entry_addr, 0, page_directory_entry | 0x20, 0, new_page_table_entry };
+                cpu_set_tlb_entry(lin & ~0xFFF, page_table_entry & ~0xFFF, NULL, user, write, page_table_entry & 0x100, 0, &src);
             }
             return 0;
         // A page fault has occurred
@@ -244,30 +622,40 @@ int cpu_mmu_translate(uint32_t lin, int shift)
             // http://www.rcollins.org/ddj/Jul96/
             // https://www.intel.com/content/dam/www/public/us/en/documents/manuals/64-ia-32-architectures-software-developer-vol-3a-part-1-manual.pdf (page 117)
             // Note that we only support 3 GB of RAM at max, so we're OK with ignoring the top bits
-            uint32_t pdp_addr = (cpu.cr[3] & ~31) | (lin >> 27 & 0x18),
-                     pdpte = cpu_read_phys(pdp_addr);
+            uint32_t pdp_addr = (cpu.cr[3] & ~31) | (lin >> 27 & 0x18), pdpte, pde_addr, pde, pde2;
             int fail = (write << 1) | (user << 2);
-            if ((pdpte & 1) == 0)
-                goto pae_page_fault;
+            struct pde_cache_entry* cached = pde_cache_lookup(lin >> 21);
+            if (cached) {
+                pdpte = cached->pdpte;
+                pde_addr = cached->pde_addr;
+                pde = cached->pde;
+                pde2 = cached->pde2;
+            } else {
+                pdpte = cpu_read_phys(pdp_addr);
+                if ((pdpte & 1) == 0)
+                    goto pae_page_fault;
 #if PAE_HANDLE_RESERVED
-            // "Writing to reserved bits in the PDPT generates a general protection fault (#GP),"
-            if (cpu_read_phys(pdp_addr + 4) & ~15)
-                EXCEPTION_GP(0);
+                // "Writing to reserved bits in the PDPT generates a general protection fault (#GP),"
+                if (cpu_read_phys(pdp_addr + 4) & ~15)
+                    EXCEPTION_GP(0);
 #endif
-            // Now look up page directory entry (which may end up being a page table entry, if we're lucky)
-            uint32_t pde_addr = (pdpte & ~0xFFF) | (lin >> 18 & 0xFF8),
-                     pde = cpu_read_phys(pde_addr), pde2 = cpu_read_phys(pde_addr + 4);
+                // Now look up page directory entry (which may end up being a page table entry, if we're lucky)
+                pde_addr = (pdpte & ~0xFFF) | (lin >> 18 & 0xFF8);
+                pde = cpu_read_phys(pde_addr);
+                pde2 = cpu_read_phys(pde_addr + 4);
 
-            // XXX yucky yucky
-            uint32_t nx_mask = -1 ^ (cpu.ia32_efer << 20 & 0x80000000);
+                // XXX yucky yucky
+                uint32_t nx_mask = -1 ^ (cpu.ia32_efer << 20 & 0x80000000);
 
-            // Check if our address is too
-            if (cpu_read_phys(pdp_addr + 4) & ~15 & nx_mask)
-                EXCEPTION_GP(0);
+                // Check if our address is too
+                if (cpu_read_phys(pdp_addr + 4) & ~15 & nx_mask)
+                    EXCEPTION_GP(0);
 #if PAE_HANDLE_RESERVED
-            if (pde2 & ~15 & nx_mask)
-                EXCEPTION_GP(0);
+                if (pde2 & ~15 & nx_mask)
+                    EXCEPTION_GP(0);
 #endif
+                pde_cache_insert(lin >> 21, pdp_addr, pdpte, pde_addr, pde, pde2);
+            }
 
             int nx_enabled = cpu.ia32_efer >> 11 & 1, nx = (pde2 >> 31) & nx_enabled;
             fail |= (execute && nx_enabled) << 4;
@@ -302,7 +690,8 @@ int cpu_mmu_translate(uint32_t lin, int shift)
 #endif
                 }
                 uint32_t phys = (pde & 0xFFE00000) | (lin & 0x1FF000);
-                cpu_set_tlb_entry(lin & ~0xFFF, phys, NULL, user, write, pde & 0x100, nx);
+                struct tlb_source src = { 0, pdp_addr, pde_addr, -1, pdpte, new_pde, pde2, 0 };
+                cpu_set_tlb_entry(lin & ~0xFFF, phys, NULL, user, write, pde & 0x100, nx, &src);
             } else {
                 uint32_t pte_addr = (pde & ~0xFFF) | (lin >> 9 & 0xFF8),
                          pte = cpu_read_phys(pte_addr), pte2 = cpu_read_phys(pte_addr + 4);
@@ -344,7 +733,8 @@ int cpu_mmu_translate(uint32_t lin, int shift)
                 printf("PDE: %08x PDE.addr: %08x\n", pde, pde_addr);
                 printf("PTE: %08x PTE.addr: %08x\n", pte, pte_addr);
 #endif
-                cpu_set_tlb_entry(lin & ~0xFFF, pte & ~0xFFF, NULL, user, write, pte & 0x100, nx);
+                struct tlb_source src = { 0, pdp_addr, pde_addr, pte_addr, pdpte, new_pde, pde2, new_pte };
+                cpu_set_tlb_entry(lin & ~0xFFF, pte & ~0xFFF, NULL, user, write, pte & 0x100, nx, &src);
             }
             return 0;
         pae_page_fault:
@@ -365,12 +755,12 @@ void cpu_mmu_tlb_invalidate(uint32_t lin)
     if(cpu.cr[4] & CR4_PSE){
         uint32_t linbase = lin & ~1023;
         for(int i=0;i<1024;i++){
-            cpu.tlb[i + linbase] = NULL;
-            cpu.tlb_tags[i + linbase] = 0xFF;
+            TLB_PTR(i + linbase) = NULL;
+            TLB_TAGS(i + linbase) = 0xFF;
         }
         return;
     }
 #endif
-    cpu.tlb[lin] = NULL;
-    cpu.tlb_tags[lin] = 0xFF;
+    TLB_PTR(lin) = NULL;
+    TLB_TAGS(lin) = 0xFF;
 }
\ No newline at end of file
@@ -33,11 +33,38 @@
         INSTRUMENT_INSN();     \
         return i + 1;          \
     } while (1)
+// Follows the successor link of the trace that just ended, which saves the call into cpu_get_trace for the common case
+// of a branch to a trace that has run before. Links never point into another state hash partition, so the link is
+// valid as long as EIP is still on the same page and the target trace hasn't been evicted.
+static inline struct decoded_instruction* cpu_next_trace(void)
+{
+    struct trace_info *prev = cpu.current_trace, *next;
+    if (prev && (cpu.phys_eip ^ cpu.last_phys_eip) < 4096) {
+        // Both links are checked against phys, so there's no need to work out which one applies. Loading them one
+        // after another (instead of picking one with a conditional move) keeps the load off the critical path.
+        next = prev->taken;
+        if (!next || next->phys != cpu.phys_eip)
+            next = prev->fallthrough;
+#ifdef DYNAREC
+        // Traces that are still counting towards JIT_THRESHOLD go through cpu_get_trace
+        if (next && next->phys == cpu.phys_eip && TRACE_VALID(next) && next->calls == JIT_THRESHOLD) {
+#else
+        if (next && next->phys == cpu.phys_eip && TRACE_VALID(next)) {
+#endif
+            cpu.current_trace = next;
+            cpu.stats.trace_link_hits++;
+            cpu.stats.trace_hits++;
+            return next->ptr;
+        }
+    }
+    return cpu_get_trace();
+}
+
 // Stops the trace and moves onto next one
-#define STOP()                  \
-    do {                        \
-        INSTRUMENT_INSN();      \
-        return cpu_get_trace(); \
+#define STOP()                   \
+    do {                         \
+        INSTRUMENT_INSN();       \
+        return cpu_next_trace(); \
     } while (0)
 #define EXCEP()                 \
     do {                        \
@@ -72,7 +99,7 @@
 #define arith_rmw(sz, func, ...)                                                   \
     uint32_t flags = i->flags,                                                     \
              linaddr = cpu_get_linaddr(flags, i),                                  \
-             tlb_shift = cpu.tlb_tags[linaddr >> 12],                              \
+             tlb_shift = TLB_TAGS(linaddr >> 12),                                  \
              shift = cpu.tlb_shift_write;                                          \
     uint##sz##_t* ptr;                                                             \
     if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
@@ -81,14 +108,14 @@
         func(I_OP(flags), (void*)&cpu.read_result, ##__VA_ARGS__);                 \
         cpu_access_write##sz(linaddr, cpu.read_result, tlb_shift >> shift, shift); \
     } else {                                                                       \
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;                                    \
+        ptr = TLB_PTR(linaddr >> 12) + linaddr;                                    \
         func(I_OP(flags), ptr, ##__VA_ARGS__);                                     \
     }                                                                              \
     NEXT(flags)
 #define arith_rmw2(sz, func, ...)                                                  \
     uint32_t flags = i->flags,                                                     \
              linaddr = cpu_get_linaddr(flags, i),                                  \
-             tlb_shift = cpu.tlb_tags[linaddr >> 12],                              \
+             tlb_shift = TLB_TAGS(linaddr >> 12),                                  \
              shift = cpu.tlb_shift_write;                                          \
     uint##sz##_t* ptr;                                                             \
     if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
@@ -97,14 +124,14 @@
         func((void*)&cpu.read_result, ##__VA_ARGS__);                              \
         cpu_access_write##sz(linaddr, cpu.read_result, tlb_shift >> shift, shift); \
     } else {                                                                       \
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;                                    \
+        ptr = TLB_PTR(linaddr >> 12) + linaddr;                                    \
         func(ptr, ##__VA_ARGS__);                                                  \
     }                                                                              \
     NEXT(flags)
 #define arith_rmw3(sz, func, offset, ...)                                          \
     uint32_t flags = i->flags,                                                     \
              linaddr = cpu_get_linaddr(flags, i) + offset,                         \
-             tlb_shift = cpu.tlb_tags[linaddr >> 12],                              \
+             tlb_shift = TLB_TAGS(linaddr >> 12),                                  \
              shift = cpu.tlb_shift_write;                                          \
     uint##sz##_t* ptr;                                                             \
     if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
@@ -113,7 +140,7 @@
         func((void*)&cpu.read_result, ##__VA_ARGS__);                              \
         cpu_access_write##sz(linaddr, cpu.read_result, tlb_shift >> shift, shift); \
     } else {                                                                       \
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;                                    \
+        ptr = TLB_PTR(linaddr >> 12) + linaddr;                                    \
         func(ptr, ##__VA_ARGS__);                                                  \
     }                                                                              \
     NEXT(flags)
@@ -172,9 +199,12 @@ static inline uint32_t cpu_get_virtaddr(uint32_t i, struct decoded_instruction*
 
 void cpu_execute(void)
 {
+#ifdef DYNAREC
+    cpu_jit_reset();
+#endif
     struct decoded_instruction* i = cpu_get_trace();
     do {
-        i = i->handler(i);
+        i = I_HANDLER(i)(i);
         if (!--cpu.cycles_to_run)
             break;
     } while (1);
@@ -568,6 +598,32 @@ OPTYPE op_jnle32(struct decoded_instruction* i)
 }
 // <<< END AUTOGENERATE "jcc" >>>
 
+// Fused instructions. The decoder replaces "dec r32; jnz" with this handler, which does the work of both and then skips
+// over the jump. The lazy flags state is still updated since the flags may be read after the jump.
+
+// cpu_execute counts a fused pair as one instruction, so account for the second one here. If the pair is the last
+// instruction of the slice, cpu_execute has to stop after it, so move the offset instead. cpu_get_cycles goes up by two
+// either way, which means that cpu_run can run one instruction more than it was asked to (see its return value).
+#define FUSED_CYCLE()              \
+    do {                           \
+        if (cpu.cycles_to_run > 1) \
+            cpu.cycles_to_run--;   \
+        else                       \
+            cpu.cycle_offset++;    \
+    } while (0)
+OPTYPE op_dec_r32_jnz32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, length = (flags & 15) + i[1].flags;
+    cpu_dec32(&R32(I_RM(flags)));
+    FUSED_CYCLE();
+    if (R32(I_RM(flags))) {
+        cpu.phys_eip += length + i[1].imm32;
+        STOP();
+    }
+    cpu.phys_eip += length;
+    INSTRUMENT_INSN();
+    return i + 2;
+}
 OPTYPE op_call_j16(struct decoded_instruction* i)
 {
     uint32_t virt_base = VIRT_EIP(), virt = virt_base + i->flags;
@@ -873,6 +929,65 @@ OPTYPE op_arith_e32i32(struct decoded_instruction* i)
     arith_rmw(32, cpu_arith32, i->imm32);
 }
 
+// Versions of the register forms above that leave the lazy flags state alone. The decoder only uses them for ADD, OR,
+// AND, SUB, and XOR, and only if the flags are overwritten before anything can observe them.
+#define arith_nf(dest, src)    \
+    do {                       \
+        switch (I_OP(flags)) { \
+        case 0:                \
+            dest += src;       \
+            break;             \
+        case 1:                \
+            dest |= src;       \
+            break;             \
+        case 4:                \
+            dest &= src;       \
+            break;             \
+        case 5:                \
+            dest -= src;       \
+            break;             \
+        case 6:                \
+            dest ^= src;       \
+            break;             \
+        }                      \
+    } while (0)
+OPTYPE op_arith_r8r8_nf(struct decoded_instruction* i)
+{
+    int flags = i->flags;
+    arith_nf(R8(I_RM(flags)), R8(I_REG(flags)));
+    NEXT(flags);
+}
+OPTYPE op_arith_r8i8_nf(struct decoded_instruction* i)
+{
+    int flags = i->flags;
+    arith_nf(R8(I_RM(flags)), i->imm8);
+    NEXT(flags);
+}
+OPTYPE op_arith_r16r16_nf(struct decoded_instruction* i)
+{
+    int flags = i->flags;
+    arith_nf(R16(I_RM(flags)), R16(I_REG(flags)));
+    NEXT(flags);
+}
+OPTYPE op_arith_r16i16_nf(struct decoded_instruction* i)
+{
+    int flags = i->flags;
+    arith_nf(R16(I_RM(flags)), i->imm16);
+    NEXT(flags);
+}
+OPTYPE op_arith_r32r32_nf(struct decoded_instruction* i)
+{
+    int flags = i->flags;
+    arith_nf(R32(I_RM(flags)), R32(I_REG(flags)));
+    NEXT(flags);
+}
+OPTYPE op_arith_r32i32_nf(struct decoded_instruction* i)
+{
+    int flags = i->flags;
+    arith_nf(R32(I_RM(flags)), i->imm32);
+    NEXT(flags);
+}
+
 OPTYPE op_shift_r8cl(struct decoded_instruction* i)
 {
     int flags = i->flags;
@@ -1259,6 +1374,44 @@ OPTYPE op_dec_e32(struct decoded_instruction* i)
     arith_rmw2(32, cpu_dec32);
 }
 
+// INC and DEC without flags, see arith_nf
+OPTYPE op_inc_r8_nf(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    R8(I_RM(flags))++;
+    NEXT(flags);
+}
+OPTYPE op_inc_r16_nf(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    R16(I_RM(flags))++;
+    NEXT(flags);
+}
+OPTYPE op_inc_r32_nf(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    R32(I_RM(flags))++;
+    NEXT(flags);
+}
+OPTYPE op_dec_r8_nf(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    R8(I_RM(flags))--;
+    NEXT(flags);
+}
+OPTYPE op_dec_r16_nf(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    R16(I_RM(flags))--;
+    NEXT(flags);
+}
+OPTYPE op_dec_r32_nf(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    R32(I_RM(flags))--;
+    NEXT(flags);
+}
+
 OPTYPE op_not_r8(struct decoded_instruction* i)
 {
     int flags = i->flags, rm = I_RM(flags);
@@ -1969,7 +2122,7 @@ OPTYPE op_xchg_r32r32(struct decoded_instruction* i)
 OPTYPE op_xchg_r8e8(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i);
-    int tlb_info = cpu.tlb_tags[linaddr >> 12];
+    int tlb_info = TLB_TAGS(linaddr >> 12);
     uint8_t* ptr;
     if (TLB_ENTRY_INVALID8(linaddr, tlb_info, cpu.tlb_shift_write)) {
         if (cpu_access_read8(linaddr, tlb_info, cpu.tlb_shift_write))
@@ -1977,7 +2130,7 @@ OPTYPE op_xchg_r8e8(struct decoded_instruction* i)
         UNUSED2(cpu_access_write8(linaddr, R8(I_REG(flags)), tlb_info, cpu.tlb_shift_write));
         R8(I_REG(flags)) = cpu.read_result;
     } else {
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;
+        ptr = TLB_PTR(linaddr >> 12) + linaddr;
         uint8_t tmp = *ptr;
         *ptr = R8(I_REG(flags));
         R8(I_REG(flags)) = tmp;
@@ -1987,7 +2140,7 @@ OPTYPE op_xchg_r8e8(struct decoded_instruction* i)
 OPTYPE op_xchg_r16e16(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i);
-    int tlb_info = cpu.tlb_tags[linaddr >> 12];
+    int tlb_info = TLB_TAGS(linaddr >> 12);
     uint16_t* ptr;
     if (TLB_ENTRY_INVALID16(linaddr, tlb_info, cpu.tlb_shift_write)) {
         tlb_info >>= cpu.tlb_shift_write;
@@ -1996,7 +2149,7 @@ OPTYPE op_xchg_r16e16(struct decoded_instruction* i)
         UNUSED2(cpu_access_write16(linaddr, R16(I_REG(flags)), tlb_info, cpu.tlb_shift_write));
         R16(I_REG(flags)) = cpu.read_result;
     } else {
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;
+        ptr = TLB_PTR(linaddr >> 12) + linaddr;
         uint16_t tmp = *ptr;
         *ptr = R16(I_REG(flags));
         R16(I_REG(flags)) = tmp;
@@ -2006,7 +2159,7 @@ OPTYPE op_xchg_r16e16(struct decoded_instruction* i)
 OPTYPE op_xchg_r32e32(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i);
-    int tlb_info = cpu.tlb_tags[linaddr >> 12];
+    int tlb_info = TLB_TAGS(linaddr >> 12);
     uint32_t* ptr;
     if (TLB_ENTRY_INVALID32(linaddr, tlb_info, cpu.tlb_shift_write)) {
         tlb_info >>= cpu.tlb_shift_write;
@@ -2015,7 +2168,7 @@ OPTYPE op_xchg_r32e32(struct decoded_instruction* i)
         UNUSED2(cpu_access_write32(linaddr, R32(I_REG(flags)), tlb_info, cpu.tlb_shift_write));
         R32(I_REG(flags)) = cpu.read_result;
     } else {
-        ptr = cpu.tlb[linaddr >> 12] + linaddr;
+        ptr = TLB_PTR(linaddr >> 12) + linaddr;
         uint32_t tmp = *ptr;
         *ptr = R32(I_REG(flags));
         R32(I_REG(flags)) = tmp;
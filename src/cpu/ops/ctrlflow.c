@@ -1576,12 +1576,12 @@ static void reload_cs_base(void)
     uint32_t virt_eip = VIRT_EIP();
     uint32_t lin_page = virt_eip >> 12,
              shift = cpu.tlb_shift_read,
-             tag = cpu.tlb_tags[virt_eip >> 12] >> shift;
+             tag = TLB_TAGS(virt_eip >> 12) >> shift;
     if (tag & 2) {
         cpu.last_phys_eip = cpu.phys_eip + 0x1000;
         return;
     }
-    cpu.phys_eip = PTR_TO_PHYS(cpu.tlb[lin_page] + virt_eip);
+    cpu.phys_eip = PTR_TO_PHYS(TLB_PTR(lin_page) + virt_eip);
     cpu.last_phys_eip = cpu.phys_eip & ~0xFFF;
     cpu.eip_phys_bias = virt_eip - cpu.phys_eip;
 }
@@ -1605,6 +1605,7 @@ int sysenter(void)
     cpu.cpl = 0;
     cpu_prot_update_cpl();
     cpu.state_hash = 0; // 32-bit code/data
+    cpu_trace_select_partition();
 
     cpu.seg[SS] = (cs_offset + 8) & 0xFFFC;
     cpu.seg_base[SS] = 0;
@@ -1632,6 +1633,7 @@ int sysexit(void)
     cpu.cpl = 3;
     cpu_prot_update_cpl();
     cpu.state_hash = 0; // 32-bit code/data
+    cpu_trace_select_partition();
 
     cpu.seg[SS] = (cpu.sysenter[SYSENTER_CS] | 3) + 24;
     cpu.seg_base[SS] = 0;
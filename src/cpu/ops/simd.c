@@ -8,6 +8,14 @@
 #include "cpu/instrument.h"
 #include "io.h"
 #include <string.h>
+#if defined(__SSE2__) && !defined(SIMD_SCALAR)
+#define HOST_SSE2
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#define HOST_SSSE3
+#include <tmmintrin.h>
+#endif
+#endif
 #define EXCEPTION_HANDLER return 1
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -136,13 +144,13 @@ static int get_read_ptr(uint32_t flags, struct decoded_instruction* i, int dword
         write_back_linaddr = linaddr;
         return 0;
     }
-    uint8_t tag = cpu.tlb_tags[linaddr >> 12] >> cpu.tlb_shift_read;
+    uint8_t tag = TLB_TAGS(linaddr >> 12) >> cpu.tlb_shift_read;
     if (tag & 2) {
         if (cpu_mmu_translate(linaddr, cpu.tlb_shift_read))
             return 1;
     }
 
-    uint32_t* host_ptr = cpu.tlb[linaddr >> 12] + linaddr;
+    uint32_t* host_ptr = TLB_PTR(linaddr >> 12) + linaddr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
         for (int i = 0, j = 0; i < dwords; i++, j += 4)
@@ -168,13 +176,13 @@ static int get_write_ptr(uint32_t flags, struct decoded_instruction* i, int dwor
         write_back_linaddr = linaddr;
         return 0;
     }
-    uint8_t tag = cpu.tlb_tags[linaddr >> 12] >> cpu.tlb_shift_write;
+    uint8_t tag = TLB_TAGS(linaddr >> 12) >> cpu.tlb_shift_write;
     if (tag & 2) {
         if (cpu_mmu_translate(linaddr, cpu.tlb_shift_write))
             return 1;
     }
 
-    uint32_t* host_ptr = cpu.tlb[linaddr >> 12] + linaddr;
+    uint32_t* host_ptr = TLB_PTR(linaddr >> 12) + linaddr;
     uint32_t phys = PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu.memory_size)) {
         write_back = 1;
@@ -258,8 +266,93 @@ static void* get_reg_dest(int x)
     return &cpu.reg32[x];
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Packed integer routines
+///////////////////////////////////////////////////////////////////////////////
+
+// When the host has SSE2 (and SSSE3, for pabs/pshufb), the packed integer helpers below hand their work to the matching
+// host instruction. The scalar loops that follow are the reference implementation: they are used on every other host,
+// and building with -DSIMD_SCALAR forces them so that the two can be compared (see tools/simdtest.c). MMX operands live
+// in the low 64 bits.
+#ifdef HOST_SSE2
+static inline __m128i simd_load(const void* ptr, int bytes)
+{
+    return bytes == 16 ? _mm_loadu_si128(ptr) : _mm_loadl_epi64(ptr);
+}
+static inline void simd_store(void* ptr, __m128i x, int bytes)
+{
+    if (bytes == 16)
+        _mm_storeu_si128(ptr, x);
+    else
+        _mm_storel_epi64(ptr, x);
+}
+static inline __m128i simd_unpacklo(__m128i a, __m128i b, int copysize)
+{
+    switch (copysize) {
+    case 1:
+        return _mm_unpacklo_epi8(a, b);
+    case 2:
+        return _mm_unpacklo_epi16(a, b);
+    case 4:
+        return _mm_unpacklo_epi32(a, b);
+    default:
+        return _mm_unpacklo_epi64(a, b);
+    }
+}
+// dest = op(dest, src)
+#define SIMD_BINARY(dest, src, bytes, op)                                            \
+    do {                                                                             \
+        simd_store(dest, op(simd_load(dest, bytes), simd_load(src, bytes)), bytes); \
+        return;                                                                      \
+    } while (0)
+// The host pack instructions take both operands from full vectors, so the two halves of an MMX pack have to be joined first
+#define SIMD_PACK(dest, src, bytes, op)                                     \
+    do {                                                                    \
+        __m128i a_ = simd_load(dest, bytes), b_ = simd_load(src, bytes);    \
+        if (bytes == 8)                                                     \
+            b_ = a_ = _mm_unpacklo_epi64(a_, b_);                           \
+        simd_store(dest, op(a_, b_), bytes);                                \
+        return;                                                             \
+    } while (0)
+#else
+#define SIMD_BINARY(dest, src, bytes, op) NOP()
+#define SIMD_PACK(dest, src, bytes, op) NOP()
+#endif
+#ifdef HOST_SSSE3
+// dest = op(src)
+#define SIMD_UNARY(dest, src, bytes, op)                       \
+    do {                                                       \
+        simd_store(dest, op(simd_load(src, bytes)), bytes);    \
+        return;                                                \
+    } while (0)
+#else
+#define SIMD_UNARY(dest, src, bytes, op) NOP()
+#endif
+
 static void punpckh(void* dst, void* src, int size, int copysize)
 {
+#ifdef HOST_SSE2
+    __m128i a = simd_load(dst, size), b = simd_load(src, size), res;
+    if (size == 8) // The high halves of MMX operands end up in the high half of the interleaved low halves
+        res = _mm_unpackhi_epi64(simd_unpacklo(a, b, copysize), a);
+    else
+        switch (copysize) {
+        case 1:
+            res = _mm_unpackhi_epi8(a, b);
+            break;
+        case 2:
+            res = _mm_unpackhi_epi16(a, b);
+            break;
+        case 4:
+            res = _mm_unpackhi_epi32(a, b);
+            break;
+        default:
+            res = _mm_unpackhi_epi64(a, b);
+            break;
+        }
+    simd_store(dst, res, size);
+    return;
+#endif
     // XXX -- make this faster
     // too many xors
     uint8_t *dst8 = dst, *src8 = src, tmp[16];
@@ -313,6 +406,7 @@ static inline uint8_t pack_i16_to_i8(uint16_t x)
 }
 static void packssdw(void* dest, void* src, int dwordcount)
 {
+    SIMD_PACK(dest, src, dwordcount << 2, _mm_packs_epi32);
     uint16_t res[8];
     uint32_t *dest32 = dest, *src32 = src;
     for (int i = 0; i < dwordcount; i++) {
@@ -323,6 +417,10 @@ static void packssdw(void* dest, void* src, int dwordcount)
 }
 static void punpckl(void* dst, void* src, int size, int copysize)
 {
+#ifdef HOST_SSE2
+    simd_store(dst, simd_unpacklo(simd_load(dst, size), simd_load(src, size), copysize), size);
+    return;
+#endif
     // XXX -- make this faster
     uint8_t *dst8 = dst, *src8 = src, tmp[16];
     int idx = 0, nidx = 0, xor = copysize - 1;
@@ -340,6 +438,7 @@ static void punpckl(void* dst, void* src, int size, int copysize)
 }
 static void psubsb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_subs_epi8);
     for (int i = 0; i < bytecount; i++) {
         uint8_t x = dest[i], y = src[i], res = x - y;
         x = (x >> 7) + 0x7F;
@@ -350,6 +449,7 @@ static void psubsb(uint8_t* dest, uint8_t* src, int bytecount)
 }
 static void psubsw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_subs_epi16);
     for (int i = 0; i < wordcount; i++) {
         uint16_t x = dest[i], y = src[i], res = x - y;
         //printf("%x - %x = %x\n", x, y, res);
@@ -361,30 +461,35 @@ static void psubsw(uint16_t* dest, uint16_t* src, int wordcount)
 }
 static void pminub(uint8_t* dest, uint8_t* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_min_epu8);
     for (int i = 0; i < bytecount; i++)
         if (src[i] < dest[i])
             dest[i] = src[i];
 }
 static void pmaxub(uint8_t* dest, uint8_t* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_max_epu8);
     for (int i = 0; i < bytecount; i++)
         if (dest[i] < src[i])
             dest[i] = src[i];
 }
 static void pminsw(int16_t* dest, int16_t* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_min_epi16);
     for (int i = 0; i < wordcount; i++)
         if (src[i] < dest[i])
             dest[i] = src[i];
 }
 static void pmaxsw(int16_t* dest, int16_t* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_max_epi16);
     for (int i = 0; i < wordcount; i++)
         if (src[i] > dest[i])
             dest[i] = src[i];
 }
 static void paddsb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_adds_epi8);
     // https://locklessinc.com/articles/sat_arithmetic/
     for (int i = 0; i < bytecount; i++) {
         uint8_t x = dest[i], y = src[i], res = x + y;
@@ -396,6 +501,7 @@ static void paddsb(uint8_t* dest, uint8_t* src, int bytecount)
 }
 static void paddsw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_adds_epi16);
     for (int i = 0; i < wordcount; i++) {
         uint16_t x = dest[i], y = src[i], res = x + y;
         x = (x >> 15) + 0x7FFF;
@@ -431,6 +537,12 @@ static void pshuf(void* dest, void* src, int imm, int shift)
 // Not the same as pshuf
 static void pshufb(void* dest, void* src, int bytes)
 {
+#ifdef HOST_SSSE3
+    // Indexes are masked so that MMX shuffles only pick from the low 8 bytes
+    __m128i index = _mm_and_si128(simd_load(src, bytes), _mm_set1_epi8(0x80 | (bytes - 1)));
+    simd_store(dest, _mm_shuffle_epi8(simd_load(dest, bytes), index), bytes);
+    return;
+#endif
     int8_t* src8 = src;
     uint8_t res[16], *dest8 = dest;
     int mask = bytes - 1;
@@ -538,6 +650,7 @@ static void cpu_psrldq(uint64_t* a, int shift, int mask)
 }
 static void pcmpeqb(uint8_t* dest, uint8_t* src, int count)
 {
+    SIMD_BINARY(dest, src, count, _mm_cmpeq_epi8);
     for (int i = 0; i < count; i++)
         if (src[i] == dest[i])
             dest[i] = 0xFF;
@@ -546,6 +659,7 @@ static void pcmpeqb(uint8_t* dest, uint8_t* src, int count)
 }
 static void pcmpeqw(uint16_t* dest, uint16_t* src, int count)
 {
+    SIMD_BINARY(dest, src, count << 1, _mm_cmpeq_epi16);
     for (int i = 0; i < count; i++)
         if (src[i] == dest[i])
             dest[i] = 0xFFFF;
@@ -554,6 +668,7 @@ static void pcmpeqw(uint16_t* dest, uint16_t* src, int count)
 }
 static void pcmpeqd(uint32_t* dest, uint32_t* src, int count)
 {
+    SIMD_BINARY(dest, src, count << 2, _mm_cmpeq_epi32);
     for (int i = 0; i < count; i++)
         if (src[i] == dest[i])
             dest[i] = 0xFFFFFFFF;
@@ -562,6 +677,7 @@ static void pcmpeqd(uint32_t* dest, uint32_t* src, int count)
 }
 static void pcmpgtb(int8_t* dest, int8_t* src, int count)
 {
+    SIMD_BINARY(dest, src, count, _mm_cmpgt_epi8);
     for (int i = 0; i < count; i++)
         if (dest[i] > src[i])
             dest[i] = 0xFF;
@@ -570,6 +686,7 @@ static void pcmpgtb(int8_t* dest, int8_t* src, int count)
 }
 static void pcmpgtw(int16_t* dest, int16_t* src, int count)
 {
+    SIMD_BINARY(dest, src, count << 1, _mm_cmpgt_epi16);
     for (int i = 0; i < count; i++)
         if (dest[i] > src[i])
             dest[i] = 0xFFFF;
@@ -578,6 +695,7 @@ static void pcmpgtw(int16_t* dest, int16_t* src, int count)
 }
 static void pcmpgtd(int32_t* dest, int32_t* src, int count)
 {
+    SIMD_BINARY(dest, src, count << 2, _mm_cmpgt_epi32);
     for (int i = 0; i < count; i++)
         if (dest[i] > src[i])
             dest[i] = 0xFFFFFFFF;
@@ -586,6 +704,7 @@ static void pcmpgtd(int32_t* dest, int32_t* src, int count)
 }
 static void packuswb(void* dest, void* src, int wordcount)
 {
+    SIMD_PACK(dest, src, wordcount << 1, _mm_packus_epi16);
     uint8_t res[16];
     uint16_t *dest16 = dest, *src16 = src;
     for (int i = 0; i < wordcount; i++) {
@@ -596,6 +715,7 @@ static void packuswb(void* dest, void* src, int wordcount)
 }
 static void packsswb(void* dest, void* src, int wordcount)
 {
+    SIMD_PACK(dest, src, wordcount << 1, _mm_packs_epi16);
     uint8_t res[16];
     uint16_t *dest16 = dest, *src16 = src;
     for (int i = 0; i < wordcount; i++) {
@@ -606,6 +726,10 @@ static void packsswb(void* dest, void* src, int wordcount)
 }
 static void pmullw(uint16_t* dest, uint16_t* src, int wordcount, int shift)
 {
+    if (shift)
+        SIMD_BINARY(dest, src, wordcount << 1, _mm_mulhi_epi16);
+    else
+        SIMD_BINARY(dest, src, wordcount << 1, _mm_mullo_epi16);
     for (int i = 0; i < wordcount; i++) {
         uint32_t result = (uint32_t)(int16_t)dest[i] * (uint32_t)(int16_t)src[i];
         dest[i] = result >> shift;
@@ -613,6 +737,8 @@ static void pmullw(uint16_t* dest, uint16_t* src, int wordcount, int shift)
 }
 static void pmuluw(void* dest, void* src, int wordcount, int shift)
 {
+    if (shift == 16)
+        SIMD_BINARY(dest, src, wordcount << 1, _mm_mulhi_epu16);
     uint16_t *dest16 = dest, *src16 = src;
     for (int i = 0; i < wordcount; i++) {
         uint32_t result = (uint32_t)dest16[i] * (uint32_t)src16[i];
@@ -621,6 +747,7 @@ static void pmuluw(void* dest, void* src, int wordcount, int shift)
 }
 static void pmuludq(void* dest, void* src, int dwordcount)
 {
+    SIMD_BINARY(dest, src, dwordcount << 2, _mm_mul_epu32);
     uint32_t *dest32 = dest, *src32 = src;
     for (int i = 0; i < dwordcount; i += 2) {
         uint64_t result = (uint64_t)dest32[i] * (uint64_t)src32[i];
@@ -630,6 +757,9 @@ static void pmuludq(void* dest, void* src, int dwordcount)
 }
 static int pmovmskb(uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    return _mm_movemask_epi8(simd_load(src, bytecount));
+#endif
     int dest = 0;
     for (int i = 0; i < bytecount; i++) {
         dest |= (src[i] >> 7) << i;
@@ -638,6 +768,7 @@ static int pmovmskb(uint8_t* src, int bytecount)
 }
 static void psubusb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_subs_epu8);
     for (int i = 0; i < bytecount; i++) {
         uint8_t result = dest[i] - src[i];
         dest[i] = -(result <= dest[i]) & result;
@@ -645,6 +776,7 @@ static void psubusb(uint8_t* dest, uint8_t* src, int bytecount)
 }
 static void psubusw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_subs_epu16);
     for (int i = 0; i < wordcount; i++) {
         uint16_t result = dest[i] - src[i];
         dest[i] = -(result <= dest[i]) & result;
@@ -652,6 +784,7 @@ static void psubusw(uint16_t* dest, uint16_t* src, int wordcount)
 }
 static void paddusb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_adds_epu8);
     for (int i = 0; i < bytecount; i++) {
         uint8_t result = dest[i] + src[i];
         dest[i] = -(result < dest[i]) | result;
@@ -659,6 +792,7 @@ static void paddusb(uint8_t* dest, uint8_t* src, int bytecount)
 }
 static void paddusw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_adds_epu16);
     for (int i = 0; i < wordcount; i++) {
         uint16_t result = dest[i] + src[i];
         dest[i] = -(result < dest[i]) | result;
@@ -666,6 +800,7 @@ static void paddusw(uint16_t* dest, uint16_t* src, int wordcount)
 }
 static void paddb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_add_epi8);
     if (dest == src) // Faster alternative
         for (int i = 0; i < bytecount; i++)
             dest[i] <<= 1;
@@ -675,6 +810,7 @@ static void paddb(uint8_t* dest, uint8_t* src, int bytecount)
 }
 static void paddw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_add_epi16);
     if (dest == src)
         for (int i = 0; i < wordcount; i++)
             dest[i] <<= 1;
@@ -684,6 +820,7 @@ static void paddw(uint16_t* dest, uint16_t* src, int wordcount)
 }
 static void paddd(uint32_t* dest, uint32_t* src, int dwordcount)
 {
+    SIMD_BINARY(dest, src, dwordcount << 2, _mm_add_epi32);
     if (dest == src)
         for (int i = 0; i < dwordcount; i++)
             dest[i] <<= 1;
@@ -693,36 +830,40 @@ static void paddd(uint32_t* dest, uint32_t* src, int dwordcount)
 }
 static void psubb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_sub_epi8);
     if (dest == src)
         for (int i = 0; i < bytecount; i++)
-            dest[i] >>= 1;
+            dest[i] = 0;
     else
         for (int i = 0; i < bytecount; i++)
             dest[i] -= src[i];
 }
 static void psubw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_sub_epi16);
     if (dest == src)
         for (int i = 0; i < wordcount; i++)
-            dest[i] >>= 1;
+            dest[i] = 0;
     else
         for (int i = 0; i < wordcount; i++)
             dest[i] -= src[i];
 }
 static void psubd(uint32_t* dest, uint32_t* src, int dwordcount)
 {
+    SIMD_BINARY(dest, src, dwordcount << 2, _mm_sub_epi32);
     if (dest == src)
         for (int i = 0; i < dwordcount; i++)
-            dest[i] >>= 1;
+            dest[i] = 0;
     else
         for (int i = 0; i < dwordcount; i++)
             dest[i] -= src[i];
 }
 static void psubq(uint64_t* dest, uint64_t* src, int qwordcount)
 {
+    SIMD_BINARY(dest, src, qwordcount << 3, _mm_sub_epi64);
     if (dest == src)
         for (int i = 0; i < qwordcount; i++)
-            dest[i] >>= 1;
+            dest[i] = 0;
     else
         for (int i = 0; i < qwordcount; i++)
             dest[i] -= src[i];
@@ -802,18 +943,21 @@ static void shufpd(void* dest, void* src, int imm)
 }
 static void pavgb(void* dest, void* src, int bytecount)
 {
+    SIMD_BINARY(dest, src, bytecount, _mm_avg_epu8);
     uint8_t *dest8 = dest, *src8 = src;
     for (int i = 0; i < bytecount; i++)
-        dest8[i] = (dest8[i] + src8[i]) >> 1;
+        dest8[i] = (dest8[i] + src8[i] + 1) >> 1;
 }
 static void pavgw(void* dest, void* src, int wordcount)
 {
+    SIMD_BINARY(dest, src, wordcount << 1, _mm_avg_epu16);
     uint16_t *dest16 = dest, *src16 = src;
     for (int i = 0; i < wordcount; i++)
-        dest16[i] = (dest16[i] + src16[i]) >> 1;
+        dest16[i] = (dest16[i] + src16[i] + 1) >> 1;
 }
 static void pmaddwd(void* dest, void* src, int dwordcount)
 {
+    SIMD_BINARY(dest, src, dwordcount << 2, _mm_madd_epi16);
     uint16_t *src16 = src, *dest16 = dest;
     uint32_t res[4];
     int idx = 0;
@@ -826,6 +970,7 @@ static void pmaddwd(void* dest, void* src, int dwordcount)
 }
 static void psadbw(void* dest, void* src, int qwordcount)
 {
+    SIMD_BINARY(dest, src, qwordcount << 3, _mm_sad_epu8);
     uint8_t *src8 = src, *dest8 = dest;
     for (int i = 0; i < qwordcount; i++) {
         uint32_t sum = 0, offs = i << 3;
@@ -843,6 +988,7 @@ static void psadbw(void* dest, void* src, int qwordcount)
 
 static void pabsb(void* dest, void* src, int bytecount)
 {
+    SIMD_UNARY(dest, src, bytecount, _mm_abs_epi8);
     int8_t* src8 = src;
     uint8_t* dest8 = dest;
     for (int i = 0; i < bytecount; i++)
@@ -850,6 +996,7 @@ static void pabsb(void* dest, void* src, int bytecount)
 }
 static void pabsw(void* dest, void* src, int wordcount)
 {
+    SIMD_UNARY(dest, src, wordcount << 1, _mm_abs_epi16);
     int16_t* src16 = src;
     uint16_t* dest16 = dest;
     for (int i = 0; i < wordcount; i++)
@@ -857,6 +1004,7 @@ static void pabsw(void* dest, void* src, int wordcount)
 }
 static void pabsd(void* dest, void* src, int dwordcount)
 {
+    SIMD_UNARY(dest, src, dwordcount << 2, _mm_abs_epi32);
     int32_t* src32 = src;
     uint32_t* dest32 = dest;
     for (int i = 0; i < dwordcount; i++)
@@ -3,10 +3,223 @@
 #include "cpu/cpu.h"
 #include "cpu/opcodes.h"
 #include "cpu/ops.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #define repz_or_repnz(flags) (flags & (I_PREFIX_REPZ | I_PREFIX_REPNZ))
 #define EXCEPTION_HANDLER return -1 // Note: -1, not 1 like most other exception handlers
 #define MAX_CYCLES_TO_RUN 65536
 
+// Bulk paths for REP MOVS/STOS. Instead of going through the TLB once per element, these handle every element that lies
+// on the current page at once. Anything that can't be done directly (TLB misses, MMIO, pages with code on them, elements
+// that straddle a page) makes them return 0, and the caller then does a single element the slow way.
+
+// Returns a host pointer for lin if it can be accessed without going through cpu_access_*, or NULL
+static inline void* string_host_ptr(uint32_t lin, int shift)
+{
+    if (TLB_TAGS(lin >> 12) >> shift & 1)
+        return NULL;
+    return TLB_PTR(lin >> 12) + lin;
+}
+
+// Number of elements, starting at lin and going in the direction of add, that stay inside the page. For 16-bit
+// addressing, the run also has to stop before the offset wraps around.
+static int string_run(uint32_t lin, uint32_t offset, int add, int addr16)
+{
+    uint32_t size = add < 0 ? -add : add, page = lin & 0xFFF, n;
+    if (page + size > 0x1000)
+        return 0;
+    if (add > 0) {
+        n = (0x1000 - page) / size;
+        if (addr16 && n > (0x10000 - offset) / size)
+            n = (0x10000 - offset) / size;
+    } else {
+        n = page / size + 1;
+        if (addr16) {
+            if (offset + size > 0x10000)
+                return 0;
+            if (n > offset / size + 1)
+                n = offset / size + 1;
+        }
+    }
+    return n;
+}
+
+static int movs_bulk(uint32_t src_lin, uint32_t src_offset, uint32_t dest_lin, uint32_t dest_offset, int add, int count, int addr16)
+{
+    int n = string_run(src_lin, src_offset, add, addr16), n2 = string_run(dest_lin, dest_offset, add, addr16);
+    if (n2 < n)
+        n = n2;
+    if (count < n)
+        n = count;
+    if (n < 2)
+        return 0;
+
+    uint8_t *src = string_host_ptr(src_lin, cpu.tlb_shift_read), *dest = string_host_ptr(dest_lin, cpu.tlb_shift_write);
+    if (!src || !dest)
+        return 0;
+    int size = add < 0 ? -add : add, bytes = n * size;
+    if (add < 0) {
+        src -= bytes - size;
+        dest -= bytes - size;
+    }
+    // Elements are copied one at a time, so a destination slightly ahead of the source repeats the first few elements
+    // instead of moving the whole block like memmove would.
+    if (add > 0 ? (dest > src && dest < src + bytes) : (dest < src && dest + bytes > src))
+        return 0;
+    memmove(dest, src, bytes);
+    return n;
+}
+
+static int stos_bulk(uint32_t dest_lin, uint32_t dest_offset, uint32_t data, int add, int count, int addr16)
+{
+    int n = string_run(dest_lin, dest_offset, add, addr16);
+    if (count < n)
+        n = count;
+    if (n < 2)
+        return 0;
+
+    uint8_t* dest = string_host_ptr(dest_lin, cpu.tlb_shift_write);
+    if (!dest)
+        return 0;
+    int size = add < 0 ? -add : add;
+    if (add < 0)
+        dest -= (n - 1) * size;
+    switch (size) {
+    case 1:
+        memset(dest, data, n);
+        break;
+    case 2: {
+        uint16_t data16 = data;
+        for (int i = 0; i < n; i++)
+            memcpy(dest + i * 2, &data16, 2);
+        break;
+    }
+    case 4:
+        for (int i = 0; i < n; i++)
+            memcpy(dest + i * 4, &data, 4);
+        break;
+    }
+    return n;
+}
+
+static inline uint32_t string_load(const uint8_t* ptr, int size)
+{
+    uint16_t data16;
+    uint32_t data32;
+    switch (size) {
+    case 1:
+        return *ptr;
+    case 2:
+        memcpy(&data16, ptr, 2);
+        return data16;
+    default:
+        memcpy(&data32, ptr, 4);
+        return data32;
+    }
+}
+
+#ifdef __SSE2__
+static inline __m128i string_cmpeq(__m128i a, __m128i b, int size)
+{
+    switch (size) {
+    case 1:
+        return _mm_cmpeq_epi8(a, b);
+    case 2:
+        return _mm_cmpeq_epi16(a, b);
+    default:
+        return _mm_cmpeq_epi32(a, b);
+    }
+}
+#endif
+
+// Search kernels for REPE/REPNE SCAS and CMPS. Both return the index of the first element, counting in the direction of
+// add, whose comparison is equal if stop_on_equal is set and unequal otherwise, or n if there is no such element. Only
+// forward scans are vectorized; backward ones are rare enough that a plain loop over host memory will do.
+static int scan_kernel(const uint8_t* buf, int n, int add, uint32_t value, int stop_on_equal)
+{
+    int size = add < 0 ? -add : add, i = 0;
+#ifdef __SSE2__
+    if (add > 0) {
+        __m128i needle = size == 1 ? _mm_set1_epi8(value) : size == 2 ? _mm_set1_epi16(value) : _mm_set1_epi32(value);
+        int invert = stop_on_equal ? 0 : 0xFFFF;
+        for (; i + 16 / size <= n; i += 16 / size) {
+            __m128i data = _mm_loadu_si128((const __m128i*)(buf + i * size));
+            int mask = _mm_movemask_epi8(string_cmpeq(data, needle, size)) ^ invert;
+            if (mask)
+                return i + __builtin_ctz(mask) / size;
+        }
+    }
+#endif
+    for (; i < n; i++)
+        if ((string_load(buf + i * add, size) == value) == stop_on_equal)
+            return i;
+    return n;
+}
+
+static int compare_kernel(const uint8_t* a, const uint8_t* b, int n, int add, int stop_on_equal)
+{
+    int size = add < 0 ? -add : add, i = 0;
+#ifdef __SSE2__
+    if (add > 0) {
+        int invert = stop_on_equal ? 0 : 0xFFFF;
+        for (; i + 16 / size <= n; i += 16 / size) {
+            __m128i data_a = _mm_loadu_si128((const __m128i*)(a + i * size)),
+                    data_b = _mm_loadu_si128((const __m128i*)(b + i * size));
+            int mask = _mm_movemask_epi8(string_cmpeq(data_a, data_b, size)) ^ invert;
+            if (mask)
+                return i + __builtin_ctz(mask) / size;
+        }
+    }
+#endif
+    for (; i < n; i++)
+        if ((string_load(a + i * add, size) == string_load(b + i * add, size)) == stop_on_equal)
+            return i;
+    return n;
+}
+
+// Bulk paths for REPE/REPNE SCAS and CMPS. They consume elements up to and including the one that ends the loop, and
+// hand back the last values compared so that the caller can set the flags exactly as the element loop would have.
+static int scas_bulk(uint32_t lin, uint32_t offset, uint32_t value, int add, int count, int addr16, int stop_on_equal, uint32_t* last)
+{
+    int n = string_run(lin, offset, add, addr16);
+    if (count < n)
+        n = count;
+    if (n < 2)
+        return 0;
+
+    uint8_t* buf = string_host_ptr(lin, cpu.tlb_shift_read);
+    if (!buf)
+        return 0;
+    int found = scan_kernel(buf, n, add, value, stop_on_equal);
+    if (found < n)
+        n = found + 1;
+    *last = string_load(buf + (n - 1) * add, add < 0 ? -add : add);
+    return n;
+}
+
+static int cmps_bulk(uint32_t si_lin, uint32_t si_offset, uint32_t di_lin, uint32_t di_offset, int add, int count, int addr16, int stop_on_equal, uint32_t* last_si, uint32_t* last_di)
+{
+    int n = string_run(si_lin, si_offset, add, addr16), n2 = string_run(di_lin, di_offset, add, addr16);
+    if (n2 < n)
+        n = n2;
+    if (count < n)
+        n = count;
+    if (n < 2)
+        return 0;
+
+    uint8_t *si = string_host_ptr(si_lin, cpu.tlb_shift_read), *di = string_host_ptr(di_lin, cpu.tlb_shift_read);
+    if (!si || !di)
+        return 0;
+    int size = add < 0 ? -add : add, found = compare_kernel(si, di, n, add, stop_on_equal);
+    if (found < n)
+        n = found + 1;
+    *last_si = string_load(si + (n - 1) * add, size);
+    *last_di = string_load(di + (n - 1) * add, size);
+    return n;
+}
+
 // <<< BEGIN AUTOGENERATE "ops" >>>
 int movsb16(int flags)
 {
@@ -20,12 +233,21 @@ int movsb16(int flags)
         cpu.reg16[DI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = movs_bulk(ds_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1);
+        if (n) {
+            cpu.reg16[SI] += add * n;
+            cpu.reg16[DI] += add * n;
+            cpu.reg16[CX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_read8(ds_base + cpu.reg16[SI], src, cpu.tlb_shift_read);
         cpu_write8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[SI] += add;
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg16[CX] != 0;
@@ -42,12 +264,21 @@ int movsb32(int flags)
         cpu.reg32[EDI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = movs_bulk(ds_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0);
+        if (n) {
+            cpu.reg32[ESI] += add * n;
+            cpu.reg32[EDI] += add * n;
+            cpu.reg32[ECX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_read8(ds_base + cpu.reg32[ESI], src, cpu.tlb_shift_read);
         cpu_write8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[ESI] += add;
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg32[ECX] != 0;
@@ -64,12 +295,21 @@ int movsw16(int flags)
         cpu.reg16[DI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = movs_bulk(ds_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1);
+        if (n) {
+            cpu.reg16[SI] += add * n;
+            cpu.reg16[DI] += add * n;
+            cpu.reg16[CX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_read16(ds_base + cpu.reg16[SI], src, cpu.tlb_shift_read);
         cpu_write16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[SI] += add;
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg16[CX] != 0;
@@ -86,12 +326,21 @@ int movsw32(int flags)
         cpu.reg32[EDI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = movs_bulk(ds_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0);
+        if (n) {
+            cpu.reg32[ESI] += add * n;
+            cpu.reg32[EDI] += add * n;
+            cpu.reg32[ECX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_read16(ds_base + cpu.reg32[ESI], src, cpu.tlb_shift_read);
         cpu_write16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[ESI] += add;
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg32[ECX] != 0;
@@ -108,12 +357,21 @@ int movsd16(int flags)
         cpu.reg16[DI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = movs_bulk(ds_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1);
+        if (n) {
+            cpu.reg16[SI] += add * n;
+            cpu.reg16[DI] += add * n;
+            cpu.reg16[CX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_read32(ds_base + cpu.reg16[SI], src, cpu.tlb_shift_read);
         cpu_write32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[SI] += add;
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg16[CX] != 0;
@@ -130,12 +388,21 @@ int movsd32(int flags)
         cpu.reg32[EDI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = movs_bulk(ds_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0);
+        if (n) {
+            cpu.reg32[ESI] += add * n;
+            cpu.reg32[EDI] += add * n;
+            cpu.reg32[ECX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_read32(ds_base + cpu.reg32[ESI], src, cpu.tlb_shift_read);
         cpu_write32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[ESI] += add;
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg32[ECX] != 0;
@@ -150,10 +417,18 @@ int stosb16(int flags)
         cpu.reg16[DI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = stos_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], src, add, count, 1);
+        if (n) {
+            cpu.reg16[DI] += add * n;
+            cpu.reg16[CX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_write8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg16[CX] != 0;
@@ -168,10 +443,18 @@ int stosb32(int flags)
         cpu.reg32[EDI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = stos_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], src, add, count, 0);
+        if (n) {
+            cpu.reg32[EDI] += add * n;
+            cpu.reg32[ECX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_write8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg32[ECX] != 0;
@@ -186,10 +469,18 @@ int stosw16(int flags)
         cpu.reg16[DI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = stos_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], src, add, count, 1);
+        if (n) {
+            cpu.reg16[DI] += add * n;
+            cpu.reg16[CX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_write16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg16[CX] != 0;
@@ -204,10 +495,18 @@ int stosw32(int flags)
         cpu.reg32[EDI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = stos_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], src, add, count, 0);
+        if (n) {
+            cpu.reg32[EDI] += add * n;
+            cpu.reg32[ECX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_write16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg32[ECX] != 0;
@@ -222,10 +521,18 @@ int stosd16(int flags)
         cpu.reg16[DI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = stos_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], src, add, count, 1);
+        if (n) {
+            cpu.reg16[DI] += add * n;
+            cpu.reg16[CX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_write32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_write);
         cpu.reg16[DI] += add;
         cpu.reg16[CX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg16[CX] != 0;
@@ -240,10 +547,18 @@ int stosd32(int flags)
         cpu.reg32[EDI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = stos_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], src, add, count, 0);
+        if (n) {
+            cpu.reg32[EDI] += add * n;
+            cpu.reg32[ECX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_write32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_write);
         cpu.reg32[EDI] += add;
         cpu.reg32[ECX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg32[ECX] != 0;
@@ -263,10 +578,24 @@ int scasb16(int flags)
         cpu.laux = SUB8;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, add, count, 1, 0, &last);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int8_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB8;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int8_t)(dest - src);
             cpu.lop2 = src;
@@ -276,10 +605,24 @@ int scasb16(int flags)
         }
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, add, count, 1, 1, &last);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int8_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB8;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int8_t)(dest - src);
             cpu.lop2 = src;
@@ -306,10 +649,24 @@ int scasb32(int flags)
         cpu.laux = SUB8;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, add, count, 0, 0, &last);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int8_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB8;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int8_t)(dest - src);
             cpu.lop2 = src;
@@ -319,10 +676,24 @@ int scasb32(int flags)
         }
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, add, count, 0, 1, &last);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int8_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB8;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int8_t)(dest - src);
             cpu.lop2 = src;
@@ -349,10 +720,24 @@ int scasw16(int flags)
         cpu.laux = SUB16;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, add, count, 1, 0, &last);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int16_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB16;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int16_t)(dest - src);
             cpu.lop2 = src;
@@ -362,10 +747,24 @@ int scasw16(int flags)
         }
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, add, count, 1, 1, &last);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int16_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB16;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int16_t)(dest - src);
             cpu.lop2 = src;
@@ -392,10 +791,24 @@ int scasw32(int flags)
         cpu.laux = SUB16;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, add, count, 0, 0, &last);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int16_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB16;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int16_t)(dest - src);
             cpu.lop2 = src;
@@ -405,10 +818,24 @@ int scasw32(int flags)
         }
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, add, count, 0, 1, &last);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int16_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB16;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int16_t)(dest - src);
             cpu.lop2 = src;
@@ -435,10 +862,24 @@ int scasd16(int flags)
         cpu.laux = SUB32;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, add, count, 1, 0, &last);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int32_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB32;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int32_t)(dest - src);
             cpu.lop2 = src;
@@ -448,10 +889,24 @@ int scasd16(int flags)
         }
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], dest, add, count, 1, 1, &last);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int32_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB32;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int32_t)(dest - src);
             cpu.lop2 = src;
@@ -478,10 +933,24 @@ int scasd32(int flags)
         cpu.laux = SUB32;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, add, count, 0, 0, &last);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int32_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB32;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int32_t)(dest - src);
             cpu.lop2 = src;
@@ -491,10 +960,24 @@ int scasd32(int flags)
         }
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last;
+            int n = scas_bulk(cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], dest, add, count, 0, 1, &last);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                src = last;
+                cpu.lr = (int32_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB32;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int32_t)(dest - src);
             cpu.lop2 = src;
@@ -775,12 +1258,28 @@ int cmpsb16(int flags)
         cpu.laux = SUB8;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1, 0, &last_dest, &last_src);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[SI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int8_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB8;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read8(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[SI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int8_t)(dest - src);
             cpu.lop2 = src;
@@ -790,12 +1289,28 @@ int cmpsb16(int flags)
         }
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1, 1, &last_dest, &last_src);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[SI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int8_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB8;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read8(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read8(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[SI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int8_t)(dest - src);
             cpu.lop2 = src;
@@ -824,12 +1339,28 @@ int cmpsb32(int flags)
         cpu.laux = SUB8;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0, 0, &last_dest, &last_src);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ESI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int8_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB8;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read8(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ESI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int8_t)(dest - src);
             cpu.lop2 = src;
@@ -839,12 +1370,28 @@ int cmpsb32(int flags)
         }
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0, 1, &last_dest, &last_src);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ESI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int8_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB8;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read8(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read8(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ESI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int8_t)(dest - src);
             cpu.lop2 = src;
@@ -873,12 +1420,28 @@ int cmpsw16(int flags)
         cpu.laux = SUB16;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1, 0, &last_dest, &last_src);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[SI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int16_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB16;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read16(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[SI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int16_t)(dest - src);
             cpu.lop2 = src;
@@ -888,12 +1451,28 @@ int cmpsw16(int flags)
         }
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1, 1, &last_dest, &last_src);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[SI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int16_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB16;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read16(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read16(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[SI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int16_t)(dest - src);
             cpu.lop2 = src;
@@ -922,12 +1501,28 @@ int cmpsw32(int flags)
         cpu.laux = SUB16;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0, 0, &last_dest, &last_src);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ESI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int16_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB16;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read16(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ESI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int16_t)(dest - src);
             cpu.lop2 = src;
@@ -937,12 +1532,28 @@ int cmpsw32(int flags)
         }
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0, 1, &last_dest, &last_src);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ESI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int16_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB16;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read16(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read16(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ESI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int16_t)(dest - src);
             cpu.lop2 = src;
@@ -971,12 +1582,28 @@ int cmpsd16(int flags)
         cpu.laux = SUB32;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1, 0, &last_dest, &last_src);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[SI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int32_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB32;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read32(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[SI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int32_t)(dest - src);
             cpu.lop2 = src;
@@ -986,12 +1613,28 @@ int cmpsd16(int flags)
         }
         return cpu.reg16[CX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg16[SI], cpu.reg16[SI], cpu.seg_base[ES] + cpu.reg16[DI], cpu.reg16[DI], add, count, 1, 1, &last_dest, &last_src);
+            if (n) {
+                cpu.reg16[DI] += add * n;
+                cpu.reg16[SI] += add * n;
+                cpu.reg16[CX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int32_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB32;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read32(seg_base + cpu.reg16[SI], dest, cpu.tlb_shift_read);
             cpu_read32(cpu.seg_base[ES] + cpu.reg16[DI], src, cpu.tlb_shift_read);
             cpu.reg16[DI] += add;
             cpu.reg16[SI] += add;
             cpu.reg16[CX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int32_t)(dest - src);
             cpu.lop2 = src;
@@ -1020,12 +1663,28 @@ int cmpsd32(int flags)
         cpu.laux = SUB32;
         return 0;
         case 1: // REPZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0, 0, &last_dest, &last_src);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ESI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int32_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB32;
+                if(src != dest) return 0;
+                continue;
+            }
             cpu_read32(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ESI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int32_t)(dest - src);
             cpu.lop2 = src;
@@ -1035,12 +1694,28 @@ int cmpsd32(int flags)
         }
         return cpu.reg32[ECX] != 0;
         case 2: // REPNZ
-        for (int i = 0; i < count; i++) {
+        while (count > 0) {
+            uint32_t last_src, last_dest;
+            int n = cmps_bulk(seg_base + cpu.reg32[ESI], cpu.reg32[ESI], cpu.seg_base[ES] + cpu.reg32[EDI], cpu.reg32[EDI], add, count, 0, 1, &last_dest, &last_src);
+            if (n) {
+                cpu.reg32[EDI] += add * n;
+                cpu.reg32[ESI] += add * n;
+                cpu.reg32[ECX] -= n;
+                count -= n;
+                dest = last_dest;
+                src = last_src;
+                cpu.lr = (int32_t)(dest - src);
+                cpu.lop2 = src;
+                cpu.laux = SUB32;
+                if(src == dest) return 0;
+                continue;
+            }
             cpu_read32(seg_base + cpu.reg32[ESI], dest, cpu.tlb_shift_read);
             cpu_read32(cpu.seg_base[ES] + cpu.reg32[EDI], src, cpu.tlb_shift_read);
             cpu.reg32[EDI] += add;
             cpu.reg32[ESI] += add;
             cpu.reg32[ECX]--;
+            count--;
             // XXX don't set this every time
             cpu.lr = (int32_t)(dest - src);
             cpu.lop2 = src;
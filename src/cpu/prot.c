@@ -13,10 +13,7 @@ int cpu_prot_set_cr(int cr, uint32_t v)
         break;
     case 3: // PDBR
         cpu.cr[3] &= ~31;
-        if(cpu.cr[4] & CR4_PGE)
-            cpu_mmu_tlb_flush_nonglobal();
-        else
-            cpu_mmu_tlb_flush();
+        cpu_mmu_tlb_switch((v ^ diffxor) & ~31);
         break;
     case 4:
         if (diffxor & (CR4_PGE | CR4_PAE | CR4_PSE | CR4_PCIDE | CR4_SMEP))
@@ -10,7 +10,7 @@ static void reload_cs_base(void)
     // Refresh cpu.last_phys_eip
     uint32_t lin_page = lin_eip >> 12,
              shift = cpu.tlb_shift_read,
-             tag = cpu.tlb_tags[lin_eip >> 12] >> shift;
+             tag = TLB_TAGS(lin_eip >> 12) >> shift;
 
     if (tag & 2) {
         // Not translated yet - let cpu_get_trace handle this
@@ -19,7 +19,7 @@ static void reload_cs_base(void)
     }
 
     // Recompute the physical EIP state
-    cpu.phys_eip = PTR_TO_PHYS(cpu.tlb[lin_page] + lin_eip);
+    cpu.phys_eip = PTR_TO_PHYS(TLB_PTR(lin_page) + lin_eip);
     cpu.last_phys_eip = cpu.phys_eip & ~0xFFF;
     cpu.eip_phys_bias = virt_eip - cpu.phys_eip;
 }
@@ -55,6 +55,7 @@ void cpu_seg_load_virtual(int id, uint16_t sel)
     switch (id) {
     case CS:
         cpu.state_hash = STATE_ADDR16 | STATE_CODE16;
+        cpu_trace_select_partition();
         break;
     case SS:
         cpu.esp_mask = 0xFFFF;
@@ -71,6 +72,7 @@ void cpu_seg_load_real(int id, uint16_t sel)
     switch (id) {
     case CS:
         cpu.state_hash = STATE_ADDR16 | STATE_CODE16;
+        cpu_trace_select_partition();
         break;
     case SS:
         cpu.esp_mask = 0xFFFF;
@@ -97,6 +99,7 @@ int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info)
             cpu.state_hash = 0;
         else
             cpu.state_hash = STATE_ADDR16 | STATE_CODE16;
+        cpu_trace_select_partition();
         cpu.cpl = sel & 3;
         cpu_prot_update_cpl();
         break;
@@ -1,7 +1,103 @@
 // Self-modifying code support
 // Note that writes to address beyond cpu.memory_size can be ignored because the translation system forbids translation from MMIO pages.
-// Also, this subsystem cannot handle cross 128-byte accesses on its own. All unaligned accesses will be split up in access.c
+// Also, this subsystem cannot handle cross 128-byte accesses on its own. Stores that stay within a page are not split up,
+// so access.c checks both the first and the last byte of every multi-byte store. Stores that cross a page are split up.
+#ifdef SMC_PROTECT
+#define _GNU_SOURCE // For MAP_ANONYMOUS and sigaction
+#endif
 #include "cpu/cpu.h"
+#include <string.h>
+#ifdef SMC_PROTECT
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Host-assisted SMC detection. Guest RAM pages that hold code are made read-only on the host instead of forcing every
+// store to them through the slow path of access.c. The first store into such a page raises SIGSEGV. The handler only
+// makes the page writable again, records it and asks the CPU loop to stop after the current instruction; cpu_run then
+// invalidates the traces in the page with cpu_smc_handle_faults, outside of signal context. A page is protected exactly
+// when its entry in cpu.smc_has_code is non-zero and it hasn't been recorded yet.
+
+// Pages that have faulted since the last call to cpu_smc_handle_faults. If there are more than this, every page that
+// holds code is invalidated.
+#define SMC_MAX_FAULTS 64
+static uint32_t fault_pages[SMC_MAX_FAULTS];
+// Whatever handled SIGSEGV before us, for faults that have nothing to do with guest RAM
+static struct sigaction old_segv_action;
+
+static void protect_page(uint32_t pageid, int prot)
+{
+    mprotect(cpu.mem + (pageid << 12), 4096, prot);
+}
+
+static void smc_fault_handler(int sig, siginfo_t* info, void* context)
+{
+    uint8_t *addr = info->si_addr, *mem = cpu.mem;
+    if (addr < mem || addr >= mem + cpu.memory_size || !cpu.smc_has_code[(addr - mem) >> 12]) {
+        // Not caused by us
+        if (old_segv_action.sa_flags & SA_SIGINFO)
+            old_segv_action.sa_sigaction(sig, info, context);
+        else if (old_segv_action.sa_handler != SIG_DFL && old_segv_action.sa_handler != SIG_IGN)
+            old_segv_action.sa_handler(sig);
+        else
+            sigaction(sig, &old_segv_action, NULL); // Retrying the access will crash with the default action
+        return;
+    }
+
+    uint32_t pageid = (addr - mem) >> 12;
+    if (cpu.smc_faults < SMC_MAX_FAULTS)
+        fault_pages[cpu.smc_faults] = pageid;
+    cpu.smc_faults++;
+    protect_page(pageid, PROT_READ | PROT_WRITE);
+
+    // The store may have modified the trace that is running. Devices writing to guest RAM outside of cpu_run (and
+    // instructions that already end the loop) don't need this. The interrupted store doesn't touch any of these fields.
+    if (cpu.cycle_offset && cpu.cycles_to_run > 1)
+        INTERNAL_CPU_LOOP_EXIT();
+}
+
+// Allocates page-aligned guest RAM and enables write protection if the host supports it
+void* cpu_smc_init_mem(uint32_t size)
+{
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = smc_fault_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sysconf(_SC_PAGESIZE) != 4096 || sigaction(SIGSEGV, &sa, &old_segv_action) == -1)
+        CPU_LOG("Unable to write protect code pages, falling back to software SMC checks\n");
+    else
+        cpu.smc_protect = 1;
+    return mem;
+}
+#endif
+
+// Records the chunks of a page that still hold code
+static void set_page_info(uint32_t pageid, uint32_t page_info)
+{
+#ifdef SMC_PROTECT
+    if (cpu.smc_protect && !page_info && cpu.smc_has_code[pageid])
+        protect_page(pageid, PROT_READ | PROT_WRITE);
+#endif
+    cpu.smc_has_code[pageid] = page_info;
+}
+
+// Forgets about all code in guest RAM, for when its contents are replaced wholesale
+void cpu_smc_clear_pages(void)
+{
+    if (!cpu.smc_has_code)
+        return;
+#ifdef SMC_PROTECT
+    if (cpu.smc_protect)
+        mprotect(cpu.mem, cpu.smc_has_code_length << 12, PROT_READ | PROT_WRITE);
+#endif
+    memset(cpu.smc_has_code, 0, 4 * cpu.smc_has_code_length);
+}
+
 int cpu_smc_page_has_code(uint32_t phys)
 {
     phys >>= 12;
@@ -23,91 +119,122 @@ void cpu_smc_set_code(uint32_t phys)
     phys >>= 7;
     if ((phys >> 5) >= cpu.smc_has_code_length)
         return;
+#ifdef SMC_PROTECT
+    if (cpu.smc_protect && !cpu.smc_has_code[phys >> 5])
+        protect_page(phys >> 5, PROT_READ);
+#endif
     cpu.smc_has_code[phys >> 5] |= 1 << (phys & 31);
 }
 
-// The maximum trace length is 32 instructions, and instructions are a maximum of 15 bytes long. 32 * 15 = 480, and that rounds up to 512 bytes.
-// If this value is set to zero, then only the last four 128-byte chunks are invalidated. If set to one, it will invalidate everything on the page until the start address
-#define REMOVE_ALL_CODE_TRACES 1
-
-void cpu_smc_invalidate(uint32_t lin, uint32_t phys)
+// Every cached trace is kept in the list of the physical page it starts in. Traces never cross pages, so a write only
+// has to be checked against the list of its own page.
+void cpu_smc_add_trace(struct trace_info* info)
 {
-    //printf("%08x %08x %08x %08x\n", lin, phys, cpu.smc_has_code_length, cpu.smc_has_code[phys >> 12]);
-    uint32_t pageid = phys >> 12, page_info, p128, invmask, pagebase = phys & ~0xFFF;
-    int start, end, quit = 0;
-
+    uint32_t pageid = info->phys >> 12;
     if (pageid >= cpu.smc_has_code_length)
         return;
-    page_info = cpu.smc_has_code[pageid];
-    p128 = phys >> 7 & 31;
-#if REMOVE_ALL_CODE_TRACES == 0
-    start = p128 - 4; // Backtrack four 128-byte cache lines.
-    if (start < 0)
-        start = 0; // In the case that our page offset is < 512, simply clamp the value to zero
-#else
-    start = 0; // Start at zero, all the time.
-#endif
-    end = p128;
-
-    {
-        int endmask = 1 << end, startmask = 1 << start;
-        if (start == 0)
-            startmask = 0; // If end is 0 and start is 0, we have a prboelm here.
-        endmask = endmask | (endmask - 1); // 8 --> (8 | 7) --> 15
-        if (startmask != 0)
-            startmask = startmask | (startmask - 1);
-        invmask = endmask ^ startmask; // Clear all bits present in startmask and endmask to reveal the range we are clearing
-
-        // If no code needs to be cleared, then don't waste time looping through it all
-        if (!(page_info & invmask))
-            return;
-    }
+    struct trace_info** head = &cpu.smc_traces[pageid];
+    info->page_next = *head;
+    if (*head)
+        (*head)->page_pprev = &info->page_next;
+    info->page_pprev = head;
+    *head = info;
+}
+
+void cpu_smc_remove_trace(struct trace_info* info)
+{
+    if (!info->page_pprev)
+        return;
+    *info->page_pprev = info->page_next;
+    if (info->page_next)
+        info->page_next->page_pprev = info->page_pprev;
+    info->page_next = NULL;
+    info->page_pprev = NULL;
+}
+
+// Empties every list. Must be called whenever the entries of cpu.trace_info are wiped or reallocated
+void cpu_smc_clear_traces(void)
+{
+    if (cpu.smc_traces)
+        memset(cpu.smc_traces, 0, sizeof(struct trace_info*) * cpu.smc_has_code_length);
+}
+
+// Returns the 128-byte chunks of its page that a trace covers
+static uint32_t trace_chunks(struct trace_info* info)
+{
+    uint32_t first = (info->phys & 0xFFF) >> 7, last = ((info->phys & 0xFFF) + TRACE_LENGTH(info->flags) - 1) >> 7;
+    return ((2u << last) - 1) & ~((1u << first) - 1);
+}
 
-    for (int i = start; i <= end; i++) {
-        uint32_t mask = 1 << i;
-        if (page_info & mask) {
-            uint32_t physbase = pagebase + (i << 7);
-            struct trace_info* info;
-            for (int j = 0; j < 128; j++) {
-                if ((info = cpu_trace_get_entry(physbase + j))) {
-                    // See if trace intersects given physical EIP and if so, exit
-                    if (!quit && phys >= info->phys && phys <= (info->phys + TRACE_LENGTH(info->flags)))
-                        quit = 1;
-                    info->phys = -1;
-                }
-            }
+// Invalidates all traces in the page that intersect [start, end). Stale entries are dropped from the list along the way.
+// Returns the number of traces that were invalidated and stores the chunks still covered by code in *chunks
+static int invalidate_range(uint32_t pageid, uint32_t start, uint32_t end, uint32_t* chunks)
+{
+    struct trace_info *info = cpu.smc_traces[pageid], *next;
+    int invalidated = 0;
+    *chunks = 0;
+    for (; info; info = next) {
+        next = info->page_next;
+        if (info->phys >> 12 != pageid || !TRACE_VALID(info)) {
+            cpu_smc_remove_trace(info);
+            continue;
         }
+        if (info->phys < end && start < info->phys + TRACE_LENGTH(info->flags)) {
+            info->phys = -1;
+            info->taken = info->fallthrough = NULL; // Cut the links to the successors of this trace
+            cpu_smc_remove_trace(info);
+            invalidated++;
+        } else
+            *chunks |= trace_chunks(info);
     }
+    return invalidated;
+}
 
-    page_info &= ~invmask;
-    cpu.smc_has_code[pageid] = page_info;
+void cpu_smc_invalidate(uint32_t lin, uint32_t phys, int length)
+{
+    //printf("%08x %08x %08x %08x\n", lin, phys, cpu.smc_has_code_length, cpu.smc_has_code[phys >> 12]);
+    uint32_t pageid = phys >> 12, page_info;
+    if (pageid >= cpu.smc_has_code_length)
+        return;
+
+    int quit = invalidate_range(pageid, phys, phys + length, &page_info);
+    set_page_info(pageid, page_info);
     if (!page_info)
         cpu_mmu_tlb_invalidate(lin); // Retranslate the address so that there's no more code remaining
 
+    // The trace that is running right now might have been modified
     if (quit)
         INTERNAL_CPU_LOOP_EXIT();
 }
-void cpu_smc_invalidate_page(uint32_t phys){
-    uint32_t pageid = phys >> 12,
-    page_info = cpu.smc_has_code[pageid], pagebase = phys & ~0xFFF, quit = 1;
-    for (int i = 0; i < 31; i++) {
-        uint32_t mask = 1 << i;
-        if (page_info & mask) {
-            uint32_t physbase = pagebase + (i << 7);
-            struct trace_info* info;
-            for (int j = 0; j < 128; j++) {
-                if ((info = cpu_trace_get_entry(physbase + j))) {
-                    // See if trace intersects given physical EIP and if so, exit
-                    if (!quit && phys >= info->phys && phys <= (info->phys + TRACE_LENGTH(info->flags)))
-                        quit = 1;
-                    info->phys = -1;
-                }
-            }
-        }
-    }
+static void invalidate_page(uint32_t pageid)
+{
+    uint32_t page_info;
+    invalidate_range(pageid, pageid << 12, (pageid << 12) + 4096, &page_info);
+    set_page_info(pageid, page_info);
+}
+void cpu_smc_invalidate_page(uint32_t phys)
+{
+    uint32_t pageid = phys >> 12;
+    if (pageid >= cpu.smc_has_code_length)
+        return;
 
-    cpu.smc_has_code[pageid] = page_info;
+    invalidate_page(pageid);
     // TODO: invalidate TLB
-    if (quit)
-        INTERNAL_CPU_LOOP_EXIT();
-}
\ No newline at end of file
+    INTERNAL_CPU_LOOP_EXIT();
+}
+
+#ifdef SMC_PROTECT
+// Invalidates the pages that the guest has written to since the last call. Called by cpu_run before it runs any code.
+void cpu_smc_handle_faults(void)
+{
+    if (cpu.smc_faults > SMC_MAX_FAULTS) {
+        for (uint32_t pageid = 0; pageid < cpu.smc_has_code_length; pageid++)
+            if (cpu.smc_has_code[pageid])
+                invalidate_page(pageid);
+    } else {
+        for (int j = 0; j < cpu.smc_faults; j++)
+            invalidate_page(fault_pages[j]);
+    }
+    cpu.smc_faults = 0;
+}
+#endif
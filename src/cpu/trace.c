@@ -3,62 +3,150 @@
 #include <string.h>
 
 static struct decoded_instruction temporary_placeholder = {
+#ifdef HANDLER_POINTERS
     .handler = op_trace_end
+#else
+    .handler = 0 // op_trace_end, which is the origin for all handler offsets
+#endif
 };
-static uint32_t hash_eip(uint32_t phys)
+// Returns the first entry of the set that the physical address belongs to
+static struct trace_info* hash_eip(struct trace_info* partition, uint32_t phys)
 {
-    return phys & (TRACE_INFO_ENTRIES - 1);
+    return &partition[((phys ^ phys >> 12) & (cpu.trace_sets - 1)) * TRACE_WAYS];
 }
 
+static void new_generation(int region)
+{
+    if (++cpu.trace_generation == 0) {
+        // The generation counter has wrapped around, so old entries could become valid again.
+        memset(cpu.trace_info, 0, sizeof(struct trace_info) * cpu.trace_info_entries * TRACE_PARTITIONS);
+        cpu_smc_clear_traces();
+        cpu.trace_generation = 1;
+    }
+    cpu.trace_region_generation[region] = cpu.trace_generation;
+}
+
+// Invalidates every trace in O(TRACE_REGIONS) time, without touching the entries themselves
 void cpu_trace_flush(void)
 {
-    memset(cpu.trace_info, 0, sizeof(struct trace_info) * TRACE_INFO_ENTRIES);
+    for (int i = 0; i < TRACE_REGIONS; i++)
+        new_generation(i);
+    cpu.trace_region = 0;
     cpu.trace_cache_usage = 0;
+    cpu.current_trace = NULL;
+    cpu.trace_partition = cpu.trace_info + TRACE_PARTITION(cpu.state_hash) * cpu.trace_info_entries;
+    cpu.stats.trace_flushes++;
+#ifdef DYNAREC
+    cpu_jit_flush();
+#endif
+}
+
+// Switches to the trace index partition of the current state hash. Must be called whenever cpu.state_hash changes.
+void cpu_trace_select_partition(void)
+{
+    struct trace_info* partition = cpu.trace_info + TRACE_PARTITION(cpu.state_hash) * cpu.trace_info_entries;
+    if (partition != cpu.trace_partition) {
+        cpu.trace_partition = partition;
+        cpu.current_trace = NULL; // Links never point into another partition
+    }
 }
 
-struct trace_info* cpu_trace_get_entry(uint32_t phys)
+// Picks the entry in the set that a new trace will be stored in. Free and stale entries are used first, otherwise the
+// oldest trace (the one with the lowest generation) is replaced.
+static struct trace_info* cpu_trace_victim(struct trace_info* set)
 {
-    struct trace_info* i = &cpu.trace_info[hash_eip(phys)];
-    if (i->phys != phys)
-        return NULL;
+    struct trace_info* victim = set;
+    for (int i = 0; i < TRACE_WAYS; i++) {
+        if (set[i].phys == (uint32_t)-1 || !TRACE_VALID(&set[i]))
+            return &set[i];
+        if (set[i].generation < victim->generation)
+            victim = &set[i];
+    }
+    return victim;
+}
+
+// Decodes a new trace into the trace cache and stores it in the given set. "link" is the successor link of the
+// previous trace, if any.
+static struct decoded_instruction* cpu_trace_decode(struct trace_info* set, struct trace_info** link)
+{
+    // Make sure that the current region has enough room in it.
+    if ((uint32_t)(cpu.trace_cache_usage + cpu.max_trace_size) >= (cpu.trace_region + 1) * cpu.trace_region_size) {
+        // If not, move onto the next region, evicting all of the traces that were decoded into it.
+        cpu.trace_region = (cpu.trace_region + 1) % TRACE_REGIONS;
+        cpu.trace_cache_usage = cpu.trace_region * cpu.trace_region_size;
+        new_generation(cpu.trace_region);
+        cpu.stats.trace_evictions++;
+    }
+    cpu.stats.trace_misses++;
+
+    // Translate the instructions, as needed
+    struct trace_info* trace = cpu_trace_victim(set);
+    struct decoded_instruction* i = &cpu.trace_cache[cpu.trace_cache_usage];
+    int translated = cpu_decode(trace, i);
+    cpu.trace_cache_usage += translated;
+    if (translated) {
+        // Move the entry to the list of the page that the new trace is in
+        cpu_smc_remove_trace(trace);
+        cpu_smc_add_trace(trace);
+        trace->flags |= cpu.trace_region << TRACE_REGION_SHIFT;
+        trace->generation = cpu.trace_region_generation[cpu.trace_region];
+        if (link)
+            *link = trace;
+        cpu.current_trace = trace;
+    } else
+        cpu.current_trace = NULL; // Page-crossing traces are not cached, so nothing can be linked to them
     return i;
 }
+
 struct decoded_instruction* cpu_get_trace(void)
 {
     // If we have gone off the page, recalculate physical EIP
     if ((cpu.phys_eip ^ cpu.last_phys_eip) > 4095) {
         uint32_t virt_eip = VIRT_EIP(), lin_eip = virt_eip + cpu.seg_base[CS];
-        uint8_t tlb_tag = cpu.tlb_tags[lin_eip >> 12];
-        if (TLB_ENTRY_INVALID8(lin_eip, tlb_tag, cpu.tlb_shift_read) || cpu.tlb_attrs[lin_eip >> 12] & TLB_ATTR_NX) {
-            if (cpu_mmu_translate(lin_eip, cpu.tlb_shift_read | 8))
+        uint8_t tlb_tag = TLB_TAGS(lin_eip >> 12);
+        if (TLB_ENTRY_INVALID8(lin_eip, tlb_tag, cpu.tlb_shift_read) || TLB_ATTRS(lin_eip >> 12) & TLB_ATTR_NX) {
+            if (cpu_mmu_translate(lin_eip, cpu.tlb_shift_read | 8)) {
+                cpu.current_trace = NULL;
                 return &temporary_placeholder;
+            }
         }
-        cpu.phys_eip = PTR_TO_PHYS(cpu.tlb[lin_eip >> 12] + lin_eip);
+        cpu.phys_eip = PTR_TO_PHYS(TLB_PTR(lin_eip >> 12) + lin_eip);
         cpu.eip_phys_bias = virt_eip - cpu.phys_eip;
         cpu.last_phys_eip = cpu.phys_eip & ~0xFFF;
     }
 
-    // Read the trace entry.
-    struct trace_info* trace = &cpu.trace_info[hash_eip(cpu.phys_eip)];
-    // If it matches, return the associated trace
-    if (trace->phys == cpu.phys_eip && trace->state_hash == cpu.state_hash) {
-        if(trace->ptr == NULL) {
-            CPU_FATAL("TRACE is NULL (internal CPU bug 1)\n");
-        }
-        return trace->ptr;
+    // First, try the successor cached in the trace we just came from. Execution either continued past the last
+    // instruction of the trace (fall-through) or branched somewhere else (taken).
+    struct trace_info *prev = cpu.current_trace, **link = NULL, *trace = NULL;
+    if (prev) {
+        link = cpu.phys_eip == prev->phys + TRACE_LENGTH(prev->flags) ? &prev->fallthrough : &prev->taken;
+        trace = *link;
     }
 
-    // Make sure that the trace cache has enough room in it.
-    if ((cpu.trace_cache_usage + MAX_TRACE_SIZE) >= TRACE_CACHE_SIZE) {
-        // If not, flush the trace cache by clearing all trace info entries
-        cpu_trace_flush();
+    if (trace && trace->phys == cpu.phys_eip && TRACE_VALID(trace))
+        cpu.stats.trace_link_hits++;
+    else {
+        // Search all the ways of the set
+        struct trace_info* set = hash_eip(cpu.trace_partition, cpu.phys_eip);
+        trace = set;
+        for (int j = 0;; j++, trace++) {
+            if (j == TRACE_WAYS) // If nothing matches, decode a new trace
+                return cpu_trace_decode(set, link);
+            if (trace->phys == cpu.phys_eip && TRACE_VALID(trace))
+                break;
+        }
+        if (trace->ptr == NULL) {
+            CPU_FATAL("TRACE is NULL (internal CPU bug 1)\n");
+        }
+        if (link)
+            *link = trace;
     }
 
-    // Translate the instructions, as needed
-    struct decoded_instruction* i = &cpu.trace_cache[cpu.trace_cache_usage];
-    cpu.trace_cache_usage += cpu_decode(trace, i);
-    if(i == NULL) {
-        CPU_FATAL("TRACE is NULL from decode (internal CPU bug) 0\n");
-    }
-    return i;
-}
\ No newline at end of file
+    cpu.current_trace = trace;
+    cpu.stats.trace_hits++;
+#ifdef DYNAREC
+    if (trace->calls < JIT_THRESHOLD && ++trace->calls == JIT_THRESHOLD)
+        cpu_jit_compile(trace);
+#endif
+    return trace->ptr;
+}
@@ -1,6 +1,7 @@
 // A set of drivers that regulates access to external files.
 // All disk image reads/writes go through this single function
 
+#define _GNU_SOURCE // For preadv and pwritev
 #include "drive.h"
 #include "platform.h"
 #include "state.h"
@@ -14,6 +15,11 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
 #else
 #include <emscripten.h>
 #endif
@@ -27,10 +33,19 @@ static void (*global_cb)(void*, int);
 static void* global_cb_arg1;
 #endif
 static int transfer_in_progress = 0;
+#if !defined(EMSCRIPTEN) && !defined(_WIN32)
+static void drive_async_cancel(void);
+static void drive_async_complete(void);
+// Number of requests that async drivers have not completed yet
+static int async_requests = 0;
+#endif
 
 void drive_cancel_transfers(void)
 {
     transfer_in_progress = 0;
+#if !defined(EMSCRIPTEN) && !defined(_WIN32)
+    drive_async_cancel();
+#endif
 }
 
 #define BLOCK_SHIFT 18
@@ -53,6 +68,14 @@ int drive_write(struct drive_info* info, void* a, void* b, uint32_t c, drv_offse
 {
     return info->write(info->data, a, b, c, d, e);
 }
+int drive_readv(struct drive_info* info, struct drive_iovec* a, int b, drv_offset_t c)
+{
+    return info->readv(info->data, a, b, c);
+}
+int drive_writev(struct drive_info* info, struct drive_iovec* a, int b, drv_offset_t c)
+{
+    return info->writev(info->data, a, b, c);
+}
 
 // ============================================================================
 // Struct definitions for block drivers.
@@ -453,6 +476,32 @@ static int drive_internal_write(void* this_ptr, void* cb_ptr, void* buffer, uint
     return DRIVE_RESULT_ASYNC;
 }
 
+// ============================================================================
+// Vectored functions
+// ============================================================================
+
+// Every block was loaded by the prefetch, so these are just a series of copies to or from the block cache
+static int drive_internal_readv(void* this_ptr, struct drive_iovec* iov, int iovcnt, drv_offset_t position)
+{
+    struct drive_internal_info* this = this_ptr;
+    for (int i = 0; i < iovcnt; i++) {
+        if (drive_internal_read_check(this, iov[i].buffer, iov[i].length, position, 1))
+            DRIVE_FATAL("Vectored read of data that has not been prefetched\n");
+        position += iov[i].length;
+    }
+    return DRIVE_RESULT_SYNC;
+}
+static int drive_internal_writev(void* this_ptr, struct drive_iovec* iov, int iovcnt, drv_offset_t position)
+{
+    struct drive_internal_info* this = this_ptr;
+    for (int i = 0; i < iovcnt; i++) {
+        if (drive_internal_write_check(this, iov[i].buffer, iov[i].length, position, 1))
+            DRIVE_FATAL("Vectored write of data that has not been prefetched\n");
+        position += iov[i].length;
+    }
+    return DRIVE_RESULT_SYNC;
+}
+
 // ============================================================================
 // Prefetch functions
 // ============================================================================
@@ -669,6 +718,8 @@ static
     info->write = drive_internal_write;
     info->state = drive_internal_state;
     info->prefetch = drive_internal_prefetch;
+    info->readv = drive_internal_readv;
+    info->writev = drive_internal_writev;
 
     // Now determine drive geometry
     info->sectors = internal->size / 512;
@@ -690,12 +741,21 @@ void drive_check_complete(void)
         transfer_in_progress = 0;
     }
 #endif
+#if !defined(EMSCRIPTEN) && !defined(_WIN32)
+    drive_async_complete();
+#endif
 }
 
 int drive_async_event_in_progress(void)
 {
+#if !defined(EMSCRIPTEN) && !defined(_WIN32)
+    if (async_requests)
+        return 1;
+#endif
 #ifdef SIMULATE_ASYNC_ACCESS
     return transfer_in_progress;
+#else
+    return 0;
 #endif
 }
 
@@ -758,8 +818,39 @@ struct simple_driver {
 
     // Table of blocks
     uint8_t** blocks;
+    // SIMPLE_BLOCK_* flags for each block
+    uint8_t* block_flags;
+
+    // Number of blocks in memory, and how many are allowed before one has to be evicted (0 if there is no limit)
+    uint32_t cached_blocks, max_cached_blocks;
+    // Next block that the CLOCK eviction algorithm will look at
+    uint32_t clock_hand;
+    // Modified blocks that have been evicted are saved here, at the same offset as in the image. Created when it is
+    // first needed, and deleted automatically when the emulator exits.
+    FILE* overlay;
+
+    // The whole image file, if it is mapped into memory (see drive_mmap_init). Shared with the file in raw mode, read
+    // only otherwise.
+    uint8_t* mapping;
+
+    // Set if blocks are loaded by the I/O threads, see drive_async_init
+    int async;
+    // Nonzero for each block that an I/O thread is reading right now
+    uint8_t* fetching;
+    // Number of blocks that the I/O threads have taken off the queue but not finished reading. Protected by fetch_lock
+    int fetches_running;
+    // Requests that are waiting for blocks to be loaded, oldest first
+    struct simple_request* pending;
+    struct simple_driver* next_async;
 };
 
+// The block has been used since the clock hand last passed it
+#define SIMPLE_BLOCK_REFERENCED 1
+// The block in memory has been modified since it was loaded
+#define SIMPLE_BLOCK_DIRTY 2
+// The latest contents of the block are in the overlay file, not the image
+#define SIMPLE_BLOCK_IN_OVERLAY 4
+
 static void drive_simple_state(void* this, char* path)
 {
     UNUSED(this);
@@ -767,8 +858,17 @@ static void drive_simple_state(void* this, char* path)
     //DRIVE_FATAL("TODO: Sync driver state\n");
 }
 
+#ifndef _WIN32
+static int drive_async_request(struct simple_driver* info, void* cb_ptr, void* buffer, uint32_t length, drv_offset_t offset, drive_cb cb, int is_write);
+static int drive_async_block_pending(struct simple_driver* info, uint32_t blockid);
+#endif
+
 static int drive_simple_prefetch(void* this_ptr, void* cb_ptr, uint32_t length, drv_offset_t position, drive_cb cb)
 {
+#ifndef _WIN32
+    if (((struct simple_driver*)this_ptr)->async)
+        return drive_async_request(this_ptr, cb_ptr, NULL, length, position, cb, 0);
+#endif
     // Since we're always sync, no need to prefetch
     UNUSED(this_ptr);
     UNUSED(cb_ptr);
@@ -778,99 +878,495 @@ static int drive_simple_prefetch(void* this_ptr, void* cb_ptr, uint32_t length,
     return DRIVE_RESULT_SYNC;
 }
 
-static inline int drive_simple_has_cache(struct simple_driver* info, drv_offset_t offset)
+// Reads a block from the image or the overlay file. The last block of the image may be cut short; the rest of it is
+// filled with zeros. Called from the I/O threads as well, so it only looks at fields that never change.
+static int drive_simple_read_block(struct simple_driver* info, uint32_t blockid, int from_overlay, uint8_t* data)
 {
-    return info->blocks[offset / info->block_size] != NULL;
+    drv_offset_t position = (drv_offset_t)blockid * info->block_size, length = info->block_size;
+    int fd = from_overlay ? fileno(info->overlay) : info->fd;
+    if (!from_overlay && length > info->image_size - position)
+        length = info->image_size - position;
+    memset(data + length, 0, info->block_size - length);
+    if (!from_overlay && info->mapping) {
+        memcpy(data, info->mapping + position, length);
+        return 0;
+    }
+#ifdef _WIN32
+    lseek(fd, position, SEEK_SET);
+    if ((drv_offset_t)read(fd, data, length) != length)
+        return -1;
+#else
+    if ((drv_offset_t)pread(fd, data, length, position) != length)
+        return -1;
+#endif
+    return 0;
 }
 
-// Reads 512 bytes of data from the cache, if possible.
-static int drive_simple_fetch_cache(struct simple_driver* info, void* buffer, drv_offset_t offset)
+static void drive_simple_evict(struct simple_driver* info, uint32_t blockid)
 {
-    if (offset & 511)
-        DRIVE_FATAL("Offset not aligned to 512 byte boundary");
-    uint32_t blockid = offset / info->block_size;
+    uint8_t* data = info->blocks[blockid];
+    if (info->block_flags[blockid] & SIMPLE_BLOCK_DIRTY) {
+        if (!info->overlay) {
+            info->overlay = tmpfile();
+            if (!info->overlay)
+                DRIVE_FATAL("Unable to create overlay file\n");
+        }
+        drv_offset_t position = (drv_offset_t)blockid * info->block_size;
+        int fd = fileno(info->overlay);
+#ifdef _WIN32
+        lseek(fd, position, SEEK_SET);
+        if ((drv_offset_t)write(fd, data, info->block_size) != info->block_size)
+#else
+        if ((drv_offset_t)pwrite(fd, data, info->block_size, position) != info->block_size)
+#endif
+            DRIVE_FATAL("Unable to write %d bytes to overlay file\n", (int)info->block_size);
+        info->block_flags[blockid] |= SIMPLE_BLOCK_IN_OVERLAY;
+    }
+    info->block_flags[blockid] &= ~(SIMPLE_BLOCK_DIRTY | SIMPLE_BLOCK_REFERENCED);
+    info->blocks[blockid] = NULL;
+    info->cached_blocks--;
+    free(data);
+}
 
-    // Check if block cache is open
-    if (info->blocks[blockid]) {
-        // Get the offset inside the block, get the physical position of the block, and copy 512 bytes into the destination buffer
-        uint32_t block_offset = offset % info->block_size;
-        void* ptr = info->blocks[blockid] + block_offset;
-        memcpy(buffer, ptr, 512); // Copy all the bytes from offset to the end of the file
-        return 1;
+// Evicts blocks until there is room for one more. Blocks that have been used recently get a second chance, and
+// unmodified blocks are simply dropped since they can be read from the image again.
+static void drive_simple_make_room(struct simple_driver* info)
+{
+    if (!info->max_cached_blocks)
+        return;
+    // Blocks that an I/O thread is reading or that a waiting request needs cannot be evicted, so give up after two trips
+    // around the clock
+    for (uint32_t steps = 0; info->cached_blocks >= info->max_cached_blocks && steps < info->block_array_size * 2; steps++) {
+        uint32_t blockid = info->clock_hand;
+        if (++info->clock_hand == info->block_array_size)
+            info->clock_hand = 0;
+        if (!info->blocks[blockid] || (info->fetching && info->fetching[blockid]))
+            continue;
+#ifndef _WIN32
+        if (info->pending && drive_async_block_pending(info, blockid))
+            continue;
+#endif
+        if (info->block_flags[blockid] & SIMPLE_BLOCK_REFERENCED)
+            info->block_flags[blockid] &= ~SIMPLE_BLOCK_REFERENCED;
+        else
+            drive_simple_evict(info, blockid);
     }
+}
 
-    return 0;
+static void drive_simple_install_block(struct simple_driver* info, uint32_t blockid, uint8_t* data)
+{
+    info->blocks[blockid] = data;
+    info->block_flags[blockid] |= SIMPLE_BLOCK_REFERENCED;
+    info->cached_blocks++;
 }
 
-static int drive_simple_add_cache(struct simple_driver* info, drv_offset_t offset)
+static void drive_simple_add_cache(struct simple_driver* info, uint32_t blockid)
 {
-    void* dest = info->blocks[offset / info->block_size] = malloc(info->block_size);
-    lseek(info->fd, offset & (drv_offset_t) ~(info->block_size - 1), SEEK_SET); // Seek to the beginning of the current block
-    if ((uint32_t)read(info->fd, dest, info->block_size) != info->block_size)
+    drive_simple_make_room(info);
+    uint8_t* data = malloc(info->block_size);
+    if (!data)
+        DRIVE_FATAL("Unable to allocate block\n");
+    if (drive_simple_read_block(info, blockid, info->block_flags[blockid] & SIMPLE_BLOCK_IN_OVERLAY, data) < 0)
         DRIVE_FATAL("Unable to read %d bytes from image file\n", (int)info->block_size);
-    return 0;
+    drive_simple_install_block(info, blockid, data);
 }
 
-static inline int drive_simple_write_cache(struct simple_driver* info, void* buffer, drv_offset_t offset)
+//#define ALLOW_READWRITE 1
+
+#ifdef _WIN32
+// There is no preadv/pwritev here, so the buffers of a run are transferred one at a time
+struct iovec {
+    void* iov_base;
+    size_t iov_len;
+};
+#endif
+
+#define SIMPLE_RUN_MAX_BUFFERS 64
+
+// Buffers that map to consecutive bytes of the image file, which can be transferred with a single system call
+struct simple_run {
+    drv_offset_t offset;
+    uint32_t length;
+    int count;
+    struct iovec iov[SIMPLE_RUN_MAX_BUFFERS];
+};
+
+static void drive_simple_flush_run(struct simple_driver* info, struct simple_run* run, int is_write)
 {
-    uint32_t block_offset = offset % info->block_size;
-    void* ptr = info->blocks[offset / info->block_size] + block_offset;
-    memcpy(ptr, buffer, 512); // Copy all the bytes from offset to the end of the file
-    return 0;
+    if (!run->count)
+        return;
+#ifdef _WIN32
+    lseek(info->fd, run->offset, SEEK_SET);
+    for (int i = 0; i < run->count; i++) {
+        int res = is_write ? write(info->fd, run->iov[i].iov_base, run->iov[i].iov_len) : read(info->fd, run->iov[i].iov_base, run->iov[i].iov_len);
+        if ((size_t)res != run->iov[i].iov_len)
+            DRIVE_FATAL("Unable to transfer %d bytes to/from image file\n", (int)run->iov[i].iov_len);
+    }
+#else
+    ssize_t res = is_write ? pwritev(info->fd, run->iov, run->count, run->offset) : preadv(info->fd, run->iov, run->count, run->offset);
+    if (res != (ssize_t)run->length)
+        DRIVE_FATAL("Unable to transfer %d bytes to/from image file\n", (int)run->length);
+#endif
+    run->count = 0;
+    run->length = 0;
 }
 
-//#define ALLOW_READWRITE 1
+static void drive_simple_add_to_run(struct simple_driver* info, struct simple_run* run, void* buffer, uint32_t length, drv_offset_t offset, int is_write)
+{
+    if (run->count) {
+        // Merge buffers that follow each other in memory as well
+        struct iovec* last = &run->iov[run->count - 1];
+        if ((uint8_t*)last->iov_base + last->iov_len == buffer) {
+            last->iov_len += length;
+            run->length += length;
+            return;
+        }
+        if (run->count == SIMPLE_RUN_MAX_BUFFERS)
+            drive_simple_flush_run(info, run, is_write);
+    }
+    if (!run->count)
+        run->offset = offset;
+    run->iov[run->count].iov_base = buffer;
+    run->iov[run->count].iov_len = length;
+    run->count++;
+    run->length += length;
+}
 
-static int drive_simple_write(void* this, void* cb_ptr, void* buffer, uint32_t size, drv_offset_t offset, drive_cb cb)
+// Serves as much of a request as possible from the block cache. Everything else is read from or written to the image
+// file, with one system call for each run of uncached blocks instead of one per sector.
+static void drive_simple_transfer(struct simple_driver* info, struct drive_iovec* iov, int iovcnt, drv_offset_t offset, int is_write)
 {
-    UNUSED(this);
-    UNUSED(cb);
-    UNUSED(cb_ptr);
+    struct simple_run run;
+    run.count = 0;
+    run.length = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        uint8_t* buffer = iov[i].buffer;
+        uint32_t left = iov[i].length;
+        if ((left | offset) & 511)
+            DRIVE_FATAL("Length/offset must be multiple of 512 bytes\n");
+        while (left) {
+            uint32_t blockid = offset / info->block_size, block_offset = offset % info->block_size,
+                     len = info->block_size - block_offset;
+            if (len > left)
+                len = left;
+
+            // Writes go to the cache unless we are allowed to modify the image file. In that case, they go to the file,
+            // and to the cached copy of the block if there is one. Evicted blocks have to be loaded again since the image
+            // file does not have their contents.
+            uint8_t* cached = info->blocks[blockid];
+            if (!cached && ((is_write && !info->raw_file_access) || (info->block_flags[blockid] & SIMPLE_BLOCK_IN_OVERLAY))) {
+                drive_simple_add_cache(info, blockid);
+                cached = info->blocks[blockid];
+            }
+            if (cached) {
+                info->block_flags[blockid] |= SIMPLE_BLOCK_REFERENCED;
+                if (is_write) {
+                    memcpy(cached + block_offset, buffer, len);
+                    if (!info->raw_file_access)
+                        info->block_flags[blockid] |= SIMPLE_BLOCK_DIRTY;
+                } else
+                    memcpy(buffer, cached + block_offset, len);
+            }
+            if (cached && !(is_write && info->raw_file_access)) // The next run will start somewhere else in the file
+                drive_simple_flush_run(info, &run, is_write);
+            else if (info->mapping) {
+                if (is_write)
+                    memcpy(info->mapping + offset, buffer, len);
+                else
+                    memcpy(buffer, info->mapping + offset, len);
+            } else
+                drive_simple_add_to_run(info, &run, buffer, len, offset, is_write);
+
+            buffer += len;
+            offset += len;
+            left -= len;
+        }
+    }
+    drive_simple_flush_run(info, &run, is_write);
+}
+
+#ifndef _WIN32
+// ============================================================================
+// Async simple driver
+// ============================================================================
+
+// Blocks are read by a pool of I/O threads so that the emulator can keep running while the host disk is busy. The
+// threads only ever touch the buffers that they allocate; everything else, including installing the blocks into the
+// cache and completing requests, happens on the main thread in drive_check_complete.
+
+#define DRIVE_ASYNC_THREADS 4
+// The largest ATA request (65536 sectors) touches 129 blocks. A request only runs once all of them are in the cache.
+#define DRIVE_ASYNC_MAX_REQUEST_BLOCKS 129
+
+// Raises the limit on cached blocks to at least min_blocks. The limit is left alone if there is none.
+static void drive_async_min_cache(struct simple_driver* info, uint32_t min_blocks, char* filename)
+{
+    if (info->max_cached_blocks >= min_blocks || !info->max_cached_blocks)
+        return;
+    fprintf(stderr, "%s: cache is too small, using %d KB instead\n", filename, (int)(min_blocks * (info->block_size / 1024)));
+    info->max_cached_blocks = min_blocks;
+}
+
+struct simple_fetch {
+    struct simple_driver* info;
+    uint32_t blockid;
+    int from_overlay;
+    uint8_t* data; // Filled in by the I/O thread, or NULL if the read failed
+    struct simple_fetch* next;
+};
 
-    if ((size | offset) & 511)
+struct simple_request {
+    int is_write;
+    void* buffer; // NULL for prefetches
+    uint32_t length;
+    drv_offset_t offset;
+    drive_cb cb;
+    void* cb_ptr;
+    struct simple_request* next;
+};
+
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_cond = PTHREAD_COND_INITIALIZER;
+// Signaled whenever an I/O thread finishes reading a block
+static pthread_cond_t fetch_idle_cond = PTHREAD_COND_INITIALIZER;
+// Blocks waiting for an I/O thread, and blocks that have been read but not installed yet
+static struct simple_fetch *fetch_queue, *fetch_done;
+static int fetch_threads_started = 0;
+static struct simple_driver* async_drivers;
+
+static void* drive_async_thread(void* arg)
+{
+    UNUSED(arg);
+    while (1) {
+        pthread_mutex_lock(&fetch_lock);
+        while (!fetch_queue)
+            pthread_cond_wait(&fetch_cond, &fetch_lock);
+        struct simple_fetch* fetch = fetch_queue;
+        fetch_queue = fetch->next;
+        fetch->info->fetches_running++;
+        pthread_mutex_unlock(&fetch_lock);
+
+        fetch->data = malloc(fetch->info->block_size);
+        if (fetch->data && drive_simple_read_block(fetch->info, fetch->blockid, fetch->from_overlay, fetch->data) < 0) {
+            free(fetch->data);
+            fetch->data = NULL;
+        }
+
+        pthread_mutex_lock(&fetch_lock);
+        fetch->next = fetch_done;
+        fetch_done = fetch;
+        fetch->info->fetches_running--;
+        pthread_cond_broadcast(&fetch_idle_cond);
+        pthread_mutex_unlock(&fetch_lock);
+    }
+    return NULL;
+}
+
+static void drive_async_fetch(struct simple_driver* info, uint32_t blockid)
+{
+    struct simple_fetch* fetch = malloc(sizeof(struct simple_fetch));
+    if (!fetch)
+        DRIVE_FATAL("Unable to allocate block fetch\n");
+    fetch->info = info;
+    fetch->blockid = blockid;
+    fetch->from_overlay = info->block_flags[blockid] & SIMPLE_BLOCK_IN_OVERLAY;
+    fetch->data = NULL;
+    info->fetching[blockid] = 1;
+
+    pthread_mutex_lock(&fetch_lock);
+    // Keep the queue in order so that blocks are read in roughly the same order as they were requested
+    struct simple_fetch** tail = &fetch_queue;
+    while (*tail)
+        tail = &(*tail)->next;
+    fetch->next = NULL;
+    *tail = fetch;
+    pthread_cond_signal(&fetch_cond);
+    pthread_mutex_unlock(&fetch_lock);
+}
+
+// Returns 1 if every block that a request touches is in the cache. Otherwise, starts loading the missing blocks. Writes
+// wait for the blocks as well, so that a block is never written to while an I/O thread is reading it.
+static int drive_async_blocks_ready(struct simple_driver* info, uint32_t length, drv_offset_t offset)
+{
+    int ready = 1;
+    if (!length)
+        return 1;
+    for (uint32_t i = offset / info->block_size; i <= (offset + length - 1) / info->block_size; i++) {
+        if (info->blocks[i])
+            continue;
+        if (!info->fetching[i])
+            drive_async_fetch(info, i);
+        ready = 0;
+    }
+    return ready;
+}
+
+static int drive_async_request(struct simple_driver* info, void* cb_ptr, void* buffer, uint32_t length, drv_offset_t offset, drive_cb cb, int is_write)
+{
+    if ((length | offset) & 511)
         DRIVE_FATAL("Length/offset must be multiple of 512 bytes\n");
 
-    struct simple_driver* info = this;
+    // Callers without a callback cannot wait, so read or write the image file directly
+    if (!cb) {
+        if (buffer) {
+            struct drive_iovec iov = { buffer, length };
+            drive_simple_transfer(info, &iov, 1, offset, is_write);
+        }
+        return DRIVE_RESULT_SYNC;
+    }
 
-    drv_offset_t end = size + offset;
-    while (offset != end) {
-        if (!info->raw_file_access) {
-            if (!drive_simple_has_cache(info, offset))
-                drive_simple_add_cache(info, offset);
-            drive_simple_write_cache(info, buffer, offset);
-        } else {
-            UNUSED(drive_simple_add_cache);
-            lseek(info->fd, offset, SEEK_SET);
-            if (write(info->fd, buffer, 512) != 512)
-                DRIVE_FATAL("Unable to write 512 bytes to image file\n");
+    // Requests are completed in order, so nothing can bypass the ones that are already waiting
+    int ready = drive_async_blocks_ready(info, length, offset);
+    if (ready && !info->pending) {
+        if (buffer) {
+            struct drive_iovec iov = { buffer, length };
+            drive_simple_transfer(info, &iov, 1, offset, is_write);
+        }
+        return DRIVE_RESULT_SYNC;
+    }
+
+    struct simple_request* req = malloc(sizeof(struct simple_request));
+    if (!req)
+        DRIVE_FATAL("Unable to allocate drive request\n");
+    req->is_write = is_write;
+    req->buffer = buffer;
+    req->length = length;
+    req->offset = offset;
+    req->cb = cb;
+    req->cb_ptr = cb_ptr;
+    req->next = NULL;
+    struct simple_request** tail = &info->pending;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = req;
+    async_requests++;
+    return DRIVE_RESULT_ASYNC;
+}
+
+// Returns 1 if a request that is waiting for blocks touches the block. Otherwise, installing the blocks that it still
+// needs could evict the ones that it already has, and the request would never run.
+static int drive_async_block_pending(struct simple_driver* info, uint32_t blockid)
+{
+    for (struct simple_request* req = info->pending; req; req = req->next) {
+        if (req->length && req->offset / info->block_size <= blockid && blockid <= (req->offset + req->length - 1) / info->block_size)
+            return 1;
+    }
+    return 0;
+}
+
+static void drive_async_run_pending(struct simple_driver* info)
+{
+    while (info->pending) {
+        struct simple_request* req = info->pending;
+        if (!drive_async_blocks_ready(info, req->length, req->offset))
+            return;
+        info->pending = req->next;
+        async_requests--;
+        if (req->buffer) {
+            struct drive_iovec iov = { req->buffer, req->length };
+            drive_simple_transfer(info, &iov, 1, req->offset, req->is_write);
+        }
+        // The callback may start another request, so the request has to be off the list by now
+        req->cb(req->cb_ptr, 0);
+        free(req);
+    }
+}
+
+static void drive_async_complete(void)
+{
+    if (!async_drivers)
+        return;
+    pthread_mutex_lock(&fetch_lock);
+    struct simple_fetch* fetch = fetch_done;
+    fetch_done = NULL;
+    pthread_mutex_unlock(&fetch_lock);
+
+    while (fetch) {
+        struct simple_fetch* next = fetch->next;
+        if (!fetch->data)
+            DRIVE_FATAL("Unable to read %d bytes from image file\n", (int)fetch->info->block_size);
+        // A write may have created the block while it was being read, and it may even have been evicted to the overlay
+        // since. Either way, the data that was read is out of date.
+        struct simple_driver* info = fetch->info;
+        uint32_t blockid = fetch->blockid;
+        info->fetching[blockid] = 0;
+        if (info->blocks[blockid] || fetch->from_overlay != (info->block_flags[blockid] & SIMPLE_BLOCK_IN_OVERLAY))
+            free(fetch->data);
+        else {
+            drive_simple_make_room(info);
+            drive_simple_install_block(info, blockid, fetch->data);
+        }
+        free(fetch);
+        fetch = next;
+    }
+
+    for (struct simple_driver* info = async_drivers; info; info = info->next_async)
+        drive_async_run_pending(info);
+}
+
+// Removes the fetches of a driver from a list, and frees them
+static void drive_async_drop_fetches(struct simple_fetch** link, struct simple_driver* info)
+{
+    while (*link) {
+        struct simple_fetch* fetch = *link;
+        if (fetch->info == info) {
+            *link = fetch->next;
+            free(fetch->data);
+            free(fetch);
+        } else
+            link = &fetch->next;
+    }
+}
+
+// Drops every request that has not completed yet. Blocks that are being read are still put in the cache.
+static void drive_async_cancel(void)
+{
+    for (struct simple_driver* info = async_drivers; info; info = info->next_async) {
+        while (info->pending) {
+            struct simple_request* next = info->pending->next;
+            free(info->pending);
+            info->pending = next;
+            async_requests--;
         }
-        buffer += 512;
-        offset += 512;
     }
+}
+#endif
+
+static int drive_simple_write(void* this, void* cb_ptr, void* buffer, uint32_t size, drv_offset_t offset, drive_cb cb)
+{
+#ifndef _WIN32
+    if (((struct simple_driver*)this)->async)
+        return drive_async_request(this, cb_ptr, buffer, size, offset, cb, 1);
+#endif
+    UNUSED(cb);
+    UNUSED(cb_ptr);
+    struct drive_iovec iov = { buffer, size };
+    drive_simple_transfer(this, &iov, 1, offset, 1);
     return DRIVE_RESULT_SYNC;
 }
 
 static int drive_simple_read(void* this, void* cb_ptr, void* buffer, uint32_t size, drv_offset_t offset, drive_cb cb)
 {
-    UNUSED(this);
+#ifndef _WIN32
+    if (((struct simple_driver*)this)->async)
+        return drive_async_request(this, cb_ptr, buffer, size, offset, cb, 0);
+#endif
     UNUSED(cb);
     UNUSED(cb_ptr);
+    struct drive_iovec iov = { buffer, size };
+    drive_simple_transfer(this, &iov, 1, offset, 0);
+    return DRIVE_RESULT_SYNC;
+}
 
-    if ((size | offset) & 511)
-        DRIVE_FATAL("Length/offset must be multiple of 512 bytes\n");
-
-    struct simple_driver* info = this;
+static int drive_simple_writev(void* this, struct drive_iovec* iov, int iovcnt, drv_offset_t offset)
+{
+    drive_simple_transfer(this, iov, iovcnt, offset, 1);
+    return DRIVE_RESULT_SYNC;
+}
 
-    drv_offset_t end = size + offset;
-    while (offset != end) {
-        if (!drive_simple_fetch_cache(info, buffer, offset)) {
-            lseek(info->fd, offset, SEEK_SET);
-            if (read(info->fd, buffer, 512) != 512)
-                DRIVE_FATAL("Unable to read 512 bytes from image file\n");
-        }
-        buffer += 512;
-        offset += 512;
-    }
+static int drive_simple_readv(void* this, struct drive_iovec* iov, int iovcnt, drv_offset_t offset)
+{
+    drive_simple_transfer(this, iov, iovcnt, offset, 0);
     return DRIVE_RESULT_SYNC;
 }
 
@@ -896,13 +1392,27 @@ int drive_simple_init(struct drive_info* info, char* filename)
     sync_info->block_size = BLOCK_SIZE;
     sync_info->block_array_size = (size + sync_info->block_size - 1) / sync_info->block_size;
     sync_info->blocks = calloc(sizeof(uint8_t*), sync_info->block_array_size);
+    sync_info->block_flags = calloc(1, sync_info->block_array_size);
+
+    sync_info->cached_blocks = 0;
+    // Rounded up to whole blocks. Transfers go through the cache one block at a time, so a single block is enough
+    sync_info->max_cached_blocks = ((uint64_t)info->cache_size + sync_info->block_size - 1) / sync_info->block_size;
+    sync_info->clock_hand = 0;
+    sync_info->overlay = NULL;
+    sync_info->mapping = NULL;
 
     sync_info->raw_file_access = info->modify_backing_file;
+    sync_info->async = 0;
+    sync_info->fetching = NULL;
+    sync_info->fetches_running = 0;
+    sync_info->pending = NULL;
 
     info->read = drive_simple_read;
     info->state = drive_simple_state;
     info->write = drive_simple_write;
     info->prefetch = drive_simple_prefetch;
+    info->readv = drive_simple_readv;
+    info->writev = drive_simple_writev;
 
     // Now determine drive geometry
     info->sectors = size / 512;
@@ -913,12 +1423,92 @@ int drive_simple_init(struct drive_info* info, char* filename)
     return 0;
 }
 
+int drive_async_init(struct drive_info* info, char* filename)
+{
+    if (drive_simple_init(info, filename) < 0)
+        return -1;
+#ifndef _WIN32
+    struct simple_driver* async_info = info->data;
+    async_info->async = 1;
+    // The blocks of waiting requests are never evicted, so leave room for the largest request on top of the blocks that
+    // the I/O threads may be reading. The IDE controller waits for each request before it sends the next one.
+    drive_async_min_cache(async_info, DRIVE_ASYNC_MAX_REQUEST_BLOCKS + DRIVE_ASYNC_THREADS, filename);
+    async_info->fetching = calloc(1, async_info->block_array_size);
+    async_info->next_async = async_drivers;
+    async_drivers = async_info;
+
+    if (!fetch_threads_started) {
+        for (int i = 0; i < DRIVE_ASYNC_THREADS; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, drive_async_thread, NULL))
+                DRIVE_FATAL("Unable to create I/O thread\n");
+            pthread_detach(thread);
+        }
+        fetch_threads_started = 1;
+    }
+#endif
+    return 0;
+}
+
+// Same as the sync driver, except that the image file is mapped into memory. Sectors are copied straight out of the
+// host's page cache instead of being read with a system call each time, and every emulator that uses the same image
+// shares the same copy of it. Writes go to the block cache as usual, or to the mapping in raw mode.
+int drive_mmap_init(struct drive_info* info, char* filename)
+{
+    if (drive_simple_init(info, filename) < 0)
+        return -1;
+#ifndef _WIN32
+    struct simple_driver* mmap_info = info->data;
+    if (!mmap_info->image_size)
+        return 0;
+    int prot = mmap_info->raw_file_access ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* mapping = mmap(NULL, mmap_info->image_size, prot, MAP_SHARED, mmap_info->fd, 0);
+    // Fall back to system calls if the image does not fit in the address space
+    if (mapping == MAP_FAILED)
+        fprintf(stderr, "Unable to map %s, reading it normally instead\n", filename);
+    else
+        mmap_info->mapping = mapping;
+#endif
+    return 0;
+}
+
 void drive_destroy_simple(struct drive_info* info)
 {
     struct simple_driver* simple_info = info->data;
+#ifndef _WIN32
+    if (simple_info->mapping)
+        munmap(simple_info->mapping, simple_info->image_size);
+#endif
+#ifndef _WIN32
+    if (simple_info->async) {
+        struct simple_driver** link = &async_drivers;
+        while (*link != simple_info)
+            link = &(*link)->next_async;
+        *link = simple_info->next_async;
+
+        // The I/O threads must be done with the driver before it is freed
+        pthread_mutex_lock(&fetch_lock);
+        drive_async_drop_fetches(&fetch_queue, simple_info);
+        while (simple_info->fetches_running)
+            pthread_cond_wait(&fetch_idle_cond, &fetch_lock);
+        drive_async_drop_fetches(&fetch_done, simple_info);
+        pthread_mutex_unlock(&fetch_lock);
+
+        while (simple_info->pending) {
+            struct simple_request* next = simple_info->pending->next;
+            free(simple_info->pending);
+            simple_info->pending = next;
+            async_requests--;
+        }
+        free(simple_info->fetching);
+    }
+#endif
     for (unsigned int i = 0; i < simple_info->block_array_size; i++)
         free(simple_info->blocks[i]);
     free(simple_info->blocks);
+    free(simple_info->block_flags);
+    if (simple_info->overlay)
+        fclose(simple_info->overlay);
     free(simple_info);
 }
 
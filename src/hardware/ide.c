@@ -1561,6 +1561,38 @@ static void ide_identify(struct ide_controller* ctrl)
     ctrl->pio_position = 0;
 }
 
+#define IDE_DMA_MAX_IOVECS 32
+
+// PRDT entries that are transferred together in a single vectored request
+struct ide_dma_batch {
+    struct drive_iovec iov[IDE_DMA_MAX_IOVECS];
+    int count;
+    uint64_t offset; // Disk offset of the first entry
+};
+
+static void ide_dma_flush(struct drive_info* drv, struct ide_dma_batch* batch, int write)
+{
+    if (!batch->count)
+        return;
+    int res = write ? drive_writev(drv, batch->iov, batch->count, batch->offset) : drive_readv(drv, batch->iov, batch->count, batch->offset);
+    if (res != DRIVE_RESULT_SYNC)
+        IDE_FATAL("Expected sync response for prefetched data\n");
+    batch->count = 0;
+}
+
+static void ide_dma_add(struct drive_info* drv, struct ide_dma_batch* batch, void* ptr, uint32_t length, uint64_t offset, int write)
+{
+    if (!length)
+        return;
+    if (batch->count == IDE_DMA_MAX_IOVECS)
+        ide_dma_flush(drv, batch, write);
+    if (!batch->count)
+        batch->offset = offset;
+    batch->iov[batch->count].buffer = ptr;
+    batch->iov[batch->count].length = length;
+    batch->count++;
+}
+
 static void ide_read_dma_handler(void* this, int status)
 {
     struct ide_controller* ctrl = this;
@@ -1570,9 +1602,9 @@ static void ide_read_dma_handler(void* this, int status)
              bytes_in_buffer = sectors * 512;
     uint64_t offset = ide_get_sector_offset(ctrl, ctrl->lba48) * 512ULL;
     struct drive_info* drv = SELECTED(ctrl, info);
+    struct ide_dma_batch batch;
+    batch.count = 0;
 
-    // XXX -- our goal should be to write it directly into memory
-    void* temp = alloca(65536);
     while (1) {
         // Read fields from PRDT
         uint32_t dest = cpu_read_phys(prdt_addr), other_stuff = cpu_read_phys(prdt_addr + 4),
@@ -1582,6 +1614,7 @@ static void ide_read_dma_handler(void* this, int status)
         uint32_t dma_bytes = count;
         if (dma_bytes > bytes_in_buffer)
             dma_bytes = bytes_in_buffer;
+        dma_bytes &= ~511;
 
         // This should be a sync read
         IDE_LOG("PCI IDE read\n");
@@ -1590,32 +1623,30 @@ static void ide_read_dma_handler(void* this, int status)
         IDE_LOG(" -- sector: %llx\n", (unsigned long long)offset >> 9);
         //if(offset == 0x19ba15000) __asm__("int3");
 
-        // Invalidate the TLB for all the pages we are going to mess with
-        {
-            // Round up so that we catch every page
-            int count_rounded = ((count + 0xFFF) >> 12) << 12;
-            for (int i = 0; i < count_rounded; i += 4096)
+        // Read the whole entry straight into guest memory if we can. The pages are invalidated by cpu_get_dma_ptr.
+        void* ptr = cpu_get_dma_ptr(dest, dma_bytes);
+        if (ptr)
+            ide_dma_add(drv, &batch, ptr, dma_bytes, offset, 0);
+        else {
+            ide_dma_flush(drv, &batch, 0);
+            uint8_t temp[512];
+            for (uint32_t i = 0; i < dma_bytes; i += 512) {
+                if (drive_read(drv, NULL, temp, 512, offset + i, NULL) != DRIVE_RESULT_SYNC)
+                    IDE_FATAL("Expected sync response for prefetched data\n");
                 cpu_init_dma(dest + i);
-        }
-        while (dma_bytes >= 512) {
-            int res = drive_read(drv, NULL, temp, 512, offset, NULL);
-            if (res != DRIVE_RESULT_SYNC)
-                IDE_FATAL("Expected sync response for prefetched data\n");
-
-            cpu_write_mem(dest, temp, 512);
-            dma_bytes -= 512;
-            dest += 512;
-            offset += 512;
+                cpu_init_dma(dest + i + 511);
+                cpu_write_mem(dest + i, temp, 512);
+            }
         }
 
         // Move ourselves forward.
-
         bytes_in_buffer -= dma_bytes;
         offset += dma_bytes;
         prdt_addr += 8;
         if (!bytes_in_buffer || end)
             break;
     }
+    ide_dma_flush(drv, &batch, 0);
     ctrl->status = ATA_STATUS_DRDY | ATA_STATUS_DSC;
     ctrl->dma_status &= ~1;
     ctrl->dma_status |= 4;
@@ -1648,6 +1679,8 @@ static void ide_write_dma_handler(void* this, int status)
     struct drive_info* drv = SELECTED(ctrl, info);
 
     void* mem = cpu_get_ram_ptr();
+    struct ide_dma_batch batch;
+    batch.count = 0;
 
     while (1) {
         // Read fields from PRDT
@@ -1658,29 +1691,23 @@ static void ide_write_dma_handler(void* this, int status)
         uint32_t dma_bytes = count;
         if (dma_bytes > bytes_in_buffer)
             dma_bytes = bytes_in_buffer;
+        dma_bytes &= ~511;
 
         // This should be a sync read
         IDE_LOG("PCI IDE write\n");
         IDE_LOG(" -- Destination: %08x\n", dest);
         IDE_LOG(" -- Length: %08x [real: %08x] End? %s\n", count, dma_bytes, end ? "Yes" : "No");
         IDE_LOG(" -- sector: %llx\n", (unsigned long long)offset >> 9);
-        while (dma_bytes >= 512) {
-            int res = drive_write(drv, NULL, mem + dest, 512, offset, NULL);
-            if (res != DRIVE_RESULT_SYNC)
-                IDE_FATAL("Expected sync response for prefetched data\n");
-            dma_bytes -= 512;
-            dest += 512;
-            offset += 512;
-        }
+        ide_dma_add(drv, &batch, mem + dest, dma_bytes, offset, 1);
 
         // Move ourselves forward.
-
         bytes_in_buffer -= dma_bytes;
         offset += dma_bytes;
         prdt_addr += 8;
         if (!bytes_in_buffer || end)
             break;
     }
+    ide_dma_flush(drv, &batch, 1);
     ctrl->status = ATA_STATUS_DRDY | ATA_STATUS_DSC;
     ctrl->dma_status &= ~1;
     ctrl->dma_status |= 4;
@@ -2036,7 +2063,7 @@ void ide_write_prdt(uint32_t addr, uint32_t data)
             switch (this->command_issued) {
             case 0x25:
             case 0xC8:
-                result = drive_prefetch(SELECTED(this, info), this, ide_get_sector_count(this, lba48), ide_get_sector_offset(this, lba48) << (drv_offset_t)9, ide_read_dma_handler);
+                result = drive_prefetch(SELECTED(this, info), this, ide_get_sector_count(this, lba48) << 9, ide_get_sector_offset(this, lba48) << (drv_offset_t)9, ide_read_dma_handler);
                 if (result == DRIVE_RESULT_SYNC)
                     ide_read_dma_handler(this, 0);
                 else
@@ -2044,7 +2071,7 @@ void ide_write_prdt(uint32_t addr, uint32_t data)
                 break;
             case 0x35:
             case 0xCA:
-                result = drive_prefetch(SELECTED(this, info), this, ide_get_sector_count(this, lba48), ide_get_sector_offset(this, lba48) << (drv_offset_t)9, ide_write_dma_handler);
+                result = drive_prefetch(SELECTED(this, info), this, ide_get_sector_count(this, lba48) << 9, ide_get_sector_offset(this, lba48) << (drv_offset_t)9, ide_write_dma_handler);
                 if (result == DRIVE_RESULT_SYNC)
                     ide_write_dma_handler(this, 0);
                 else
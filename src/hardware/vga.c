@@ -90,6 +90,8 @@ static struct vga_info {
 
     // These fields should not be saved in the VRAM savestate since they have to do with rendering.
     uint8_t* vbe_scanlines_modified;
+    // Pages of the linear framebuffer that the CPU wrote to directly, see vga_update_lfb_mapping
+    uint32_t* lfb_dirty;
 
     // Screen data cannot change if memory_modified is zero.
     int memory_modified;
@@ -110,6 +112,35 @@ static void vga_alloc_mem(void)
         afree(vga.vram);
     vga.vram = aalloc(vga.vram_size, 8);
     memset(vga.vram, 0, vga.vram_size);
+    vga.lfb_dirty = realloc(vga.lfb_dirty, (((vga.vram_size >> 12) + 31) >> 5) * 4);
+}
+
+// While the linear framebuffer is enabled, it is mapped straight into the CPU's physical address space instead of
+// trapping every access in vga_mem_readb/vga_mem_writeb. vga_update picks up the pages written in the meantime.
+static void vga_update_lfb_mapping(void)
+{
+    if ((vga.vbe_enable & (VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED)) == (VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED))
+        cpu_map_device_ram(VBE_LFB_BASE, vga.vram_size, vga.vram);
+    else
+        cpu_map_device_ram(0, 0, NULL);
+}
+
+// Marks the scanlines covered by the framebuffer pages that the CPU wrote to as modified
+static void vga_collect_lfb_writes(void)
+{
+    if (!cpu_get_device_ram_dirty(vga.lfb_dirty))
+        return;
+    uint32_t bytes_per_line = vga.total_width * ((vga.vbe_regs[3] + 7) >> 3);
+    if (!bytes_per_line)
+        return;
+    for (uint32_t i = 0; i < (uint32_t)vga.vram_size >> 12; i++) {
+        if (!(vga.lfb_dirty[i >> 5] >> (i & 31) & 1))
+            continue;
+        uint32_t scanline = (i << 12) / bytes_per_line, last = ((i << 12) | 0xFFF) / bytes_per_line;
+        for (; scanline <= last && scanline < vga.total_height; scanline++)
+            vga.vbe_scanlines_modified[scanline] = 1;
+    }
+    vga.memory_modified = 1;
 }
 
 static void vga_state(void)
@@ -162,6 +193,7 @@ static void vga_state(void)
     if (state_is_reading()) {
         vga_update_size();
         vga_alloc_mem();
+        vga_update_lfb_mapping();
     }
     state_file(vga.vram_size, "vram", vga.vram);
 
@@ -428,6 +460,7 @@ static
                 vga.vbe_regs[9] = 0;
                 vga.vbe_regs[6] = vga.total_width;
                 vga.vbe_regs[7] = vga.total_height;
+                vga_update_lfb_mapping();
                 // TODO...
             }
             break;
@@ -965,6 +998,7 @@ void vga_update(void)
         offset_between_lines = vga.total_width * 4;
         break;
     }
+    vga_collect_lfb_writes();
     if (!vga.memory_modified)
         return;
     vga.memory_modified &= ~(1 << (vga.current_scanline != 0));
@@ -283,6 +283,8 @@ static const struct ini_enum driver_types[] = {
     { "normal", 0 },
     { "network", 2 },
     { "net", 2 },
+    { "async", 3 },
+    { "mmap", 4 },
     { NULL, 0 }
 };
 static const struct ini_enum virtio_types[] = {
@@ -321,11 +323,16 @@ static int parse_disk(struct drive_info* drv, struct ini_section* s, int id)
     if (driver == 0 && wb)
         printf("WARNING: Disk %d uses async (chunked) driver but writeback is not supported!!\n", id);
     drv->modify_backing_file = wb;
+    drv->cache_size = get_field_int(s, "cache", 256 * 1024 * 1024);
     if (path && inserted) {
 #ifndef EMSCRIPTEN
         UNUSED(id);
         if (driver == 0)
             return drive_init(drv, path);
+        else if (driver == 3)
+            return drive_async_init(drv, path);
+        else if (driver == 4)
+            return drive_mmap_init(drv, path);
         else
             return drive_simple_init(drv, path);
 #else
@@ -382,6 +389,14 @@ int parse_cfg(struct pc_settings* pc, char* data)
     pc->pci_vga_enabled = get_field_int(global, "pcivga", 0);
     pc->boot_kernel = get_field_int(global, "kernel", 0);
 
+    // CPU cache sizes (zero selects the default)
+    pc->cpu_cache.trace_info_entries = get_field_int(global, "traceentries", 0);
+    pc->cpu_cache.trace_cache_size = get_field_int(global, "tracecache", 0);
+    pc->cpu_cache.max_trace_size = get_field_int(global, "tracesize", 0);
+    pc->cpu_cache.tlb_entries = get_field_int(global, "tlbsize", 0);
+
+    pc->fpu_fast = get_field_int(global, "fastfpu", 0);
+
     // Now figure out disk image information
     int res = parse_disk(&pc->drives[0], get_section(global, "ata0-master"), 0);
     res |= parse_disk(&pc->drives[1], get_section(global, "ata0-slave"), 1);
@@ -1,5 +1,8 @@
 #include "io.h"
 #include "cpuapi.h"
+#ifdef RECORD
+#include "record.h"
+#endif
 #include "util.h"
 #include <stdint.h>
 #include <stdio.h>
@@ -210,116 +213,207 @@ static uint32_t io_default_mmio_readb(uint32_t addr)
     UNUSED(addr);
     return -1;
 }
+static uint32_t io_mmio_read(uint32_t addr, int size);
 // XXX: Increase performance
 static uint32_t io_default_mmio_readw(uint32_t addr)
 {
-    uint16_t result = io_handle_mmio_read(addr, 0);
-    return result | io_handle_mmio_read(addr + 1, 0) << 8;
+    uint16_t result = io_mmio_read(addr, 0);
+    return result | io_mmio_read(addr + 1, 0) << 8;
 }
 static uint32_t io_default_mmio_readd(uint32_t addr)
 {
-    uint32_t result = io_handle_mmio_read(addr, 0);
-    result |= io_handle_mmio_read(addr + 1, 0) << 8;
-    result |= io_handle_mmio_read(addr + 2, 0) << 16;
-    return result | io_handle_mmio_read(addr + 3, 0) << 24;
+    uint32_t result = io_mmio_read(addr, 0);
+    result |= io_mmio_read(addr + 1, 0) << 8;
+    result |= io_mmio_read(addr + 2, 0) << 16;
+    return result | io_mmio_read(addr + 3, 0) << 24;
 }
 
-// Memory mapped locations are so few and far in between that it's ok to do it the simple way:
+// Memory mapped regions, in the order that they were registered. Earlier regions take priority over later ones if they
+// overlap, and anything that isn't covered by a region goes to the default handlers. Like before, the byte right after
+// the end of a region is treated as part of it.
 #define MAX_MMIO 10
 struct mmio {
     io_read r[3];
     io_write w[3];
-    uint32_t begin, end;
+    uint32_t begin, end; // end is inclusive
+    uint64_t accesses;
 };
 
-static struct mmio mmio[MAX_MMIO + 1];
-static int mmio_pos[2] = { 0, 0 },
-           tf = 0; // Ugly hack, but necessary
-void io_register_mmio_read(uint32_t start, uint32_t length, io_read b, io_read w, io_read d)
+// To find the region of an address without scanning the list, every 4 KB page has the index of its region (plus one)
+// in a two level table. 0 means that no region touches the page, and MMIO_PAGE_MIXED means that the page is only
+// partially covered, so the list has to be scanned. Tables are only allocated for 4 MB areas that have regions in them.
+#define MMIO_PAGE_MIXED 0xFF
+struct mmio_map {
+    struct mmio regions[MAX_MMIO];
+    int count;
+    uint8_t* pages[1024];
+};
+static struct mmio_map mmio_maps[2]; // Reads, writes
+
+static uint32_t mmio_page_get(struct mmio_map* map, uint32_t page)
 {
-    if (tf && mmio_pos[0] == MAX_MMIO) {
-        IO_LOG("Too many read areas\n");
-        abort();
+    uint8_t* table = map->pages[page >> 10];
+    return table ? table[page & 1023] : 0;
+}
+
+static void mmio_page_set(struct mmio_map* map, uint32_t page, uint8_t value)
+{
+    uint8_t** table = &map->pages[page >> 10];
+    if (!*table) {
+        *table = calloc(1024, 1);
+        if (!*table) {
+            IO_LOG("Unable to allocate MMIO page table\n");
+            abort();
+        }
     }
-    mmio[mmio_pos[0]].begin = start;
-    mmio[mmio_pos[0]].end = start + length;
-    mmio[mmio_pos[0]].r[0] = b ? b : io_default_mmio_readb;
-    mmio[mmio_pos[0]].r[1] = w ? w : io_default_mmio_readw;
-    mmio[mmio_pos[0]].r[2] = d ? d : io_default_mmio_readd;
+    (*table)[page & 1023] = value;
+}
 
-    mmio_pos[0]++;
+// Rebuilds the page table whenever regions are added or moved, which only happens during initialization and when
+// the guest reprograms a BAR.
+static void mmio_rebuild(struct mmio_map* map)
+{
+    for (int i = 0; i < 1024; i++) {
+        free(map->pages[i]);
+        map->pages[i] = NULL;
+    }
+    for (int i = 0; i < map->count; i++) {
+        struct mmio* region = &map->regions[i];
+        // A region that wraps around the end of the address space (e.g. a BAR being sized) can never match an address
+        if (region->end < region->begin)
+            continue;
+        uint32_t page = region->begin >> 12, last = region->end >> 12;
+        while (1) {
+            uint32_t current = mmio_page_get(map, page);
+            // Pages that an earlier region covers completely never reach us. Partially covered pages stay partial.
+            if (!current) {
+                int full = region->begin <= page << 12 && region->end >= (page << 12 | 0xFFF);
+                mmio_page_set(map, page, full ? i + 1 : MMIO_PAGE_MIXED);
+            }
+            if (page == last)
+                break;
+            page++;
+        }
+    }
 }
-void io_register_mmio_write(uint32_t start, uint32_t length, io_write b, io_write w, io_write d)
+
+static struct mmio* mmio_find(struct mmio_map* map, uint32_t addr)
 {
-    if (tf && mmio_pos[1] == MAX_MMIO) {
-        IO_LOG("Too many write areas\n");
-        abort();
+    uint32_t index = mmio_page_get(map, addr >> 12);
+    if (index != MMIO_PAGE_MIXED)
+        return index ? &map->regions[index - 1] : NULL;
+    for (int i = 0; i < map->count; i++) {
+        if (addr >= map->regions[i].begin && map->regions[i].end >= addr)
+            return &map->regions[i];
     }
+    return NULL;
+}
 
-    mmio[mmio_pos[1]].begin = start;
-    mmio[mmio_pos[1]].end = start + length;
-    mmio[mmio_pos[1]].w[0] = b ? b : io_default_mmio_writeb;
-    mmio[mmio_pos[1]].w[1] = w ? w : io_default_mmio_writew;
-    mmio[mmio_pos[1]].w[2] = d ? d : io_default_mmio_writed;
+static struct mmio* mmio_add(struct mmio_map* map, uint32_t start, uint32_t length)
+{
+    if (map->count == MAX_MMIO) {
+        IO_LOG("Too many %s areas\n", map == &mmio_maps[0] ? "read" : "write");
+        abort();
+    }
+    struct mmio* region = &map->regions[map->count++];
+    region->begin = start;
+    region->end = start + length;
+    region->accesses = 0;
+    return region;
+}
 
-    mmio_pos[1]++;
+void io_register_mmio_read(uint32_t start, uint32_t length, io_read b, io_read w, io_read d)
+{
+    struct mmio* region = mmio_add(&mmio_maps[0], start, length);
+    region->r[0] = b ? b : io_default_mmio_readb;
+    region->r[1] = w ? w : io_default_mmio_readw;
+    region->r[2] = d ? d : io_default_mmio_readd;
+    mmio_rebuild(&mmio_maps[0]);
 }
+void io_register_mmio_write(uint32_t start, uint32_t length, io_write b, io_write w, io_write d)
+{
+    struct mmio* region = mmio_add(&mmio_maps[1], start, length);
+    region->w[0] = b ? b : io_default_mmio_writeb;
+    region->w[1] = w ? w : io_default_mmio_writew;
+    region->w[2] = d ? d : io_default_mmio_writed;
+    mmio_rebuild(&mmio_maps[1]);
+}
+// Moves the region starting at oldstart. The write handlers of a device are registered with the same range, so they
+// are moved along with the read handlers.
 void io_remap_mmio_read(uint32_t oldstart, uint32_t newstart){
-    for(int i=0;i<MAX_MMIO;i++){
-        if(mmio[i].begin == oldstart){
-            mmio[i].begin = newstart;
-            mmio[i].end = (mmio[i].end - oldstart) + newstart;
-            return;
+    int found = 0;
+    for (int j = 0; j < 2; j++) {
+        struct mmio_map* map = &mmio_maps[j];
+        for (int i = 0; i < map->count; i++) {
+            if (map->regions[i].begin == oldstart) {
+                map->regions[i].begin = newstart;
+                map->regions[i].end = (map->regions[i].end - oldstart) + newstart;
+                mmio_rebuild(map);
+                found = 1;
+                break;
+            }
         }
     }
-    IO_LOG("Unable to remap MMIO range at %08x to %08x\n", oldstart, newstart);
+    if (!found)
+        IO_LOG("Unable to remap MMIO range at %08x to %08x\n", oldstart, newstart);
 }
 
 void io_handle_mmio_write(uint32_t addr, uint32_t data, int size)
 {
-    //if(addr == 0x004abc95) __asm__("int3");
-    for (int i = 0; i <= MAX_MMIO; i++) {
-        if (addr >= mmio[i].begin && mmio[i].end >= addr) {
-            //printf("'%c' %08x %08x %08x %d %d size: %d\n", data, mmio[i].begin, addr, mmio[i].end, addr >= mmio[i].begin, addr < mmio[i].end, size);
-            mmio[i].w[size](addr, data);
-            return;
-        }
+    struct mmio* region = mmio_find(&mmio_maps[1], addr);
+    if (!region) {
+        static const io_write defaults[3] = { io_default_mmio_writeb, io_default_mmio_writew, io_default_mmio_writed };
+        defaults[size](addr, data);
+        return;
     }
-    abort();
+    region->accesses++;
+    region->w[size](addr, data);
 }
-uint32_t io_handle_mmio_read(uint32_t addr, int size)
+static uint32_t io_mmio_read(uint32_t addr, int size)
 {
-    for (int i = 0; i <= MAX_MMIO; i++) {
-        if (addr >= mmio[i].begin && mmio[i].end >= addr) {
-            uint32_t res = mmio[i].r[size](addr); 
-            //printf("%08x\n", res);
-            return res;
-        }
+    struct mmio* region = mmio_find(&mmio_maps[0], addr);
+    if (!region) {
+        static const io_read defaults[3] = { io_default_mmio_readb, io_default_mmio_readw, io_default_mmio_readd };
+        return defaults[size](addr);
     }
-    IO_LOG(" ??? should not be here ??? Unknown mmio read: %08x\n", addr);
-    abort();
+    region->accesses++;
+    return region->r[size](addr);
+}
+uint32_t io_handle_mmio_read(uint32_t addr, int size)
+{
+#ifdef RECORD
+    uint32_t result = io_mmio_read(addr, size);
+    record_mmio_read(addr, result, size);
+    return result;
+#else
+    return io_mmio_read(addr, size);
+#endif
 }
 
 // Checks if address is mmapped for reading
 int io_addr_mmio_read(uint32_t addr){
-    for (int i = 0; i <= MAX_MMIO; i++) {
-        if (addr >= mmio[i].begin && mmio[i].end >= addr) {
-            return mmio[i].begin != 0;
+    struct mmio* region = mmio_find(&mmio_maps[0], addr);
+    return region && region->begin != 0;
+}
+
+// For debugging purposes. Call using GDB
+void io_mmio_debug(void)
+{
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < mmio_maps[j].count; i++) {
+            struct mmio* region = &mmio_maps[j].regions[i];
+            printf("MMIO %s %08x-%08x: %llu accesses\n", j ? "write" : "read", region->begin, region->end,
+                (unsigned long long)region->accesses);
         }
     }
-    return 0;
 }
 
 void io_init(void)
 {
     io_register_read(0, 65536, NULL, NULL, NULL);
     io_register_write(0, 65536, NULL, NULL, NULL);
-    tf = 0;
-    for (int i = 0; i < (MAX_MMIO + 1); i++) {
-        io_register_mmio_read(0, -1, NULL, NULL, NULL); // Cover an address space from 0 ... 0xFFFFFFFF
-        io_register_mmio_write(0, -1, NULL, NULL, NULL);
+    for (int i = 0; i < 2; i++) {
+        mmio_maps[i].count = 0;
+        mmio_rebuild(&mmio_maps[i]);
     }
-    mmio_pos[0] = 0;
-    mmio_pos[1] = 0;
-    tf = 1;
-}
\ No newline at end of file
+}
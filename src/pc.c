@@ -11,6 +11,13 @@
 #define DISABLE_RESTORE
 // Comment below line to disable automatic saving.
 #define DISABLE_CONSTANT_SAVING
+// With --record, a savestate is saved to savestates/halfix_record once the guest has run this many instructions, and
+// what the devices do from then on is recorded next to it (see src/record.c). tools/cpubench.c can replay it. The
+// directory has to exist.
+#ifdef RECORD
+#define RECORD_STATE_AT 100000000
+#include "record.h"
+#endif
 
 static inline void pc_cmos_lowhi(int idx, int data)
 {
@@ -222,6 +229,9 @@ int pc_init(struct pc_settings* pc)
     if (cpu_init() == -1)
         return -1;
     cpu_set_cpuid(&pc->cpu);
+    if (cpu_set_cache_config(&pc->cpu_cache) == -1)
+        return -1;
+    cpu_set_fpu_fast_mode(pc->fpu_fast);
     io_init();
     dma_init();
     cmos_init(pc->current_time);
@@ -431,6 +441,14 @@ int pc_execute(void)
         sync = 0;
         last = cpu_get_cycles();
     }
+#ifdef RECORD
+    static int recorded = 0;
+    if (!recorded && !drive_async_event_in_progress() && cpu_get_cycles() >= RECORD_STATE_AT) {
+        state_store_to_file("savestates/halfix_record");
+        record_start("savestates/halfix_record");
+        recorded = 1;
+    }
+#endif
     do {
         now = get_now();
         cycles_to_run = devices_get_next(now, &devices_need_servicing);
@@ -0,0 +1,115 @@
+// Instrumentation callbacks (see include/cpu/instrument.h) that record everything the CPU gets from devices, so that
+// tools/cpubench.c can run the same stretch of guest code again on its own. Only built with --record, which takes the
+// place of any other instrumentation. Nothing is recorded until pc.c calls record_start, which it does right after
+// saving the state given by RECORD_STATE_AT.
+
+#include "record.h"
+#include "cpu/cpu.h"
+#include "cpu/instrument.h"
+#include "cpuapi.h"
+#include "devices.h"
+#include "util.h"
+#include <stdio.h>
+
+static FILE* events;
+
+void record_start(char* path)
+{
+    char temp[1000];
+    sprintf(temp, "%s/events", path);
+    if (!(events = fopen(temp, "wb"))) {
+        fprintf(stderr, "Unable to create %s\n", temp);
+        return;
+    }
+    struct record_header header = { RECORD_MAGIC, apic_is_enabled() };
+    fwrite(&header, sizeof(header), 1, events);
+}
+
+static void record(int type, uint32_t addr, uint32_t data, int size)
+{
+    struct record_event event;
+    event.cycles = cpu_get_cycles();
+    event.phys_eip = cpu.phys_eip;
+    event.type = type;
+    event.size = size;
+    event.unused = 0;
+    event.addr = addr;
+    event.data = data;
+    fwrite(&event, sizeof(event), 1, events);
+    // The emulator is usually stopped by killing it, so don't leave anything in the buffer
+    fflush(events);
+}
+
+void cpu_instrument_io_read(uint32_t addr, uint32_t data, int size)
+{
+    if (events)
+        record(RECORD_IO_READ, addr, data, size);
+}
+void record_mmio_read(uint32_t addr, uint32_t data, int size)
+{
+    if (events)
+        record(RECORD_MMIO_READ, addr, data, size);
+}
+void cpu_instrument_hardware_interrupt(int vector)
+{
+    if (events)
+        record(RECORD_INTERRUPT, 0, vector, 0);
+}
+void cpu_instrument_dma(uint32_t addr, void* data, uint32_t length)
+{
+    if (events) {
+        record(RECORD_DMA, addr, length, 0);
+        fwrite(data, length, 1, events);
+        fflush(events);
+    }
+}
+void cpu_instrument_set_a20(int newvalue)
+{
+    if (events)
+        record(RECORD_A20, 0, newvalue, 0);
+}
+
+// The CPU does all of these by itself, so they come out the same way when the recording is played back
+void cpu_instrument_memory_permissions_changed(uint32_t addr, int access_bits)
+{
+    UNUSED(addr | access_bits);
+}
+void cpu_instrument_paging_modified(uint32_t page_directory_entry_addr)
+{
+    UNUSED(page_directory_entry_addr);
+}
+void cpu_instrument_init_mem(void)
+{
+}
+void cpu_instrument_init(void)
+{
+}
+void cpu_instrument_execute(void)
+{
+}
+void cpu_instrument_io_write(uint32_t addr, uint32_t data, int size)
+{
+    UNUSED(addr | data | size);
+}
+void cpu_instrument_access_msr(int index, uint32_t high, uint32_t low, int writing)
+{
+    UNUSED(index | high | low | writing);
+}
+void cpu_instrument_set_intr_line(int value, int _internal)
+{
+    UNUSED(value | _internal);
+}
+void cpu_instrument_rdtsc(uint32_t eax, uint32_t edx)
+{
+    UNUSED(eax | edx);
+}
+void cpu_instrument_pre_fpu(void)
+{
+}
+void cpu_instrument_tlb_full(void)
+{
+}
+void cpu_instrument_approximate_sse(int dest, int dwords)
+{
+    UNUSED(dest | dwords);
+}
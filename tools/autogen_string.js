@@ -61,18 +61,27 @@ int movs$4$3(int flags)
         cpu.reg$2DI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = movs_bulk(ds_base + cpu.reg$2SI], cpu.reg$2SI], cpu.seg_base[ES] + cpu.reg$2DI], cpu.reg$2DI], add, count, $5);
+        if (n) {
+            cpu.reg$2SI] += add * n;
+            cpu.reg$2DI] += add * n;
+            cpu.reg$2CX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_read$0(ds_base + cpu.reg$2SI], src, cpu.tlb_shift_read);
         cpu_write$0(cpu.seg_base[ES] + cpu.reg$2DI], src, cpu.tlb_shift_write);
         cpu.reg$2SI] += add;
         cpu.reg$2DI] += add;
         cpu.reg$2CX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg$2CX] != 0;
 }
             */
-        }, szspc, add, regspec, asize, size_endings[osize]);
+        }, szspc, add, regspec, asize, size_endings[osize], asize === 16 ? 1 : 0);
     },
     "stos": function (osize, asize) {
         var add = "-" + osize + " : " + osize,
@@ -103,16 +112,24 @@ int stos$5$3(int flags)
         cpu.reg$2DI] += add;
         return 0;
     }
-    for (int i = 0; i < count; i++) {
+    while (count > 0) {
+        int n = stos_bulk(cpu.seg_base[ES] + cpu.reg$2DI], cpu.reg$2DI], src, add, count, $6);
+        if (n) {
+            cpu.reg$2DI] += add * n;
+            cpu.reg$2CX] -= n;
+            count -= n;
+            continue;
+        }
         cpu_write$0(cpu.seg_base[ES] + cpu.reg$2DI], src, cpu.tlb_shift_write);
         cpu.reg$2DI] += add;
         cpu.reg$2CX]--;
+        count--;
         //cpu.cycles_to_run--;
     }
     return cpu.reg$2CX] != 0;
 }
             */
-        }, szspc, add, regspec, asize, al, size_endings[osize]);
+        }, szspc, add, regspec, asize, al, size_endings[osize], asize === 16 ? 1 : 0);
     },
     "scas": function (osize, asize) {
         var add = "-" + osize + " : " + osize,
@@ -148,10 +165,24 @@ int scas$5$3(int flags)
             cpu.laux = SUB$0;
             return 0;
         case 1: // REPZ
-            for (int i = 0; i < count; i++) {
+            while (count > 0) {
+                uint32_t last;
+                int n = scas_bulk(cpu.seg_base[ES] + cpu.reg$2DI], cpu.reg$2DI], dest, add, count, $6, 0, &last);
+                if (n) {
+                    cpu.reg$2DI] += add * n;
+                    cpu.reg$2CX] -= n;
+                    count -= n;
+                    src = last;
+                    cpu.lr = (int$0_t)(dest - src);
+                    cpu.lop2 = src;
+                    cpu.laux = SUB$0;
+                    if(src != dest) return 0;
+                    continue;
+                }
                 cpu_read$0(cpu.seg_base[ES] + cpu.reg$2DI], src, cpu.tlb_shift_read);
                 cpu.reg$2DI] += add;
                 cpu.reg$2CX]--;
+                count--;
 
                 // XXX don't set this every time
                 cpu.lr = (int$0_t)(dest - src);
@@ -163,10 +194,24 @@ int scas$5$3(int flags)
             }
             return cpu.reg$2CX] != 0;
         case 2: // REPNZ
-            for (int i = 0; i < count; i++) {
+            while (count > 0) {
+                uint32_t last;
+                int n = scas_bulk(cpu.seg_base[ES] + cpu.reg$2DI], cpu.reg$2DI], dest, add, count, $6, 1, &last);
+                if (n) {
+                    cpu.reg$2DI] += add * n;
+                    cpu.reg$2CX] -= n;
+                    count -= n;
+                    src = last;
+                    cpu.lr = (int$0_t)(dest - src);
+                    cpu.lop2 = src;
+                    cpu.laux = SUB$0;
+                    if(src == dest) return 0;
+                    continue;
+                }
                 cpu_read$0(cpu.seg_base[ES] + cpu.reg$2DI], src, cpu.tlb_shift_read);
                 cpu.reg$2DI] += add;
                 cpu.reg$2CX]--;
+                count--;
                 
                 // XXX don't set this every time
                 cpu.lr = (int$0_t)(dest - src);
@@ -181,7 +226,7 @@ int scas$5$3(int flags)
     CPU_FATAL("unreachable");
 }
             */
-        }, szspc, add, regspec, asize, al, size_endings[osize]);
+        }, szspc, add, regspec, asize, al, size_endings[osize], asize === 16 ? 1 : 0);
     },
     "ins": function (osize, asize) {
         var add = "-" + osize + " : " + osize,
@@ -295,12 +340,28 @@ int cmps$4$3(int flags)
             cpu.laux = SUB$0;
             return 0;
         case 1: // REPZ
-            for (int i = 0; i < count; i++) {
+            while (count > 0) {
+                uint32_t last_src, last_dest;
+                int n = cmps_bulk(seg_base + cpu.reg$2SI], cpu.reg$2SI], cpu.seg_base[ES] + cpu.reg$2DI], cpu.reg$2DI], add, count, $5, 0, &last_dest, &last_src);
+                if (n) {
+                    cpu.reg$2DI] += add * n;
+                    cpu.reg$2SI] += add * n;
+                    cpu.reg$2CX] -= n;
+                    count -= n;
+                    dest = last_dest;
+                    src = last_src;
+                    cpu.lr = (int$0_t)(dest - src);
+                    cpu.lop2 = src;
+                    cpu.laux = SUB$0;
+                    if(src != dest) return 0;
+                    continue;
+                }
                 cpu_read$0(seg_base + cpu.reg$2SI], dest, cpu.tlb_shift_read);
                 cpu_read$0(cpu.seg_base[ES] + cpu.reg$2DI], src, cpu.tlb_shift_read);
                 cpu.reg$2DI] += add;
                 cpu.reg$2SI] += add;
                 cpu.reg$2CX]--;
+                count--;
 
                 // XXX don't set this every time
                 cpu.lr = (int$0_t)(dest - src);
@@ -312,12 +373,28 @@ int cmps$4$3(int flags)
             }
             return cpu.reg$2CX] != 0;
         case 2: // REPNZ
-            for (int i = 0; i < count; i++) {
+            while (count > 0) {
+                uint32_t last_src, last_dest;
+                int n = cmps_bulk(seg_base + cpu.reg$2SI], cpu.reg$2SI], cpu.seg_base[ES] + cpu.reg$2DI], cpu.reg$2DI], add, count, $5, 1, &last_dest, &last_src);
+                if (n) {
+                    cpu.reg$2DI] += add * n;
+                    cpu.reg$2SI] += add * n;
+                    cpu.reg$2CX] -= n;
+                    count -= n;
+                    dest = last_dest;
+                    src = last_src;
+                    cpu.lr = (int$0_t)(dest - src);
+                    cpu.lop2 = src;
+                    cpu.laux = SUB$0;
+                    if(src == dest) return 0;
+                    continue;
+                }
                 cpu_read$0(seg_base + cpu.reg$2SI], dest, cpu.tlb_shift_read);
                 cpu_read$0(cpu.seg_base[ES] + cpu.reg$2DI], src, cpu.tlb_shift_read);
                 cpu.reg$2DI] += add;
                 cpu.reg$2SI] += add;
                 cpu.reg$2CX]--;
+                count--;
                 
                 // XXX don't set this every time
                 cpu.lr = (int$0_t)(dest - src);
@@ -332,7 +409,7 @@ int cmps$4$3(int flags)
     CPU_FATAL("unreachable");
 }
             */
-        }, szspc, add, regspec, asize, size_endings[osize]);
+        }, szspc, add, regspec, asize, size_endings[osize], asize === 16 ? 1 : 0);
     },
     "lods": function (osize, asize) {
         var add = "-" + osize + " : " + osize,
@@ -0,0 +1,357 @@
+// CPU microbenchmarks. Runs small, loop-heavy pieces of 32-bit code through the CPU core on its own, without the rest
+// of the emulator, and reports how long each guest instruction takes. Every kernel is run with macro-op fusion turned
+// off and on, which shows how much the fused handlers save. The last kernel is a long stretch of straight-line code that
+// doesn't fit in the host's caches once decoded, which is where the size of struct decoded_instruction matters: build
+// once as is and once with -DHANDLER_POINTERS to compare the two layouts.
+//
+// With -r, the kernels are replaced by guest code recorded from the emulator: build halfix with --record, and point
+// cpubench at the savestate that it writes (see RECORD_STATE_AT in src/pc.c). The CPU runs on from there with no devices attached,
+// so port reads return zero and there are no interrupts, and the run ends early if the guest halts. Each run starts
+// from the savestate with an empty trace cache, so the time includes decoding.
+//
+// Build from the project's root directory, with the same flags as the emulator you want to measure:
+//  gcc -O3 -std=c99 -DCPU_BENCH -Iinclude -o cpubench tools/cpubench.c tools/cpustubs.c src/state.c $(ls src/cpu/*.c src/cpu/ops/*.c | grep -v libcpu) -lm
+// Add -DDYNAREC to measure the dynamic recompiler as well.
+// Usage:
+//  ./cpubench [millions of instructions per kernel]
+//  ./cpubench -r savestates/halfix_record [millions of instructions]
+
+#define _GNU_SOURCE // For clock_gettime
+#include "cpu/cpu.h"
+#include "cpuapi.h"
+#include "devices.h"
+#include "io.h"
+#include "record.h"
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define CODE_ADDR 0x1000
+#define STACK_ADDR 0x80000
+#define MEMORY_SIZE (1024 * 1024)
+#define BENCH_RUNS 5
+
+struct kernel {
+    const char* name;
+    // Instructions that one iteration of the loop runs, and the number of them that start a fused pair
+    int insns, pairs;
+    int length;
+    uint8_t code[32];
+    // If set, the code is copied this many times and followed by a jump back to the start
+    int repeat;
+};
+
+static const struct kernel kernels[] = {
+    { "dec r32; jnz", 4, 1, 7, {
+                                   0x01, 0xC8, // add eax, ecx
+                                   0x31, 0xC3, // xor ebx, eax
+                                   0x4E, // dec esi
+                                   0x75, 0xF9, // jnz 0
+                               },
+        0 },
+    { "straight-line code", 6, 0, 11, {
+                                          0x01, 0xD8, // add eax, ebx
+                                          0x31, 0xC1, // xor ecx, eax
+                                          0x89, 0xCA, // mov edx, ecx
+                                          0x46, // inc esi
+                                          0x39, 0xFE, // cmp esi, edi
+                                          0x74, 0x00, // jz 11
+                                      },
+        16384 },
+};
+
+// Flat 32-bit protected mode, with paging off and the code at CODE_ADDR
+static void bench_setup(const struct kernel* k)
+{
+    cpu_reset();
+    uint8_t* mem = cpu.mem;
+    uint32_t addr = CODE_ADDR;
+    for (int r = 0; r < (k->repeat ? k->repeat : 1); r++) {
+        // Traces that cross a page aren't cached, so keep every copy within a page and jump over the gaps
+        if ((addr & 4095) + k->length > 4096 - 2) {
+            uint32_t next = (addr | 4095) + 1;
+            mem[addr] = 0xEB; // jmp next
+            mem[addr + 1] = next - (addr + 2);
+            addr = next;
+        }
+        memcpy(mem + addr, k->code, k->length);
+        addr += k->length;
+    }
+    mem[addr] = 0xE9; // jmp CODE_ADDR
+    *(uint32_t*)(mem + addr + 1) = CODE_ADDR - (addr + 5);
+
+    cpu_prot_set_cr(0, cpu.cr[0] | CR0_PE);
+    for (int i = 0; i < 6; i++) {
+        cpu.seg_base[i] = 0;
+        cpu.seg_limit[i] = -1;
+    }
+    cpu.esp_mask = -1;
+    cpu.state_hash = 0;
+    cpu_trace_select_partition();
+
+    memset(cpu.reg32, 0, sizeof(cpu.reg32));
+    cpu.reg32[EBX] = 1;
+    cpu.reg32[EDX] = -1;
+    cpu.reg32[ESP] = STACK_ADDR;
+    cpu.phys_eip = CODE_ADDR;
+    cpu.eip_phys_bias = 0;
+    cpu.last_phys_eip = CODE_ADDR ^ 0x1000; // Makes cpu_get_trace look up the physical address
+}
+
+// Returns the best of a few runs, since the machine running the benchmark is rarely completely idle
+static double bench_run(const struct kernel* k, int fusion, uint64_t insns)
+{
+    double best = 0;
+    cpu_set_fusion(fusion);
+    bench_setup(k);
+    cpu_run(k->repeat * k->insns * 2 + 100000); // Decode everything before the clock starts
+
+    cpu_reset_cache_stats();
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        struct timespec start, end;
+        uint64_t done = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (done < insns / BENCH_RUNS)
+            done += cpu_run(1000000);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / done;
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+
+    // Decoding isn't what we want to measure. If this shows up, the trace cache is too small for the kernel
+    struct cpu_cache_stats stats;
+    cpu_get_cache_stats(&stats);
+    if (stats.trace_misses * 100 > stats.trace_hits)
+        printf("%s: %llu trace cache misses while timing\n", k->name, (unsigned long long)stats.trace_misses);
+    return best;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The events that src/record.c wrote, and how far the replay has got through them
+static struct replay_event {
+    struct record_event e;
+    uint8_t* bytes; // For RECORD_DMA
+    int next_async; // Index of the first event at or after this one that isn't a read
+} * events;
+static int event_count, cursor, diverged, apic_enabled;
+
+static int is_async(int type)
+{
+    return type != RECORD_IO_READ && type != RECORD_MMIO_READ;
+}
+
+static int load_events(char* path)
+{
+    char name[1000];
+    sprintf(name, "%s/events", path);
+    FILE* f = fopen(name, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", name);
+        return 1;
+    }
+    struct record_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != RECORD_MAGIC) {
+        fprintf(stderr, "%s is not a recording\n", name);
+        return 1;
+    }
+    apic_enabled = header.apic_enabled;
+
+    int size = 0;
+    struct record_event e;
+    // The emulator was probably killed while it was writing, so the last event may be cut short
+    while (fread(&e, sizeof(e), 1, f) == 1) {
+        uint8_t* bytes = NULL;
+        if (e.type == RECORD_DMA) {
+            bytes = malloc(e.data);
+            if (fread(bytes, e.data, 1, f) != 1)
+                break;
+        }
+        if (event_count == size)
+            events = realloc(events, (size = size * 2 + 1024) * sizeof(struct replay_event));
+        events[event_count].e = e;
+        events[event_count++].bytes = bytes;
+    }
+    fclose(f);
+
+    int next = event_count;
+    for (int i = event_count - 1; i >= 0; i--) {
+        if (is_async(events[i].e.type))
+            next = i;
+        events[i].next_async = next;
+    }
+    return 0;
+}
+
+// Stops the replay as soon as the CPU does something that it didn't do in the recording
+static void diverge(void)
+{
+    if (!diverged) {
+        diverged = 1;
+        cpu_cancel_execution_cycle(EXIT_STATUS_NORMAL);
+    }
+}
+
+// Writes that devices made to RAM and changes to the A20 gate, up to the current instruction
+static void replay_async(void)
+{
+    uint64_t cycles = cpu_get_cycles();
+    for (; cursor < event_count && events[cursor].e.cycles <= cycles; cursor++) {
+        struct record_event* e = &events[cursor].e;
+        if (e->type == RECORD_DMA) {
+            for (uint32_t page = e->addr >> 12; page <= (e->addr + e->data - 1) >> 12; page++)
+                cpu_init_dma(page << 12);
+            cpu_write_mem(e->addr, events[cursor].bytes, e->data);
+        } else if (e->type == RECORD_A20)
+            cpu_set_a20(e->data);
+        else
+            break;
+    }
+}
+
+static uint32_t replay_read(int type, uint32_t addr, int size)
+{
+    if (!events)
+        return type == RECORD_MMIO_READ ? -1 : 0;
+    replay_async();
+    struct record_event* e = &events[cursor].e;
+    if (diverged || cursor == event_count || e->type != type || e->addr != addr || e->size != size
+        || e->cycles != cpu_get_cycles() || e->phys_eip != cpu.phys_eip) {
+        diverge();
+        return 0;
+    }
+    cursor++;
+    return e->data;
+}
+
+uint8_t io_readb(uint32_t port)
+{
+    return replay_read(RECORD_IO_READ, port, 1);
+}
+uint16_t io_readw(uint32_t port)
+{
+    return replay_read(RECORD_IO_READ, port, 2);
+}
+uint32_t io_readd(uint32_t port)
+{
+    return replay_read(RECORD_IO_READ, port, 4);
+}
+uint32_t io_handle_mmio_read(uint32_t addr, int size)
+{
+    return replay_read(RECORD_MMIO_READ, addr, size);
+}
+uint8_t pic_get_interrupt(void)
+{
+    // replay() raises the line right when the next event is an interrupt
+    cpu_lower_intr_line();
+    if (cursor == event_count || events[cursor].e.type != RECORD_INTERRUPT) {
+        diverge();
+        return 0;
+    }
+    return events[cursor++].e.data;
+}
+int apic_is_enabled(void)
+{
+    return apic_enabled;
+}
+
+// Runs the guest code in a recording, starting over from the savestate every time. Returns the number of instructions
+// that came out the same as in the recording.
+static uint64_t replay_once(char* path, uint64_t insns)
+{
+    state_read_from_file(path);
+    cpu_lower_intr_line(); // Interrupts come from the recording
+    cursor = diverged = 0;
+    uint64_t start = cpu_get_cycles(), cycles = start;
+    while (!diverged && cycles - start < insns) {
+        replay_async();
+        if (cursor < event_count && events[cursor].e.cycles < cycles)
+            break; // An interrupt that should have been taken already
+        int next = cursor < event_count ? events[cursor].next_async : event_count;
+        uint64_t chunk = 1000000;
+        if (next < event_count) {
+            if (events[next].e.cycles == cycles && events[next].e.type == RECORD_INTERRUPT && next == cursor)
+                cpu_raise_intr_line();
+            else if (events[next].e.cycles - cycles < chunk)
+                chunk = events[next].e.cycles - cycles;
+        }
+        if (chunk > insns - (cycles - start))
+            chunk = insns - (cycles - start);
+        cpu_run(chunk ? chunk : 1);
+        uint64_t after = cpu_get_cycles();
+        // A halted CPU waits for an interrupt, which has to come at the same instruction count
+        if (after == cycles && cpu_get_exit_reason() == EXIT_STATUS_HLT && !cpu.intr_line_state
+            && (cursor == event_count || events[cursor].e.cycles != cycles))
+            break;
+        cycles = after;
+    }
+    return cycles - start;
+}
+
+static int replay(char* path, uint64_t insns)
+{
+    char ram[1000];
+    struct stat st;
+    sprintf(ram, "%s/ram", path);
+    if (stat(ram, &st)) {
+        fprintf(stderr, "Cannot find %s\n", ram);
+        return 1;
+    }
+    if (load_events(path) || cpu_init_mem(st.st_size) || cpu_init())
+        return 1;
+
+    double best = 0;
+    uint64_t done = 0;
+    struct cpu_cache_stats stats;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        cpu_reset_cache_stats();
+        double start = now();
+        done = replay_once(path, insns);
+        double ns = (now() - start) / done;
+        if (run == 0 || ns < best)
+            best = ns;
+        cpu_get_cache_stats(&stats);
+    }
+
+    printf("struct decoded_instruction: %d bytes\n", (int)sizeof(struct decoded_instruction));
+    printf("%s: %llu instructions, %.3f ns/insn\n", path, (unsigned long long)done, best);
+    if (done < insns)
+        printf("replay stopped %s at event %d of %d\n", diverged ? "following the recording" : "early", cursor,
+            event_count);
+    printf("trace lookups: %llu, of which %llu through links, %llu decoded\n",
+        (unsigned long long)(stats.trace_hits + stats.trace_misses), (unsigned long long)stats.trace_link_hits,
+        (unsigned long long)stats.trace_misses);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2 && !strcmp(argv[1], "-r"))
+        return replay(argv[2], (argc > 3 ? atoi(argv[3]) : 100) * 1000000ULL);
+
+    uint64_t insns = (argc > 1 ? atoi(argv[1]) : 100) * 1000000ULL;
+    if (cpu_init_mem(MEMORY_SIZE) || cpu_init())
+        return 1;
+    cpu_set_a20(1); // Normally done by the chipset
+
+    printf("struct decoded_instruction: %d bytes\n", (int)sizeof(struct decoded_instruction));
+    printf("%-24s %12s %12s %12s %8s\n", "kernel", "dispatches", "unfused", "fused", "speedup");
+    printf("%-24s %12s %12s %12s\n", "", "per iter", "ns/insn", "ns/insn");
+    for (unsigned int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        const struct kernel* k = &kernels[i];
+        double unfused = bench_run(k, 0, insns), fused = bench_run(k, 1, insns);
+        char dispatches[32];
+        sprintf(dispatches, "%d -> %d", k->insns, k->insns - k->pairs);
+        printf("%-24s %12s %12.3f %12.3f %7.2fx\n", k->name, dispatches, unfused, fused, unfused / fused);
+    }
+    return 0;
+}
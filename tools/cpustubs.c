@@ -0,0 +1,98 @@
+// Stand-ins for the parts of the emulator that the CPU core calls into, so that tools can link against src/cpu on its own.
+// None of them do anything useful.
+
+#include "cpuapi.h"
+#include "devices.h"
+#include "io.h"
+#include "state.h"
+#include "util.h"
+#include <stdlib.h>
+
+#ifndef CPU_BENCH // tools/cpubench.c has its own, which play back what the devices did in a recording
+uint8_t io_readb(uint32_t port)
+{
+    return port & 0;
+}
+uint16_t io_readw(uint32_t port)
+{
+    return port & 0;
+}
+uint32_t io_readd(uint32_t port)
+{
+    return port & 0;
+}
+uint32_t io_handle_mmio_read(uint32_t addr, int size)
+{
+    UNUSED(addr | size);
+    return -1;
+}
+uint8_t pic_get_interrupt(void)
+{
+    return -1;
+}
+int apic_is_enabled(void)
+{
+    return 0;
+}
+#endif
+void io_writeb(uint32_t port, uint8_t data)
+{
+    UNUSED(port | data);
+}
+void io_writew(uint32_t port, uint16_t data)
+{
+    UNUSED(port | data);
+}
+void io_writed(uint32_t port, uint32_t data)
+{
+    UNUSED(port | data);
+}
+void io_handle_mmio_write(uint32_t addr, uint32_t data, int size)
+{
+    UNUSED(addr | data | size);
+}
+void io_register_reset(io_reset cb)
+{
+    cb();
+}
+void pic_raise_irq(int line)
+{
+    UNUSED(line);
+}
+void pic_lower_irq(int line)
+{
+    UNUSED(line);
+}
+#ifndef CPU_BENCH // tools/cpubench.c links against src/state.c so that it can load savestates
+void state_register(state_handler s)
+{
+    UNUSED(s);
+}
+struct bjson_object* state_obj(char* name, int keyvalues)
+{
+    UNUSED(name);
+    UNUSED(keyvalues);
+    return NULL;
+}
+void state_field(struct bjson_object* obj, int length, char* name, void* ptr)
+{
+    UNUSED(obj);
+    UNUSED(length);
+    UNUSED(name);
+    UNUSED(ptr);
+}
+void state_file(int size, char* name, void* ptr)
+{
+    UNUSED(size);
+    UNUSED(name);
+    UNUSED(ptr);
+}
+int state_is_reading(void)
+{
+    return 0;
+}
+#endif
+void util_abort(void)
+{
+    abort();
+}
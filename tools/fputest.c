@@ -0,0 +1,88 @@
+// Differential test for the x87 fast path in src/cpu/fpu.c (see cpu_set_fpu_fast_mode). Runs FADD, FSUB, FMUL, FDIV and
+// FSQRT on random operands in 24 and 53-bit precision, once on the host and once with softfloat, and checks that the
+// results and the status words match. That includes C1, which is set when a result was rounded away from zero.
+//
+// Build from the project's root directory:
+//  gcc -O2 -std=c99 -Iinclude -o fputest tools/fputest.c tools/cpustubs.c $(ls src/cpu/*.c src/cpu/ops/*.c | grep -v -e libcpu -e fpu.c) -lm
+// Usage:
+//  ./fputest [iterations]
+
+// The operations are static, so the whole file is compiled in here
+#include "../src/cpu/fpu.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint64_t random_state = 88172645463325252ULL;
+static uint64_t random64(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// A normal number whose mantissa fits in the given precision, with an exponent around zero so that most operations
+// stay in the range of the host format
+static floatx80 random_operand(int precision)
+{
+    floatx80 result;
+    uint64_t bits = random64();
+    result.exp = (bits >> 63) << 15 | (16383 + (int)(bits >> 56 & 63) - 32);
+    result.fraction = (1ULL << 63 | random64() >> 1) & ~((1ULL << (64 - precision)) - 1);
+    return result;
+}
+
+// Runs an operation (the low three bits of the opcode, or -1 for FSQRT) and returns the result and the status word
+static floatx80 run(int op, floatx80 a, floatx80 b, int fast, uint16_t* status_word)
+{
+    cpu_set_fpu_fast_mode(fast);
+    fpu.status.float_exception_flags = 0;
+    fpu.status_word = 0;
+    floatx80 result = op < 0 ? fpu_sqrt(a) : fpu_arith(op, a, b);
+    fpu_check_exceptions();
+    *status_word = fpu.status_word;
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* names[8] = { "fadd", "fmul", NULL, NULL, "fsub", "fsubr", "fdiv", "fdivr" };
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000, failures = 0, rounded_up = 0, rounded_down = 0;
+
+    for (int it = 0; it < iterations; it++) {
+        int precision = it & 1 ? 53 : 24, op = (int)(random64() % 9) - 1;
+        if (op == 2 || op == 3)
+            continue; // FCOM and FCOMP
+        // The x87 is set up the way that Windows leaves it: all exceptions masked, rounding to nearest
+        fpu_set_control_word(precision == 24 ? 0x007F : 0x027F);
+        floatx80 a = random_operand(precision), b = random_operand(precision);
+        if (op < 0)
+            a.exp &= 0x7FFF; // Square roots of positive numbers only
+
+        uint16_t sw_fast, sw_soft;
+        uint64_t fast_before = 0, fast_after = 0;
+        for (int i = 0; i < FPU_STAT_OPS; i++)
+            fast_before += fpu_stats.fast[i];
+        floatx80 fast = run(op, a, b, 1, &sw_fast);
+        for (int i = 0; i < FPU_STAT_OPS; i++)
+            fast_after += fpu_stats.fast[i];
+        floatx80 soft = run(op, a, b, 0, &sw_soft);
+        if (fast_after == fast_before)
+            continue; // The fast path gave up, so both results came from softfloat
+
+        if (sw_fast & (1 << 9))
+            rounded_up++;
+        else if (sw_fast & FPU_EXCEPTION_PRECISION)
+            rounded_down++;
+        if (fast.exp != soft.exp || fast.fraction != soft.fraction || sw_fast != sw_soft) {
+            if (failures++ < 20)
+                printf("%s/%d %04x:%016llx %04x:%016llx: host %04x:%016llx sw=%04x, softfloat %04x:%016llx sw=%04x\n",
+                    op < 0 ? "fsqrt" : names[op], precision, a.exp, (unsigned long long)a.fraction, b.exp,
+                    (unsigned long long)b.fraction, fast.exp, (unsigned long long)fast.fraction, sw_fast, soft.exp,
+                    (unsigned long long)soft.fraction, sw_soft);
+        }
+    }
+
+    printf("%d mismatches, %d results rounded up, %d rounded down\n", failures, rounded_up, rounded_down);
+    return failures != 0;
+}
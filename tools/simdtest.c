@@ -0,0 +1,173 @@
+// Differential test for the packed integer helpers in src/cpu/ops/simd.c. Runs every helper on random operands and
+// prints a checksum of the results for each one. The host intrinsics and the scalar reference have to agree, so build
+// the test both ways and compare the output.
+//
+// Build from the project's root directory:
+//  SRC="tools/cpustubs.c $(ls src/cpu/*.c src/cpu/ops/*.c | grep -v -e libcpu -e simd.c)"
+//  gcc -O2 -std=c99 -Iinclude -o simdtest tools/simdtest.c $SRC -lm
+//  gcc -O2 -std=c99 -Iinclude -DSIMD_SCALAR -o simdtest-scalar tools/simdtest.c $SRC -lm
+//  diff <(./simdtest) <(./simdtest-scalar) && echo OK
+// Add -mssse3 to the first build to test pabs and pshufb as well. Pass -v to print every operand and result, which
+// makes the diff point at the exact input that differs.
+// Usage:
+//  ./simdtest [-v] [iterations]
+
+// The helpers are static, so the whole file is compiled in here
+#include "../src/cpu/ops/simd.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_RESULTS 128
+
+static struct {
+    const char* name;
+    int size;
+    uint64_t hash;
+} results[MAX_RESULTS];
+static int result_count, slot, verbose;
+
+static uint64_t random_state = 88172645463325252ULL;
+static uint8_t random_byte(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state >> 24;
+}
+
+static void print_bytes(const uint8_t* x)
+{
+    for (int i = 15; i >= 0; i--)
+        printf("%02x", x[i]);
+}
+
+static void record(const char* name, int size, const uint8_t* d, const uint8_t* s, const uint8_t* result)
+{
+    if (slot == result_count) {
+        if (result_count == MAX_RESULTS) {
+            fprintf(stderr, "Too many helpers, increase MAX_RESULTS\n");
+            exit(1);
+        }
+        results[result_count].name = name;
+        results[result_count].size = size;
+        results[result_count++].hash = 1469598103934665603ULL;
+    }
+    for (int i = 0; i < 16; i++)
+        results[slot].hash = (results[slot].hash ^ result[i]) * 1099511628211ULL; // FNV-1a
+    slot++;
+
+    if (verbose) {
+        printf("%s/%d ", name, size);
+        print_bytes(d);
+        printf(" ");
+        print_bytes(s);
+        printf(" -> ");
+        print_bytes(result);
+        printf("\n");
+    }
+}
+
+// Operands are random, but with plenty of the values that the saturating and signed operations treat specially
+static void random_operands(uint8_t* d, uint8_t* s, int iteration)
+{
+    static const uint8_t edges[] = { 0x00, 0x01, 0x7F, 0x80, 0x81, 0xFF };
+    for (int i = 0; i < 16; i++) {
+        d[i] = random_byte();
+        s[i] = random_byte();
+        if (iteration & 1 && (random_byte() & 3) == 0)
+            s[i] = d[i];
+        if (iteration & 2)
+            d[i] |= 0x80;
+        if (iteration & 4)
+            s[i] = edges[random_byte() % sizeof(edges)];
+    }
+}
+
+// Runs one helper on a copy of the destination operand. Passing d as the source tests both operands being the same
+#define TEST(name, call)                 \
+    do {                                 \
+        memcpy(e, d, 16);                \
+        call;                            \
+        record(name, size, d, s, e);     \
+    } while (0)
+#define TEST2(fn, count) TEST(#fn, fn((void*)e, (void*)s, size / (count)))
+#define TEST_SAME(fn, count) TEST(#fn " same", fn((void*)e, (void*)e, size / (count)))
+
+int main(int argc, char** argv)
+{
+    int iterations = 20000;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-v"))
+            verbose = 1;
+        else
+            iterations = atoi(argv[i]);
+    }
+
+    for (int it = 0; it < iterations; it++) {
+        uint8_t d[16], s[16], e[16];
+        random_operands(d, s, it);
+        slot = 0;
+        // MMX registers are 8 bytes wide and XMM registers are 16
+        for (int size = 8; size <= 16; size += 8) {
+            TEST2(paddb, 1);
+            TEST2(paddw, 2);
+            TEST2(paddd, 4);
+            TEST2(psubb, 1);
+            TEST2(psubw, 2);
+            TEST2(psubd, 4);
+            TEST2(psubq, 8);
+            TEST_SAME(paddb, 1);
+            TEST_SAME(psubb, 1);
+            TEST_SAME(psubq, 8);
+            TEST2(paddsb, 1);
+            TEST2(paddsw, 2);
+            TEST2(psubsb, 1);
+            TEST2(psubsw, 2);
+            TEST2(paddusb, 1);
+            TEST2(paddusw, 2);
+            TEST2(psubusb, 1);
+            TEST2(psubusw, 2);
+            TEST2(pminub, 1);
+            TEST2(pmaxub, 1);
+            TEST2(pminsw, 2);
+            TEST2(pmaxsw, 2);
+            TEST2(pcmpeqb, 1);
+            TEST2(pcmpeqw, 2);
+            TEST2(pcmpeqd, 4);
+            TEST2(pcmpgtb, 1);
+            TEST2(pcmpgtw, 2);
+            TEST2(pcmpgtd, 4);
+            TEST2(pavgb, 1);
+            TEST2(pavgw, 2);
+            TEST2(pmaddwd, 4);
+            TEST2(psadbw, 8);
+            TEST2(pmuludq, 4);
+            TEST("pmullw", pmullw((void*)e, (void*)s, size / 2, 0));
+            TEST("pmulhw", pmullw((void*)e, (void*)s, size / 2, 16));
+            TEST("pmulhuw", pmuluw(e, s, size / 2, 16));
+            TEST2(packuswb, 2);
+            TEST2(packsswb, 2);
+            TEST2(packssdw, 4);
+            TEST2(pabsb, 1);
+            TEST2(pabsw, 2);
+            TEST2(pabsd, 4);
+            TEST2(pshufb, 1);
+            for (int copysize = 1; copysize <= 8 && copysize < size; copysize *= 2) {
+                TEST("punpckl", punpckl(e, s, size, copysize));
+                TEST("punpckh", punpckh(e, s, size, copysize));
+            }
+            int mask = pmovmskb(d, size);
+            memset(e, 0, 16);
+            memcpy(e, &mask, sizeof(mask));
+            record("pmovmskb", size, d, s, e);
+        }
+    }
+
+    if (!verbose) {
+        for (int i = 0; i < result_count; i++) {
+            // punpckl/punpckh run once for every element size, so they take up several slots with the same name
+            printf("%-16s %2d %016llx\n", results[i].name, results[i].size, (unsigned long long)results[i].hash);
+        }
+    }
+    return 0;
+}